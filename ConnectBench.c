@@ -0,0 +1,507 @@
+// ConnectBench: drives connect/send/recv/close loops through the wrapper builds against SocksStandIn and
+// reports connects per second, connect() latency percentiles and system calls per connect. With the
+// --max-*/--min-* limits it exits non-zero on a regression, so it can gate performance changes.
+//     for f in 1 ConnetcInterceptionOnly ConnectWithDNSInterception; do
+//         gcc -O2 -shared -fPIC -o $f.so $f.c -ldl -lpthread; done
+//     gcc -O2 -Wall -o SocksStandIn SocksStandIn.c -lm && gcc -O2 -Wall -o ConnectBench ConnectBench.c -lpthread
+//     ./ConnectBench --delay exp:1 --fail 0.01:0x04 --threads 4 --seconds 5
+// Options:
+//     --lib PATH          Wrapper to measure; repeatable (default ./1.so ./ConnetcInterceptionOnly.so
+//                         ./ConnectWithDNSInterception.so)
+//     --server PATH       SocksStandIn binary (default ./SocksStandIn); --no-server uses one already running
+//     --port N            SocksPort of the stand-in (default 19050)
+//     --delay SPEC, --fail RATE[:CODE]  Passed on to SocksStandIn
+//     --threads N         Connecting threads (default 1)
+//     --seconds N         Measured time per wrapper (default 3), after --warmup N connects per thread (default 50)
+//     --payload N         Bytes sent and echoed back per connection (default 64)
+//     --nonblock          Non-blocking connect() completed with poll(), instead of a blocking one
+//     --verbose           Keep the wrappers' messages (failed requests are only counted otherwise)
+//     --syscalls N        Connects traced with ptrace to count system calls (default 200, 0 = skip)
+//     --max-p99 US, --max-p999 US, --min-cps N, --max-syscalls N   Regression limits
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ptrace.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define BENCH_TARGET "198.51.100.7" // TEST-NET-2: never reachable directly, so only a working wrapper connects
+#define BENCH_TARGET_PORT 80
+#define BENCH_LIBS_MAX 16
+
+static const char *libs[BENCH_LIBS_MAX];
+static int lib_count = 0;
+static const char *server_path = "./SocksStandIn";
+static const char *server_args[64];
+static int server_argc = 0;
+static int use_server = 1;
+static int port = 19050;
+static int threads = 1;
+static double seconds = 3;
+static int warmup = 50;
+static size_t payload = 64;
+static int nonblock = 0;
+static int verbose = 0;
+static int syscall_connects = 200;
+static double max_p99 = 0, max_p999 = 0, min_cps = 0, max_syscalls = 0;
+
+struct worker {
+    pthread_t thread;
+    uint32_t *latency_us; // connect() latency of every measured connect
+    size_t count, capacity;
+    unsigned long errors;
+};
+
+static volatile int measuring_done = 0;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * @brief One iteration: socket, connect through the wrapper, send the payload, read the echo, close.
+ * @param latency_ns Receives the time spent in connect() (and the poll() completing it).
+ * @return 0 on success, -1 on failure.
+ */
+static int bench_once(uint64_t *latency_ns) {
+    static const char fill[4096];
+    struct sockaddr_in target;
+    char echo[4096];
+    size_t left;
+    uint64_t start;
+    int result = -1;
+    int fd;
+
+    memset(&target, 0, sizeof(target));
+    target.sin_family = AF_INET;
+    target.sin_port = htons(BENCH_TARGET_PORT);
+    inet_pton(AF_INET, BENCH_TARGET, &target.sin_addr);
+
+    fd = socket(AF_INET, SOCK_STREAM | (nonblock ? SOCK_NONBLOCK : 0), 0);
+    if (fd < 0) {
+        return -1;
+    }
+    start = now_ns();
+    if (connect(fd, (struct sockaddr *)&target, sizeof(target)) < 0) {
+        struct pollfd pfd = {fd, POLLOUT, 0};
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (!nonblock || errno != EINPROGRESS || poll(&pfd, 1, 30000) != 1 ||
+            getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+            close(fd);
+            return -1;
+        }
+    }
+    *latency_ns = now_ns() - start;
+    if (nonblock) {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    }
+
+    for (left = payload; left > 0;) {
+        size_t chunk = left < sizeof(fill) ? left : sizeof(fill);
+        ssize_t n = send(fd, fill, chunk, MSG_NOSIGNAL);
+        if (n <= 0) {
+            goto out;
+        }
+        left -= (size_t)n;
+    }
+    for (left = payload; left > 0;) {
+        ssize_t n = recv(fd, echo, left < sizeof(echo) ? left : sizeof(echo), 0);
+        if (n <= 0) {
+            goto out;
+        }
+        left -= (size_t)n;
+    }
+    result = 0;
+out:
+    close(fd);
+    return result;
+}
+
+static void *worker_main(void *arg) {
+    struct worker *w = arg;
+    uint64_t latency;
+    int i;
+
+    for (i = 0; i < warmup; i++) {
+        bench_once(&latency);
+    }
+    while (!__atomic_load_n(&measuring_done, __ATOMIC_ACQUIRE)) {
+        if (bench_once(&latency) < 0) {
+            w->errors++;
+            continue;
+        }
+        if (w->count == w->capacity) {
+            w->capacity = w->capacity ? w->capacity * 2 : 65536;
+            w->latency_us = realloc(w->latency_us, w->capacity * sizeof(*w->latency_us));
+            if (!w->latency_us) {
+                fprintf(stderr, "ConnectBench: out of memory\n");
+                exit(1);
+            }
+        }
+        w->latency_us[w->count++] = (uint32_t)(latency / 1000);
+    }
+    return NULL;
+}
+
+static int compare_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * @brief Counts the system calls of syscall_connects iterations on a ptrace()d copy of this process.
+ * Only the connecting thread is traced: the wrappers' helper threads work off the critical path.
+ * @return System calls per connect, or -1 if ptrace() is not available.
+ */
+static double count_syscalls(void) {
+    unsigned long calls = 0;
+    int counting = 0, in_call = 0;
+    int status;
+    pid_t child;
+
+    if (syscall_connects <= 0) {
+        return -1;
+    }
+    child = fork();
+    if (child < 0) {
+        return -1;
+    }
+    if (child == 0) {
+        uint64_t latency;
+        int i;
+        alarm(60);
+        if (ptrace(PTRACE_TRACEME, 0, NULL, NULL) < 0) {
+            _exit(1);
+        }
+        raise(SIGSTOP);
+        for (i = 0; i < warmup; i++) {
+            bench_once(&latency);
+        }
+        raise(SIGUSR1); // Start counting
+        for (i = 0; i < syscall_connects; i++) {
+            bench_once(&latency);
+        }
+        raise(SIGUSR2); // Stop counting
+        _exit(0);
+    }
+    if (waitpid(child, &status, 0) < 0 || !WIFSTOPPED(status)) {
+        return -1;
+    }
+    ptrace(PTRACE_SETOPTIONS, child, NULL, (void *)(long)(PTRACE_O_TRACESYSGOOD | PTRACE_O_EXITKILL));
+    ptrace(PTRACE_SYSCALL, child, NULL, NULL);
+    for (;;) {
+        int sig = 0;
+        if (waitpid(child, &status, 0) < 0 || WIFEXITED(status) || WIFSIGNALED(status)) {
+            break;
+        }
+        if (WSTOPSIG(status) == (SIGTRAP | 0x80)) {
+            in_call = !in_call;
+            if (in_call && counting) {
+                calls++;
+            }
+        } else if (WSTOPSIG(status) == SIGUSR1) {
+            counting = 1;
+        } else if (WSTOPSIG(status) == SIGUSR2) {
+            counting = 0;
+            calls--; // The tgkill() raising SIGUSR2
+        } else {
+            sig = WSTOPSIG(status);
+        }
+        ptrace(PTRACE_SYSCALL, child, NULL, (void *)(long)sig);
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        return -1;
+    }
+    return (double)calls / syscall_connects;
+}
+
+/**
+ * @brief Measures the wrapper preloaded into this process and prints one RESULT line.
+ */
+static int run_child(const char *lib) {
+    struct worker *workers = calloc((size_t)threads, sizeof(*workers));
+    uint32_t *all;
+    size_t total = 0, at = 0;
+    unsigned long errors = 0;
+    uint64_t start, elapsed;
+    double syscalls;
+    int i;
+
+    if (!workers) {
+        return 1;
+    }
+    // A wrapper that hangs fails the run instead of stalling the gate
+    alarm((unsigned int)seconds + 120);
+    syscalls = count_syscalls();
+
+    start = now_ns();
+    for (i = 0; i < threads; i++) {
+        pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]);
+    }
+    usleep((useconds_t)(seconds * 1e6));
+    __atomic_store_n(&measuring_done, 1, __ATOMIC_RELEASE);
+    for (i = 0; i < threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        total += workers[i].count;
+        errors += workers[i].errors;
+    }
+    elapsed = now_ns() - start;
+
+    all = malloc((total ? total : 1) * sizeof(*all));
+    if (!all) {
+        return 1;
+    }
+    for (i = 0; i < threads; i++) {
+        memcpy(all + at, workers[i].latency_us, workers[i].count * sizeof(*all));
+        at += workers[i].count;
+    }
+    qsort(all, total, sizeof(*all), compare_u32);
+    if (total == 0) {
+        printf("RESULT %s 0 0 0 0 %.2f %lu\n", lib, syscalls, errors);
+        return 0;
+    }
+    printf("RESULT %s %.1f %u %u %u %.2f %lu\n", lib, (double)total / ((double)elapsed / 1e9),
+           all[total / 2], all[(size_t)((double)total * 0.99)], all[(size_t)((double)total * 0.999)], syscalls, errors);
+    return 0;
+}
+
+/**
+ * @brief Starts SocksStandIn and waits until its port accepts connections.
+ * @return Its pid, or -1.
+ */
+static pid_t start_server(void) {
+    char port_arg[16];
+    const char *argv[80];
+    struct sockaddr_in addr;
+    pid_t pid;
+    int argc = 0;
+    int i;
+
+    snprintf(port_arg, sizeof(port_arg), "%d", port);
+    argv[argc++] = server_path;
+    argv[argc++] = "--port";
+    argv[argc++] = port_arg;
+    for (i = 0; i < server_argc; i++) {
+        argv[argc++] = server_args[i];
+    }
+    argv[argc] = NULL;
+    pid = fork();
+    if (pid == 0) {
+        execv(server_path, (char **)argv);
+        fprintf(stderr, "ConnectBench: %s: %s\n", server_path, strerror(errno));
+        _exit(127);
+    }
+    if (pid < 0) {
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    for (i = 0; i < 200; i++) {
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int ok = connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+        close(fd);
+        if (ok) {
+            return pid;
+        }
+        if (waitpid(pid, NULL, WNOHANG) == pid) {
+            return -1;
+        }
+        usleep(10000);
+    }
+    kill(pid, SIGTERM);
+    return -1;
+}
+
+/**
+ * @brief Runs this program again with the wrapper preloaded and reads back its RESULT line.
+ */
+static int run_lib(char **argv, const char *lib, char *result, size_t result_size) {
+    char port_env[16];
+    int pipefd[2];
+    FILE *out;
+    pid_t pid;
+    int status;
+    int found = 0;
+
+    if (pipe(pipefd) < 0) {
+        return -1;
+    }
+    pid = fork();
+    if (pid == 0) {
+        dup2(pipefd[1], STDOUT_FILENO);
+        if (!verbose) {
+            int null_fd = open("/dev/null", O_WRONLY);
+            dup2(null_fd, STDERR_FILENO);
+        }
+        close(pipefd[0]);
+        close(pipefd[1]);
+        snprintf(port_env, sizeof(port_env), "%d", port);
+        // Only the stand-in's SocksPort: no configuration file, no SocksPorts list
+        setenv("TORSOCKS_CONF_FILE", "/dev/null", 1);
+        setenv("TORSOCKS_TOR_ADDRESS", "127.0.0.1", 1);
+        setenv("TORSOCKS_TOR_PORT", port_env, 1);
+        setenv("TORSOCKS_SOCKS_PORTS", "", 1);
+        // Every connect goes to the same target and --fail refuses at random: one refusal must not
+        // turn the following connects into negative cache hits
+        setenv("TORSOCKS_NEGATIVE_CACHE_MS", "0", 1);
+        setenv("LD_PRELOAD", lib, 1);
+        setenv("CONNECTBENCH_CHILD", lib, 1);
+        execv("/proc/self/exe", argv);
+        _exit(127);
+    }
+    close(pipefd[1]);
+    out = fdopen(pipefd[0], "r");
+    while (out && fgets(result, (int)result_size, out)) {
+        if (strncmp(result, "RESULT ", 7) == 0) {
+            found = 1;
+            break;
+        }
+    }
+    if (out) {
+        fclose(out);
+    }
+    waitpid(pid, &status, 0);
+    return found ? 0 : -1;
+}
+
+static void usage(const char *self) {
+    fprintf(stderr, "usage: %s [--lib PATH]... [--server PATH | --no-server] [--port N] [--delay SPEC] "
+                    "[--fail RATE[:CODE]]... [--threads N] [--seconds N] [--warmup N] [--payload N] [--nonblock] [--verbose] "
+                    "[--syscalls N] [--max-p99 US] [--max-p999 US] [--min-cps N] [--max-syscalls N]\n", self);
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    const char *child_lib;
+    int failed = 0;
+    pid_t server = -1;
+    int i;
+
+    for (i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (strcmp(arg, "--nonblock") == 0) {
+            nonblock = 1;
+            continue;
+        }
+        if (strcmp(arg, "--verbose") == 0) {
+            verbose = 1;
+            continue;
+        }
+        if (strcmp(arg, "--no-server") == 0) {
+            use_server = 0;
+            continue;
+        }
+        if (!value) {
+            usage(argv[0]);
+        }
+        i++;
+        if (strcmp(arg, "--lib") == 0 && lib_count < BENCH_LIBS_MAX) {
+            libs[lib_count++] = value;
+        } else if (strcmp(arg, "--server") == 0) {
+            server_path = value;
+        } else if (strcmp(arg, "--port") == 0) {
+            port = atoi(value);
+        } else if ((strcmp(arg, "--delay") == 0 || strcmp(arg, "--fail") == 0 || strcmp(arg, "--seed") == 0) &&
+                   server_argc < 62) {
+            server_args[server_argc++] = arg;
+            server_args[server_argc++] = value;
+        } else if (strcmp(arg, "--threads") == 0) {
+            threads = atoi(value) > 0 ? atoi(value) : 1;
+        } else if (strcmp(arg, "--seconds") == 0) {
+            seconds = atof(value);
+        } else if (strcmp(arg, "--warmup") == 0) {
+            warmup = atoi(value);
+        } else if (strcmp(arg, "--payload") == 0) {
+            payload = (size_t)atol(value);
+        } else if (strcmp(arg, "--syscalls") == 0) {
+            syscall_connects = atoi(value);
+        } else if (strcmp(arg, "--max-p99") == 0) {
+            max_p99 = atof(value);
+        } else if (strcmp(arg, "--max-p999") == 0) {
+            max_p999 = atof(value);
+        } else if (strcmp(arg, "--min-cps") == 0) {
+            min_cps = atof(value);
+        } else if (strcmp(arg, "--max-syscalls") == 0) {
+            max_syscalls = atof(value);
+        } else {
+            usage(argv[0]);
+        }
+    }
+
+    // The re-executed copy, started with the same options, measures the wrapper preloaded into it
+    child_lib = getenv("CONNECTBENCH_CHILD");
+    if (child_lib) {
+        return run_child(child_lib);
+    }
+    if (lib_count == 0) {
+        libs[lib_count++] = "./1.so";
+        libs[lib_count++] = "./ConnetcInterceptionOnly.so";
+        libs[lib_count++] = "./ConnectWithDNSInterception.so";
+    }
+    if (use_server) {
+        server = start_server();
+        if (server < 0) {
+            fprintf(stderr, "ConnectBench: could not start %s on port %d\n", server_path, port);
+            return 1;
+        }
+    }
+
+    printf("%-36s %12s %9s %9s %9s %14s %8s\n", "wrapper", "connects/s", "p50 us", "p99 us", "p999 us",
+           "syscalls/conn", "errors");
+    for (i = 0; i < lib_count; i++) {
+        char result[512];
+        char name[256];
+        double cps, syscalls;
+        unsigned int p50, p99, p999;
+        unsigned long errors;
+
+        if (access(libs[i], R_OK) != 0) {
+            printf("%-36s missing\n", libs[i]);
+            failed = 1;
+            continue;
+        }
+        if (run_lib(argv, libs[i], result, sizeof(result)) < 0 ||
+            sscanf(result, "RESULT %255s %lf %u %u %u %lf %lu", name, &cps, &p50, &p99, &p999, &syscalls, &errors) != 7) {
+            printf("%-36s failed to run\n", libs[i]);
+            failed = 1;
+            continue;
+        }
+        if (syscalls < 0) {
+            printf("%-36s %12.1f %9u %9u %9u %14s %8lu", libs[i], cps, p50, p99, p999, "n/a", errors);
+        } else {
+            printf("%-36s %12.1f %9u %9u %9u %14.2f %8lu", libs[i], cps, p50, p99, p999, syscalls, errors);
+        }
+        // Regression gate
+        if ((max_p99 > 0 && p99 > max_p99) || (max_p999 > 0 && p999 > max_p999) || (min_cps > 0 && cps < min_cps) ||
+            (max_syscalls > 0 && syscalls > max_syscalls)) {
+            printf("  REGRESSION");
+            failed = 1;
+        }
+        printf("\n");
+    }
+
+    if (server > 0) {
+        kill(server, SIGTERM);
+        waitpid(server, NULL, 0);
+    }
+    return failed;
+}
\ No newline at end of file
@@ -0,0 +1,313 @@
+// MetricsExporter: serves the counters every preloaded wrapper adds to with TOR_METRICS (see "Metrics" in
+// TorsocksWrapper.h) in the Prometheus text format, over HTTP on a unix-domain socket.
+//     gcc -O2 -Wall -o MetricsExporter MetricsExporter.c
+//     ./MetricsExporter [segment] [socket]       (defaults below; socket "-" prints once to stdout)
+//     curl --unix-socket /tmp/torsocks-metrics.sock http://localhost/metrics
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#define EXPORTER_SEGMENT "/dev/shm/torsocks-metrics"
+#define EXPORTER_SOCKET "/tmp/torsocks-metrics.sock"
+#define EXPORTER_BODY_MAX (64 * 1024)
+
+// --- Segment layout: keep in sync with the wrappers ---
+#define SOCKS5_METRICS_MAGIC 0x31435254454d5354ull // "TSMETRC1"
+#define TOR_METRICS_CPUS 256
+#define SOCKS5_METRICS_BUCKETS 240
+#define SOCKS5_METRICS_REPLIES 19
+
+struct socks5_metrics_header {
+    uint64_t magic;
+    uint32_t cpus;
+    uint32_t buckets;
+    uint32_t replies;
+    uint32_t reserved0;
+    uint64_t attached;
+    uint8_t reserved[32];
+};
+
+struct socks5_metrics_cpu {
+    uint64_t connects[2];
+    uint64_t succeeded;
+    uint64_t failed[SOCKS5_METRICS_REPLIES];
+    uint64_t bytes[2];
+    uint64_t latency_sum_us[2];
+    uint64_t latency[2][SOCKS5_METRICS_BUCKETS];
+} __attribute__((aligned(64)));
+
+// SOCKS reply of each failure counter, and why Tor sends it
+static const struct {
+    const char *code;
+    const char *reason;
+} reply_labels[SOCKS5_METRICS_REPLIES] = {
+    {"0x00", "succeeded"},
+    {"0x01", "general failure"},
+    {"0x02", "not allowed by ruleset"},
+    {"0x03", "network unreachable"},
+    {"0x04", "host unreachable"},
+    {"0x05", "connection refused"},
+    {"0x06", "TTL expired"},
+    {"0x07", "command not supported"},
+    {"0x08", "address type not supported"},
+    {"0xf0", "onion service descriptor not found"},
+    {"0xf1", "onion service descriptor invalid"},
+    {"0xf2", "onion service introduction failed"},
+    {"0xf3", "onion service rendezvous failed"},
+    {"0xf4", "onion service client authorization missing"},
+    {"0xf5", "onion service client authorization wrong"},
+    {"0xf6", "invalid onion service address"},
+    {"0xf7", "onion service introduction timed out"},
+    {"other", "unknown reply code"},
+    {"none", "no reply: proxy unreachable or handshake failed"},
+};
+
+static const char *outcome_labels[2] = {"success", "failure"};
+
+struct body {
+    char *buf;
+    size_t len;
+};
+
+static void body_printf(struct body *body, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+static void body_printf(struct body *body, const char *format, ...) {
+    va_list args;
+    int n;
+
+    if (body->len >= EXPORTER_BODY_MAX) {
+        return;
+    }
+    va_start(args, format);
+    n = vsnprintf(body->buf + body->len, EXPORTER_BODY_MAX - body->len, format, args);
+    va_end(args);
+    if (n > 0) {
+        body->len += (size_t)n;
+        if (body->len > EXPORTER_BODY_MAX) {
+            body->len = EXPORTER_BODY_MAX;
+        }
+    }
+}
+
+/**
+ * @brief Lowest latency in microseconds that lands in a histogram bucket (the wrapper's socks5_metrics_bucket()).
+ */
+static uint64_t bucket_low_us(int bucket) {
+    if (bucket < 8) {
+        return (uint64_t)bucket;
+    }
+    return (uint64_t)(8 + bucket % 8) << (bucket / 8 - 1);
+}
+
+/**
+ * @brief Maps the segment read-only.
+ * @return The header, or NULL if the segment is missing or has another layout.
+ */
+static const struct socks5_metrics_header *segment_map(const char *path) {
+    size_t size = sizeof(struct socks5_metrics_header) + TOR_METRICS_CPUS * sizeof(struct socks5_metrics_cpu);
+    const struct socks5_metrics_header *header;
+    struct stat st;
+    void *map;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "MetricsExporter: %s: %s\n", path, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+    if ((size_t)st.st_size != size) {
+        fprintf(stderr, "MetricsExporter: %s: not a metrics segment of this version\n", path);
+        close(fd);
+        return NULL;
+    }
+    map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "MetricsExporter: %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    header = map;
+    if (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != SOCKS5_METRICS_MAGIC || header->cpus != TOR_METRICS_CPUS ||
+        header->buckets != SOCKS5_METRICS_BUCKETS || header->replies != SOCKS5_METRICS_REPLIES) {
+        fprintf(stderr, "MetricsExporter: %s: not a metrics segment of this version\n", path);
+        munmap(map, size);
+        return NULL;
+    }
+    return header;
+}
+
+/**
+ * @brief Sums the per-CPU counters and renders them in the Prometheus text exposition format.
+ */
+static void render(const struct socks5_metrics_header *header, struct body *body) {
+    const struct socks5_metrics_cpu *cpus = (const struct socks5_metrics_cpu *)(header + 1);
+    static struct socks5_metrics_cpu total;
+    const uint64_t *from;
+    uint64_t *to;
+    size_t i, c;
+    int outcome;
+    int b;
+
+    // 1. Add up the CPUs; each counter is read with one atomic load, so a scrape never sees a torn value
+    memset(&total, 0, sizeof(total));
+    to = (uint64_t *)&total;
+    for (c = 0; c < TOR_METRICS_CPUS; c++) {
+        from = (const uint64_t *)&cpus[c];
+        for (i = 0; i < sizeof(total) / sizeof(uint64_t); i++) {
+            to[i] += __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+        }
+    }
+
+    // 2. Counters
+    body_printf(body, "# HELP torsocks_processes_attached_total Processes that attached to the metrics segment.\n"
+                      "# TYPE torsocks_processes_attached_total counter\n"
+                      "torsocks_processes_attached_total %llu\n",
+                (unsigned long long)__atomic_load_n(&header->attached, __ATOMIC_RELAXED));
+    body_printf(body, "# HELP torsocks_connects_total connect() calls for IP destinations, by route.\n"
+                      "# TYPE torsocks_connects_total counter\n"
+                      "torsocks_connects_total{route=\"tor\"} %llu\n"
+                      "torsocks_connects_total{route=\"bypass\"} %llu\n",
+                (unsigned long long)total.connects[0], (unsigned long long)total.connects[1]);
+    body_printf(body, "# HELP torsocks_connect_successes_total Connects through Tor that became usable.\n"
+                      "# TYPE torsocks_connect_successes_total counter\n"
+                      "torsocks_connect_successes_total %llu\n", (unsigned long long)total.succeeded);
+    body_printf(body, "# HELP torsocks_connect_failures_total Connects through Tor that failed, by SOCKS reply.\n"
+                      "# TYPE torsocks_connect_failures_total counter\n");
+    for (i = 0; i < SOCKS5_METRICS_REPLIES; i++) {
+        body_printf(body, "torsocks_connect_failures_total{reply=\"%s\",reason=\"%s\"} %llu\n",
+                    reply_labels[i].code, reply_labels[i].reason, (unsigned long long)total.failed[i]);
+    }
+    body_printf(body, "# HELP torsocks_stream_bytes_total Payload of established streams through Tor.\n"
+                      "# TYPE torsocks_stream_bytes_total counter\n"
+                      "torsocks_stream_bytes_total{direction=\"sent\"} %llu\n"
+                      "torsocks_stream_bytes_total{direction=\"received\"} %llu\n",
+                (unsigned long long)total.bytes[0], (unsigned long long)total.bytes[1]);
+
+    // 3. Latency: the fine buckets are folded into one le bound per power of two from 64 us to 64 s
+    body_printf(body, "# HELP torsocks_connect_duration_seconds Time from connect() until the stream is usable or failed.\n"
+                      "# TYPE torsocks_connect_duration_seconds histogram\n");
+    for (outcome = 0; outcome < 2; outcome++) {
+        uint64_t cumulative = 0;
+        uint64_t bound = 64;
+        for (b = 0; b < SOCKS5_METRICS_BUCKETS; b++) {
+            while (bound <= (1ull << 26) && bucket_low_us(b) >= bound) {
+                body_printf(body, "torsocks_connect_duration_seconds_bucket{outcome=\"%s\",le=\"%g\"} %llu\n",
+                            outcome_labels[outcome], (double)bound / 1e6, (unsigned long long)cumulative);
+                bound *= 2;
+            }
+            cumulative += total.latency[outcome][b];
+        }
+        while (bound <= (1ull << 26)) {
+            body_printf(body, "torsocks_connect_duration_seconds_bucket{outcome=\"%s\",le=\"%g\"} %llu\n",
+                        outcome_labels[outcome], (double)bound / 1e6, (unsigned long long)cumulative);
+            bound *= 2;
+        }
+        body_printf(body, "torsocks_connect_duration_seconds_bucket{outcome=\"%s\",le=\"+Inf\"} %llu\n"
+                          "torsocks_connect_duration_seconds_sum{outcome=\"%s\"} %.6f\n"
+                          "torsocks_connect_duration_seconds_count{outcome=\"%s\"} %llu\n",
+                    outcome_labels[outcome], (unsigned long long)cumulative, outcome_labels[outcome],
+                    (double)total.latency_sum_us[outcome] / 1e6, outcome_labels[outcome], (unsigned long long)cumulative);
+    }
+}
+
+/**
+ * @brief Answers one scrape: the request is read and ignored, every path gets the metrics.
+ */
+static void serve(int client, const struct socks5_metrics_header *header, struct body *body) {
+    struct timeval timeout = {1, 0};
+    char request[4096];
+    char head[256];
+    size_t have = 0;
+    ssize_t n;
+    int head_len;
+
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    while (have < sizeof(request) - 1) {
+        n = recv(client, request + have, sizeof(request) - 1 - have, 0);
+        if (n <= 0) {
+            break;
+        }
+        have += (size_t)n;
+        request[have] = '\0';
+        if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n")) {
+            break;
+        }
+    }
+
+    body->len = 0;
+    render(header, body);
+    head_len = snprintf(head, sizeof(head), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                                            "Content-Length: %zu\r\nConnection: close\r\n\r\n", body->len);
+    if (send(client, head, (size_t)head_len, MSG_NOSIGNAL) == head_len) {
+        size_t sent = 0;
+        while (sent < body->len && (n = send(client, body->buf + sent, body->len - sent, MSG_NOSIGNAL)) > 0) {
+            sent += (size_t)n;
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    const char *segment = argc > 1 ? argv[1] : EXPORTER_SEGMENT;
+    const char *socket_path = argc > 2 ? argv[2] : EXPORTER_SOCKET;
+    const struct socks5_metrics_header *header;
+    struct sockaddr_un addr;
+    struct body body;
+    int listener;
+
+    header = segment_map(segment);
+    if (!header) {
+        return 1;
+    }
+    body.buf = malloc(EXPORTER_BODY_MAX);
+    body.len = 0;
+    if (!body.buf) {
+        return 1;
+    }
+    if (strcmp(socket_path, "-") == 0) {
+        render(header, &body);
+        fwrite(body.buf, 1, body.len, stdout);
+        return 0;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "MetricsExporter: socket path too long\n");
+        return 1;
+    }
+    strcpy(addr.sun_path, socket_path);
+    listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    unlink(socket_path);
+    if (listener < 0 || bind(listener, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listener, 16) < 0) {
+        fprintf(stderr, "MetricsExporter: %s: %s\n", socket_path, strerror(errno));
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    for (;;) {
+        int client = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+        if (client < 0) {
+            if (errno != EINTR && errno != ECONNABORTED) {
+                fprintf(stderr, "MetricsExporter: accept: %s\n", strerror(errno));
+                return 1;
+            }
+            continue;
+        }
+        serve(client, header, &body);
+        close(client);
+    }
+}
\ No newline at end of file
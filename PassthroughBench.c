@@ -0,0 +1,223 @@
+// PassthroughBench: what the interposed connect() costs on the paths that never reach Tor (AF_UNIX and
+// bypassed destinations), in nanoseconds, cycles, instructions and cache misses per call over calling the
+// next connect() directly. The kernel is kept out of the measurement: built with -DPASSTHROUGH_STUB the same
+// file is a stub library whose connect() returns at once, preloaded behind the wrapper so the wrapper's
+// real_connect() lands in it.
+//     gcc -O2 -shared -fPIC -DPASSTHROUGH_STUB -o PassthroughStub.so PassthroughBench.c
+//     gcc -O2 -Wall -o PassthroughBench PassthroughBench.c -ldl
+//     for f in 1 ConnetcInterceptionOnly ConnectWithDNSInterception; do
+//         gcc -O2 -shared -fPIC -o $f.so $f.c -ldl -lpthread
+//         LD_PRELOAD="./$f.so ./PassthroughStub.so" ./PassthroughBench; done
+// Hardware counters come from perf_event_open() and are shown as n/a where it is not permitted
+// (kernel.perf_event_paranoid, containers). Options: --iterations N (default 10000000), --runs N (default 5,
+// the best run is kept), --max-ns NS (exit 1 if any path adds more).
+#define _GNU_SOURCE
+#include <sys/socket.h>
+
+#ifdef PASSTHROUGH_STUB
+int connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
+    (void)sockfd;
+    (void)addr;
+    (void)addrlen;
+    __asm__ __volatile__("" ::: "memory");
+    return 0;
+}
+#else
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <dlfcn.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/perf_event.h>
+
+typedef int (*connect_fn)(int, const struct sockaddr *, socklen_t);
+
+#define BENCH_COUNTERS 4
+
+static const struct bench_counter {
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+} bench_counters[BENCH_COUNTERS] = {
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"L1d-misses", PERF_TYPE_HW_CACHE,
+     PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+    {"cache-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+};
+
+static int counter_fds[BENCH_COUNTERS];
+
+struct bench_result {
+    double ns;
+    double counts[BENCH_COUNTERS]; // Per call, < 0 when the counter is not available
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static void counters_open(void) {
+    int i;
+
+    for (i = 0; i < BENCH_COUNTERS; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = bench_counters[i].type;
+        attr.config = bench_counters[i].config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        counter_fds[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+}
+
+/**
+ * @brief Times iterations calls of fn(-1, addr, addrlen), the best of runs.
+ */
+static struct bench_result bench_run(connect_fn fn, const struct sockaddr *addr, socklen_t addrlen, long iterations,
+                                     int runs) {
+    struct bench_result best;
+    int run, i;
+
+    best.ns = -1;
+    for (run = 0; run < runs; run++) {
+        struct bench_result result;
+        uint64_t start;
+        long n;
+
+        for (i = 0; i < BENCH_COUNTERS; i++) {
+            if (counter_fds[i] >= 0) {
+                ioctl(counter_fds[i], PERF_EVENT_IOC_RESET, 0);
+                ioctl(counter_fds[i], PERF_EVENT_IOC_ENABLE, 0);
+            }
+        }
+        start = now_ns();
+        for (n = 0; n < iterations; n++) {
+            fn(-1, addr, addrlen);
+        }
+        result.ns = (double)(now_ns() - start) / (double)iterations;
+        for (i = 0; i < BENCH_COUNTERS; i++) {
+            uint64_t count;
+            result.counts[i] = -1;
+            if (counter_fds[i] >= 0) {
+                ioctl(counter_fds[i], PERF_EVENT_IOC_DISABLE, 0);
+                if (read(counter_fds[i], &count, sizeof(count)) == sizeof(count)) {
+                    result.counts[i] = (double)count / (double)iterations;
+                }
+            }
+        }
+        if (best.ns < 0 || result.ns < best.ns) {
+            best = result;
+        }
+    }
+    return best;
+}
+
+int main(int argc, char **argv) {
+    struct sockaddr_un unix_addr;
+    struct sockaddr_in loopback4;
+    struct sockaddr_in6 loopback6;
+    const struct {
+        const char *name;
+        const struct sockaddr *addr;
+        socklen_t addrlen;
+    } paths[] = {
+        {"AF_UNIX", (const struct sockaddr *)&unix_addr, sizeof(unix_addr)},
+        {"bypass 127.0.0.1", (const struct sockaddr *)&loopback4, sizeof(loopback4)},
+        {"bypass ::1", (const struct sockaddr *)&loopback6, sizeof(loopback6)},
+    };
+    const char *preload = getenv("LD_PRELOAD");
+    long iterations = 10000000;
+    int runs = 5;
+    double max_ns = 0;
+    int failed = 0;
+    connect_fn interposed, next;
+    void *stub;
+    size_t p;
+    int i;
+
+    for (i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--iterations") == 0) {
+            iterations = atol(argv[i + 1]);
+        } else if (strcmp(argv[i], "--runs") == 0) {
+            runs = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "--max-ns") == 0) {
+            max_ns = atof(argv[i + 1]);
+        } else {
+            break;
+        }
+    }
+    if (i < argc || iterations <= 0 || runs <= 0) {
+        fprintf(stderr, "usage: %s [--iterations N] [--runs N] [--max-ns NS]\n", argv[0]);
+        return 2;
+    }
+
+    // connect() as the application sees it (the wrapper), and the one the wrapper forwards to (the stub)
+    interposed = (connect_fn)dlsym(RTLD_DEFAULT, "connect");
+    stub = dlopen("PassthroughStub.so", RTLD_NOW | RTLD_NOLOAD);
+    if (!stub) {
+        stub = dlopen("./PassthroughStub.so", RTLD_NOW | RTLD_NOLOAD);
+    }
+    next = stub ? (connect_fn)dlsym(stub, "connect") : NULL;
+    if (!next || !preload) {
+        fprintf(stderr, "PassthroughBench: preload the wrapper and PassthroughStub.so behind it, "
+                        "LD_PRELOAD=\"./1.so ./PassthroughStub.so\"\n");
+        return 2;
+    }
+
+    memset(&unix_addr, 0, sizeof(unix_addr));
+    unix_addr.sun_family = AF_UNIX;
+    strcpy(unix_addr.sun_path, "/run/dbus/system_bus_socket");
+    memset(&loopback4, 0, sizeof(loopback4));
+    loopback4.sin_family = AF_INET;
+    loopback4.sin_port = htons(6379);
+    loopback4.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    memset(&loopback6, 0, sizeof(loopback6));
+    loopback6.sin6_family = AF_INET6;
+    loopback6.sin6_port = htons(6379);
+    loopback6.sin6_addr = in6addr_loopback;
+
+    counters_open();
+    // The first call resolves the wrapper's symbols and loads its configuration
+    interposed(-1, paths[0].addr, paths[0].addrlen);
+
+    printf("%s\n", preload);
+    printf("%-18s %10s %10s %10s", "path", "direct ns", "wrapped ns", "added ns");
+    for (i = 0; i < BENCH_COUNTERS; i++) {
+        printf(" %13s", bench_counters[i].name);
+    }
+    printf("\n");
+    for (p = 0; p < sizeof(paths) / sizeof(paths[0]); p++) {
+        struct bench_result direct = bench_run(next, paths[p].addr, paths[p].addrlen, iterations, runs);
+        struct bench_result wrapped = bench_run(interposed, paths[p].addr, paths[p].addrlen, iterations, runs);
+        double added = wrapped.ns - direct.ns;
+
+        printf("%-18s %10.2f %10.2f %10.2f", paths[p].name, direct.ns, wrapped.ns, added);
+        // Counters are shown as what the wrapper adds per call
+        for (i = 0; i < BENCH_COUNTERS; i++) {
+            if (direct.counts[i] < 0 || wrapped.counts[i] < 0) {
+                printf(" %13s", "n/a");
+            } else {
+                printf(" %+13.3f", wrapped.counts[i] - direct.counts[i]);
+            }
+        }
+        if (max_ns > 0 && added > max_ns) {
+            printf("  REGRESSION");
+            failed = 1;
+        }
+        printf("\n");
+    }
+    return failed;
+}
+#endif
\ No newline at end of file
@@ -0,0 +1,568 @@
+// SocksStandIn: an epoll-based SOCKS5 server that answers like Tor's SocksPort, for benchmarking the
+// wrappers without a Tor daemon. CONNECT replies can be delayed by a random distribution and refused at
+// a given rate; after a successful reply the stream echoes whatever it receives.
+//     gcc -O2 -Wall -o SocksStandIn SocksStandIn.c -lm
+//     ./SocksStandIn --port 19050 --delay exp:2 --fail 0.01:0x04 --fail 0.001:0xf6
+// Options:
+//     --port N        TCP port on 127.0.0.1 (default 19050)
+//     --unix PATH     Also listen on a unix-domain socket ("SocksPort unix:PATH")
+//     --delay SPEC    Delay before each CONNECT reply, in milliseconds:
+//                     fixed:MS, uniform:MIN:MAX, exp:MEAN or lognormal:MEDIAN:SIGMA (default fixed:0)
+//     --fail RATE[:CODE]  Refuse this fraction of CONNECTs with CODE (default 0x01); repeatable
+//     --seed N        Seed of the delay and failure draws
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <math.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define STANDIN_BUF 16384
+#define STANDIN_FAIL_MAX 16
+#define STANDIN_EVENTS 256
+
+enum conn_state {
+    CONN_GREETING, // Waiting for Ver | Nmethods | Methods
+    CONN_AUTH,     // RFC 1929 username/password (isolation tokens)
+    CONN_REQUEST,  // Waiting for the CONNECT request
+    CONN_DELAYED,  // Reply scheduled on the timer heap
+    CONN_ECHO      // Reply sent, echoing the stream
+};
+
+struct conn {
+    int open;
+    uint32_t generation;       // Tells timer entries of a closed connection from those of its fd's successor
+    int state;
+    unsigned char in[600];     // Greeting, auth and CONNECT request bytes
+    size_t in_len;
+    unsigned char reply_code;  // Decided when the request arrives
+    char *out;                 // Echo bytes the socket did not take yet
+    size_t out_len, out_off;
+};
+
+struct timer {
+    uint64_t deadline_ns;
+    int fd;
+    uint32_t generation;
+};
+
+struct fail_rule {
+    double rate;
+    unsigned char code;
+};
+
+static struct conn *conns;
+static size_t conn_max;
+static struct timer *timers;
+static size_t timer_count, timer_capacity;
+static int epfd, timer_fd;
+
+static int delay_kind = 0; // 0 fixed, 1 uniform, 2 exponential, 3 lognormal
+static double delay_a = 0, delay_b = 0;
+static struct fail_rule fail_rules[STANDIN_FAIL_MAX];
+static int fail_count = 0;
+static uint64_t rng_state = 0x9e3779b97f4a7c15ull;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+// --- Random draws: xorshift64* ---
+static double rng_uniform(void) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return (double)((rng_state * 0x2545f4914f6cdd1dull) >> 11) / 9007199254740992.0; // [0, 1)
+}
+
+static double rng_normal(void) {
+    double u = rng_uniform();
+    double v = rng_uniform();
+    return sqrt(-2.0 * log(1.0 - u)) * cos(2.0 * M_PI * v);
+}
+
+/**
+ * @brief Draws the delay of one CONNECT reply, in nanoseconds.
+ */
+static uint64_t draw_delay_ns(void) {
+    double ms;
+
+    switch (delay_kind) {
+    case 1:
+        ms = delay_a + (delay_b - delay_a) * rng_uniform();
+        break;
+    case 2:
+        ms = -delay_a * log(1.0 - rng_uniform());
+        break;
+    case 3:
+        ms = delay_a * exp(delay_b * rng_normal());
+        break;
+    default:
+        ms = delay_a;
+        break;
+    }
+    return ms > 0 ? (uint64_t)(ms * 1e6) : 0;
+}
+
+/**
+ * @brief Draws the reply code of one CONNECT: 0x00, or the code of a failure rule.
+ */
+static unsigned char draw_reply(void) {
+    double u = rng_uniform();
+    int i;
+
+    for (i = 0; i < fail_count; i++) {
+        if (u < fail_rules[i].rate) {
+            return fail_rules[i].code;
+        }
+        u -= fail_rules[i].rate;
+    }
+    return 0x00;
+}
+
+// --- Timer heap: pending CONNECT replies, earliest first, one timerfd armed for the top ---
+static void timer_arm(void) {
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof(its));
+    if (timer_count) {
+        uint64_t deadline = timers[0].deadline_ns ? timers[0].deadline_ns : 1;
+        its.it_value.tv_sec = (time_t)(deadline / 1000000000u);
+        its.it_value.tv_nsec = (long)(deadline % 1000000000u);
+    }
+    timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+static void timer_push(uint64_t deadline_ns, int fd, uint32_t generation) {
+    size_t i;
+
+    if (timer_count == timer_capacity) {
+        timer_capacity = timer_capacity ? timer_capacity * 2 : 1024;
+        timers = realloc(timers, timer_capacity * sizeof(*timers));
+        if (!timers) {
+            perror("SocksStandIn: realloc");
+            exit(1);
+        }
+    }
+    i = timer_count++;
+    while (i > 0 && timers[(i - 1) / 2].deadline_ns > deadline_ns) {
+        timers[i] = timers[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    timers[i].deadline_ns = deadline_ns;
+    timers[i].fd = fd;
+    timers[i].generation = generation;
+    if (i == 0) {
+        timer_arm();
+    }
+}
+
+static struct timer timer_pop(void) {
+    struct timer top = timers[0];
+    struct timer last = timers[--timer_count];
+    size_t i = 0;
+
+    for (;;) {
+        size_t child = 2 * i + 1;
+        if (child >= timer_count) {
+            break;
+        }
+        if (child + 1 < timer_count && timers[child + 1].deadline_ns < timers[child].deadline_ns) {
+            child++;
+        }
+        if (timers[child].deadline_ns >= last.deadline_ns) {
+            break;
+        }
+        timers[i] = timers[child];
+        i = child;
+    }
+    if (timer_count) {
+        timers[i] = last;
+    }
+    return top;
+}
+
+// --- Connections ---
+static void conn_close(int fd) {
+    struct conn *c = &conns[fd];
+
+    epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+    close(fd);
+    free(c->out);
+    c->out = NULL;
+    c->open = 0;
+    c->generation++;
+}
+
+static void conn_interest(int fd, uint32_t events) {
+    struct epoll_event ev;
+
+    ev.events = events;
+    ev.data.fd = fd;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+/**
+ * @brief Sends a short protocol message; a fresh socket always takes it whole.
+ */
+static int conn_send(int fd, const void *buf, size_t len) {
+    return send(fd, buf, len, MSG_NOSIGNAL) == (ssize_t)len ? 0 : -1;
+}
+
+/**
+ * @brief Sends the scheduled CONNECT reply, Tor-style: IPv4 BND.ADDR 0.0.0.0:0.
+ */
+static void conn_reply(int fd) {
+    struct conn *c = &conns[fd];
+    unsigned char reply[10] = {0x05, 0x00, 0x00, 0x01, 0, 0, 0, 0, 0, 0};
+
+    reply[1] = c->reply_code;
+    if (conn_send(fd, reply, sizeof(reply)) < 0 || c->reply_code != 0x00) {
+        conn_close(fd);
+        return;
+    }
+    c->state = CONN_ECHO;
+    // Optimistic data read together with the request is echoed first
+    if (c->in_len && conn_send(fd, c->in, c->in_len) < 0) {
+        conn_close(fd);
+        return;
+    }
+    c->in_len = 0;
+    // Bytes that arrived behind the request (optimistic data) are waiting in the socket
+    conn_interest(fd, EPOLLIN);
+}
+
+/**
+ * @brief Consumes greeting, authentication and request bytes as far as they go.
+ * @return 0 to keep the connection, -1 to close it.
+ */
+static int conn_parse(int fd) {
+    struct conn *c = &conns[fd];
+    size_t need;
+
+    for (;;) {
+        switch (c->state) {
+        case CONN_GREETING:
+            if (c->in_len < 2 || c->in_len < 2u + c->in[1]) {
+                return 0;
+            }
+            need = 2u + c->in[1];
+            if (c->in[0] != 0x05) {
+                return -1;
+            }
+            {
+                unsigned char method = 0xff;
+                size_t i;
+                for (i = 2; i < need; i++) {
+                    if (c->in[i] == 0x00 && method == 0xff) {
+                        method = 0x00;
+                    }
+                    if (c->in[i] == 0x02) {
+                        method = 0x02; // Tor prefers username/password: it carries the isolation token
+                    }
+                }
+                unsigned char answer[2] = {0x05, method};
+                if (conn_send(fd, answer, sizeof(answer)) < 0 || method == 0xff) {
+                    return -1;
+                }
+                c->state = method == 0x02 ? CONN_AUTH : CONN_REQUEST;
+            }
+            break;
+        case CONN_AUTH:
+            if (c->in_len < 2 || c->in_len < 3u + c->in[1] || c->in_len < 3u + c->in[1] + c->in[2 + c->in[1]]) {
+                return 0;
+            }
+            need = 3u + c->in[1] + c->in[2 + c->in[1]];
+            {
+                static const unsigned char ok[2] = {0x01, 0x00};
+                if (conn_send(fd, ok, sizeof(ok)) < 0) {
+                    return -1;
+                }
+            }
+            c->state = CONN_REQUEST;
+            break;
+        case CONN_REQUEST:
+            if (c->in_len < 5) {
+                return 0;
+            }
+            if (c->in[3] == 0x01) {
+                need = 10;
+            } else if (c->in[3] == 0x04) {
+                need = 22;
+            } else if (c->in[3] == 0x03) {
+                need = 7u + c->in[4];
+            } else {
+                return -1;
+            }
+            if (c->in_len < need) {
+                return 0;
+            }
+            c->reply_code = c->in[1] == 0x01 ? draw_reply() : 0x07;
+            c->state = CONN_DELAYED;
+            c->in_len -= need;
+            memmove(c->in, c->in + need, c->in_len);
+            // Leave further bytes in the socket until the reply is out
+            conn_interest(fd, EPOLLRDHUP);
+            timer_push(now_ns() + draw_delay_ns(), fd, c->generation);
+            return 0;
+        default:
+            return 0;
+        }
+        c->in_len -= need;
+        memmove(c->in, c->in + need, c->in_len);
+    }
+}
+
+/**
+ * @brief Echoes stream data, parking what the socket does not take until it is writable again.
+ */
+static int conn_echo(int fd, uint32_t events) {
+    struct conn *c = &conns[fd];
+    char buf[STANDIN_BUF];
+    ssize_t n;
+
+    if (c->out_len) {
+        if (!(events & EPOLLOUT)) {
+            return 0;
+        }
+        n = send(fd, c->out + c->out_off, c->out_len - c->out_off, MSG_NOSIGNAL);
+        if (n < 0) {
+            return errno == EAGAIN ? 0 : -1;
+        }
+        c->out_off += (size_t)n;
+        if (c->out_off < c->out_len) {
+            return 0;
+        }
+        c->out_len = c->out_off = 0;
+        conn_interest(fd, EPOLLIN);
+    }
+    for (;;) {
+        n = recv(fd, buf, sizeof(buf), 0);
+        if (n == 0) {
+            return -1;
+        }
+        if (n < 0) {
+            return errno == EAGAIN ? 0 : -1;
+        }
+        ssize_t sent = send(fd, buf, (size_t)n, MSG_NOSIGNAL);
+        if (sent < 0 && errno != EAGAIN) {
+            return -1;
+        }
+        if (sent < n) {
+            if (sent < 0) {
+                sent = 0;
+            }
+            c->out = c->out ? c->out : malloc(STANDIN_BUF);
+            if (!c->out) {
+                return -1;
+            }
+            memcpy(c->out, buf + sent, (size_t)(n - sent));
+            c->out_len = (size_t)(n - sent);
+            c->out_off = 0;
+            conn_interest(fd, EPOLLOUT);
+            return 0;
+        }
+    }
+}
+
+static void conn_event(int fd, uint32_t events) {
+    struct conn *c = &conns[fd];
+    ssize_t n;
+
+    if (c->state == CONN_ECHO) {
+        if (conn_echo(fd, events) < 0) {
+            conn_close(fd);
+        }
+        return;
+    }
+    if (c->state == CONN_DELAYED) {
+        if (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+            conn_close(fd);
+        }
+        return;
+    }
+    n = recv(fd, c->in + c->in_len, sizeof(c->in) - c->in_len, 0);
+    if (n == 0 || (n < 0 && errno != EAGAIN) || (n > 0 && (c->in_len += (size_t)n, conn_parse(fd) < 0))) {
+        conn_close(fd);
+    }
+}
+
+static void accept_all(int listener) {
+    for (;;) {
+        int fd = accept4(listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        struct epoll_event ev;
+
+        if (fd < 0) {
+            return;
+        }
+        if ((size_t)fd >= conn_max) {
+            close(fd);
+            continue;
+        }
+        conns[fd].open = 1;
+        conns[fd].state = CONN_GREETING;
+        conns[fd].in_len = 0;
+        conns[fd].out_len = conns[fd].out_off = 0;
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+    }
+}
+
+static void fire_timers(void) {
+    uint64_t expirations;
+    uint64_t now = now_ns();
+
+    if (read(timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+        return;
+    }
+    while (timer_count && timers[0].deadline_ns <= now) {
+        struct timer t = timer_pop();
+        if (conns[t.fd].open && conns[t.fd].generation == t.generation && conns[t.fd].state == CONN_DELAYED) {
+            conn_reply(t.fd);
+        }
+    }
+    timer_arm();
+}
+
+static int parse_delay(const char *spec) {
+    if (sscanf(spec, "fixed:%lf", &delay_a) == 1) {
+        delay_kind = 0;
+    } else if (sscanf(spec, "uniform:%lf:%lf", &delay_a, &delay_b) == 2 && delay_b >= delay_a) {
+        delay_kind = 1;
+    } else if (sscanf(spec, "exp:%lf", &delay_a) == 1) {
+        delay_kind = 2;
+    } else if (sscanf(spec, "lognormal:%lf:%lf", &delay_a, &delay_b) == 2) {
+        delay_kind = 3;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+static int listen_on(const struct sockaddr *addr, socklen_t len) {
+    int one = 1;
+    int fd = socket(addr->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    struct epoll_event ev;
+
+    if (fd < 0) {
+        return -1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, addr, len) < 0 || listen(fd, 4096) < 0) {
+        close(fd);
+        return -1;
+    }
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+    return fd;
+}
+
+int main(int argc, char **argv) {
+    struct epoll_event events[STANDIN_EVENTS];
+    struct sockaddr_in tcp_addr;
+    struct rlimit limit;
+    const char *unix_path = NULL;
+    int port = 19050;
+    int tcp_fd, unix_fd = -1;
+    int i;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+            port = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--unix") == 0 && i + 1 < argc) {
+            unix_path = argv[++i];
+        } else if (strcmp(argv[i], "--delay") == 0 && i + 1 < argc) {
+            if (parse_delay(argv[++i]) < 0) {
+                fprintf(stderr, "SocksStandIn: bad delay '%s'\n", argv[i]);
+                return 2;
+            }
+        } else if (strcmp(argv[i], "--fail") == 0 && i + 1 < argc && fail_count < STANDIN_FAIL_MAX) {
+            unsigned int code = 0x01;
+            if (sscanf(argv[++i], "%lf:%i", &fail_rules[fail_count].rate, &code) < 1 || code > 0xff) {
+                fprintf(stderr, "SocksStandIn: bad failure rule '%s'\n", argv[i]);
+                return 2;
+            }
+            fail_rules[fail_count++].code = (unsigned char)code;
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            rng_state = strtoull(argv[++i], NULL, 0) | 1;
+        } else {
+            fprintf(stderr, "usage: %s [--port N] [--unix PATH] [--delay SPEC] [--fail RATE[:CODE]]... [--seed N]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    // One connection slot per possible fd
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+        getrlimit(RLIMIT_NOFILE, &limit);
+    }
+    conn_max = limit.rlim_cur > 1048576 ? 1048576 : (size_t)limit.rlim_cur;
+    conns = calloc(conn_max, sizeof(*conns));
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (!conns || epfd < 0 || timer_fd < 0) {
+        perror("SocksStandIn");
+        return 1;
+    }
+    {
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.fd = timer_fd;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, timer_fd, &ev);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    memset(&tcp_addr, 0, sizeof(tcp_addr));
+    tcp_addr.sin_family = AF_INET;
+    tcp_addr.sin_port = htons((uint16_t)port);
+    tcp_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    tcp_fd = listen_on((struct sockaddr *)&tcp_addr, sizeof(tcp_addr));
+    if (tcp_fd < 0) {
+        fprintf(stderr, "SocksStandIn: 127.0.0.1:%d: %s\n", port, strerror(errno));
+        return 1;
+    }
+    if (unix_path) {
+        struct sockaddr_un unix_addr;
+        memset(&unix_addr, 0, sizeof(unix_addr));
+        unix_addr.sun_family = AF_UNIX;
+        snprintf(unix_addr.sun_path, sizeof(unix_addr.sun_path), "%s", unix_path);
+        unlink(unix_path);
+        unix_fd = listen_on((struct sockaddr *)&unix_addr, sizeof(unix_addr));
+        if (unix_fd < 0) {
+            fprintf(stderr, "SocksStandIn: %s: %s\n", unix_path, strerror(errno));
+            return 1;
+        }
+    }
+
+    for (;;) {
+        int n = epoll_wait(epfd, events, STANDIN_EVENTS, -1);
+        for (i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            if (fd == tcp_fd || fd == unix_fd) {
+                accept_all(fd);
+            } else if (fd == timer_fd) {
+                fire_timers();
+            } else if (conns[fd].open) {
+                conn_event(fd, events[i].events);
+            }
+        }
+    }
+}
\ No newline at end of file
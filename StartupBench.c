@@ -0,0 +1,259 @@
+// StartupBench: what preloading a wrapper adds to every exec() of a short-lived process. Each run forks,
+// stamps the clock and execs this program again, which reports how long it took to reach main() and
+// what its first close() cost (where a lazily started wrapper resolves that function). The same is
+// done without any preload, and the medians are compared. With --target, an external program is
+// spawned instead and only the wall time from fork() to its exit is measured.
+//     for f in 1 ConnetcInterceptionOnly ConnectWithDNSInterception; do
+//         gcc -O2 -shared -fPIC -o $f.so $f.c -ldl -lpthread; done
+//     gcc -O2 -Wall -o StartupBench StartupBench.c
+//     ./StartupBench --runs 2000
+//     ./StartupBench --lib ./1.so --target /bin/true
+// Options: --lib PATH (repeatable; default the three wrappers), --runs N (default 1000),
+// --target PROG [ARGS...] (must come last), --max-us US (exit 1 if a wrapper adds more to exec-to-main).
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define BENCH_LIBS_MAX 16
+#define BENCH_CHILD_ARG "--startup-child"
+
+extern char **environ;
+
+struct bench_config {
+    const char *lib; // NULL: no preload
+    uint64_t *exec_ns, *first_call_ns, *wall_ns;
+    int samples;
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_us(uint64_t *values, int count, double p) {
+    if (count == 0) {
+        return 0;
+    }
+    qsort(values, (size_t)count, sizeof(*values), compare_u64);
+    return (double)values[(int)((count - 1) * p)] / 1000.0;
+}
+
+/**
+ * @brief The exec()ed copy: reports exec-to-main and the first close() to the parent, then exits.
+ */
+static int run_child(const char *start) {
+    uint64_t reached = now_ns();
+    uint64_t before, first_call;
+
+    before = now_ns();
+    close(-1);
+    first_call = now_ns() - before;
+    printf("%llu %llu\n", (unsigned long long)(reached - strtoull(start, NULL, 10)), (unsigned long long)first_call);
+    return 0;
+}
+
+/**
+ * @brief Builds the environment of a run: ours, with LD_PRELOAD replaced.
+ */
+static char **bench_environment(const char *lib) {
+    size_t count = 0, i, j = 0;
+    char **env;
+
+    while (environ[count]) {
+        count++;
+    }
+    env = calloc(count + 2, sizeof(*env));
+    if (!env) {
+        return NULL;
+    }
+    for (i = 0; i < count; i++) {
+        if (strncmp(environ[i], "LD_PRELOAD=", 11) != 0) {
+            env[j++] = environ[i];
+        }
+    }
+    if (lib) {
+        size_t size = strlen(lib) + sizeof("LD_PRELOAD=");
+        env[j] = malloc(size);
+        if (!env[j]) {
+            free(env);
+            return NULL;
+        }
+        snprintf(env[j], size, "LD_PRELOAD=%s", lib);
+    }
+    return env;
+}
+
+/**
+ * @brief One fork()/exec() of the child (or of target), adding a sample to config.
+ * @return 0 on success, -1 if the run failed.
+ */
+static int bench_run(struct bench_config *config, char **env, char **target) {
+    unsigned long long exec_ns = 0, first_call_ns = 0;
+    uint64_t start = now_ns();
+    int pipefd[2];
+    int status;
+    pid_t pid;
+
+    if (!target && pipe(pipefd) < 0) {
+        return -1;
+    }
+    pid = fork();
+    if (pid == 0) {
+        char stamp[32];
+        char *argv[] = {"/proc/self/exe", BENCH_CHILD_ARG, stamp, NULL};
+        if (target) {
+            execve(target[0], target, env);
+            _exit(127);
+        }
+        dup2(pipefd[1], STDOUT_FILENO);
+        close(pipefd[0]);
+        close(pipefd[1]);
+        // The stamp is taken last, right before the kernel loads the program
+        snprintf(stamp, sizeof(stamp), "%llu", (unsigned long long)now_ns());
+        execve(argv[0], argv, env);
+        _exit(127);
+    }
+    if (!target) {
+        FILE *out;
+        close(pipefd[1]);
+        out = fdopen(pipefd[0], "r");
+        if (!out || fscanf(out, "%llu %llu", &exec_ns, &first_call_ns) != 2) {
+            exec_ns = 0;
+        }
+        if (out) {
+            fclose(out);
+        } else {
+            close(pipefd[0]);
+        }
+    }
+    if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0 ||
+        (!target && exec_ns == 0)) {
+        return -1;
+    }
+    config->wall_ns[config->samples] = now_ns() - start;
+    config->exec_ns[config->samples] = exec_ns;
+    config->first_call_ns[config->samples] = first_call_ns;
+    config->samples++;
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    struct bench_config configs[BENCH_LIBS_MAX + 1];
+    const char *libs[BENCH_LIBS_MAX];
+    char **envs[BENCH_LIBS_MAX + 1];
+    char **target = NULL;
+    double base_exec = 0, base_wall = 0;
+    double max_us = 0;
+    int lib_count = 0;
+    int config_count;
+    int runs = 1000;
+    int failed = 0;
+    int i, c;
+
+    if (argc == 3 && strcmp(argv[1], BENCH_CHILD_ARG) == 0) {
+        return run_child(argv[2]);
+    }
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--target") == 0 && i + 1 < argc) {
+            target = &argv[i + 1];
+            break;
+        } else if (strcmp(argv[i], "--lib") == 0 && i + 1 < argc && lib_count < BENCH_LIBS_MAX) {
+            libs[lib_count++] = argv[++i];
+        } else if (strcmp(argv[i], "--runs") == 0 && i + 1 < argc) {
+            runs = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--max-us") == 0 && i + 1 < argc) {
+            max_us = atof(argv[++i]);
+        } else {
+            fprintf(stderr, "usage: %s [--lib PATH]... [--runs N] [--max-us US] [--target PROG [ARGS...]]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (runs <= 0) {
+        runs = 1;
+    }
+    if (lib_count == 0) {
+        libs[lib_count++] = "./1.so";
+        libs[lib_count++] = "./ConnetcInterceptionOnly.so";
+        libs[lib_count++] = "./ConnectWithDNSInterception.so";
+    }
+
+    // Configuration 0 runs without a preload
+    config_count = lib_count + 1;
+    for (c = 0; c < config_count; c++) {
+        configs[c].lib = c == 0 ? NULL : libs[c - 1];
+        configs[c].exec_ns = calloc((size_t)runs, sizeof(uint64_t));
+        configs[c].first_call_ns = calloc((size_t)runs, sizeof(uint64_t));
+        configs[c].wall_ns = calloc((size_t)runs, sizeof(uint64_t));
+        configs[c].samples = 0;
+        envs[c] = bench_environment(configs[c].lib);
+        if (!configs[c].exec_ns || !configs[c].first_call_ns || !configs[c].wall_ns || !envs[c]) {
+            fprintf(stderr, "StartupBench: out of memory\n");
+            return 1;
+        }
+        if (configs[c].lib && access(configs[c].lib, R_OK) != 0) {
+            fprintf(stderr, "StartupBench: %s: %s\n", configs[c].lib, strerror(errno));
+            return 1;
+        }
+    }
+    // Interleaved, so frequency scaling and page cache state hit every configuration alike
+    for (i = 0; i < runs; i++) {
+        for (c = 0; c < config_count; c++) {
+            if (bench_run(&configs[c], envs[c], target) < 0 && i == 0) {
+                fprintf(stderr, "StartupBench: run with %s failed\n", configs[c].lib ? configs[c].lib : "no preload");
+            }
+        }
+    }
+
+    if (target) {
+        printf("%-36s %12s %12s %12s\n", "preload", "wall p50 us", "wall p90 us", "added us");
+    } else {
+        printf("%-36s %12s %12s %12s %14s %12s\n", "preload", "exec p50 us", "exec p90 us", "added us",
+               "1st close us", "wall p50 us");
+    }
+    for (c = 0; c < config_count; c++) {
+        struct bench_config *config = &configs[c];
+        const char *name = config->lib ? config->lib : "(none)";
+        double wall = percentile_us(config->wall_ns, config->samples, 0.5);
+        double exec;
+
+        if (config->samples == 0) {
+            printf("%-36s failed\n", name);
+            failed = 1;
+            continue;
+        }
+        if (c == 0) {
+            base_wall = wall;
+        }
+        if (target) {
+            printf("%-36s %12.1f %12.1f %+12.1f\n", name, wall, percentile_us(config->wall_ns, config->samples, 0.9),
+                   wall - base_wall);
+            continue;
+        }
+        exec = percentile_us(config->exec_ns, config->samples, 0.5);
+        if (c == 0) {
+            base_exec = exec;
+        }
+        printf("%-36s %12.1f %12.1f %+12.1f %14.2f %12.1f", name, exec,
+               percentile_us(config->exec_ns, config->samples, 0.9), exec - base_exec,
+               percentile_us(config->first_call_ns, config->samples, 0.5), wall);
+        if (c > 0 && max_us > 0 && exec - base_exec > max_us) {
+            printf("  REGRESSION");
+            failed = 1;
+        }
+        printf("\n");
+    }
+    return failed;
+}
\ No newline at end of file
@@ -0,0 +1,6023 @@
+// Shared machinery of the LD_PRELOAD SOCKS5 wrappers 1.c, ConnetcInterceptionOnly.c and
+// ConnectWithDNSInterception.c: configuration, the proxy leg, the SOCKS5 handshake, the per-fd table and every
+// interposed function. A wrapper includes this header once and defines socks5_request_build(), which decides
+// what the CONNECT request asks Tor to reach; everything else is the same in all three builds, e.g.
+//     gcc -O2 -shared -fPIC -o libtorsocks-wrapper.so ConnetcInterceptionOnly.c -ldl -lpthread
+#ifndef TORSOCKS_WRAPPER_H
+#define TORSOCKS_WRAPPER_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE  // Required for dlsym and RTLD_NEXT
+#endif
+#include <dlfcn.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h> // For TCP_FASTOPEN_CONNECT and TCP_NODELAY
+#include <unistd.h> // For close()
+#include <netdb.h>  // For NI_MAXHOST
+#include <fcntl.h>  // For fcntl() / O_NONBLOCK
+#include <stdarg.h> // For the fcntl() wrapper
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h> // For the pool thread signal mask
+#include <stdlib.h> // For malloc/free
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/select.h>
+#include <sys/uio.h> // For struct iovec
+#include <sys/un.h>  // For struct sockaddr_un
+#include <sys/resource.h> // For RLIMIT_NOFILE
+#include <sched.h> // For sched_yield()
+#include <sys/inotify.h> // For the configuration file watcher
+#include <stddef.h>  // For offsetof()
+#include <strings.h> // For strcasecmp()
+#include <ctype.h>
+#include <limits.h>
+#include <sys/mman.h> // For the trace file and the metrics segment
+#include <sys/stat.h>
+#include <sys/syscall.h> // For the admission control futex
+#include <linux/futex.h>
+
+// --- Configuration Constants (Simplified) ---
+// Runtime configuration ("Key value" lines, see "Runtime configuration" below), read when the library is
+// loaded; TORSOCKS_CONF_FILE names another file. The constants that follow are only its defaults.
+#define TOR_CONFIG_FILE "/etc/torsocks-wrapper.conf"
+// Follow the file with inotify and switch to the new settings without restarting the application
+#define TOR_CONFIG_RELOAD 1
+#define TOR_SOCKS_ADDR "127.0.0.1" // IPv4 or IPv6 literal, e.g. "::1"
+#define TOR_SOCKS_PORT 9050
+// Non-empty: use Tor's "SocksPort unix:<path>" instead of the TCP address above
+#define TOR_SOCKS_UNIX_PATH ""
+// Destinations connected to directly instead of through Tor, as "[!]prefix[/len][:port[-port]]" entries,
+// e.g. "127.0.0.0/8,::1,10.0.0.0/8,192.168.0.0/16:8000-8999,!10.1.2.0/24" ("!" keeps a range on Tor)
+#define TOR_BYPASS_RULES "127.0.0.0/8,::1"
+// Non-empty: spread connections over these SocksPorts (several Tor instances) instead of the one above,
+// e.g. "127.0.0.1:9050,127.0.0.1:9060,[::1]:9070,unix:/run/tor2/socks"
+#define TOR_SOCKS_SHARDS ""
+// How a new connection picks its SocksPort: TOR_SHARD_ROUND_ROBIN, TOR_SHARD_LEAST_OUTSTANDING or
+// TOR_SHARD_CONSISTENT_HASH (same destination host -> same Tor instance and circuits)
+#define TOR_SHARD_STRATEGY TOR_SHARD_ROUND_ROBIN
+// Non-zero: authenticate with this many generated isolation tokens (SOCKS username/password), so Tor
+// spreads the streams over as many circuits instead of one and parallel transfers add up
+#define TOR_ISOLATION_STRIPES 0
+// How a connection picks its token: TOR_STRIPE_ROUND_ROBIN, TOR_STRIPE_PER_DESTINATION or TOR_STRIPE_PER_THREAD
+#define TOR_STRIPE_STRATEGY TOR_STRIPE_ROUND_ROBIN
+// Username of the isolation tokens; the password tells the stripes apart
+#define TOR_ISOLATION_USER "torsocks"
+// Open the TCP proxy leg with TCP Fast Open so the greeting rides in the SYN.
+// Off by default: once a cookie is cached the proxy connect() succeeds before the SocksPort answers, so
+// a SocksPort that is down fails the greeting instead and the breaker never sees it; the option also stays
+// on the application's socket, and it only pays off where the SocksPort host enabled Fast Open listeners.
+#define TOR_SOCKS_FASTOPEN 0
+// Non-blocking sockets get EINPROGRESS and the SOCKS5 exchange is driven from poll()/select()/epoll_wait()
+#define TOR_ASYNC_CONNECT 1
+// Greeting and CONNECT request go out in one write; both replies are read back together
+#define TOR_PIPELINED_HANDSHAKE 1
+// Keep greeted proxy connections ready; the pool size follows the connect rate within these bounds.
+// Off by default: a pooled connection is dup3()ed over the application's socket, so options the
+// application set on it before connect() (TCP_NODELAY, SO_KEEPALIVE, buffer sizes, SO_MARK) are lost.
+// Bound sockets never take one.
+#define TOR_PREWARM_POOL 0
+#define TOR_POOL_MIN 2
+#define TOR_POOL_MAX 64
+// Return from a blocking connect() once CONNECT is queued and consume the reply on the first read.
+// Off by default: an unreachable target then fails the first read instead of connect().
+#define TOR_OPTIMISTIC_DATA 0
+// Blocking connect() races a second CONNECT on the next SocksPort shard, same isolation token, when the
+// first has no reply after TOR_HEDGE_DELAY_MS. Needs TOR_SOCKS_SHARDS. The winning proxy connection is
+// dup3()ed over the application's socket; TCP_NODELAY, SO_KEEPALIVE, SO_PRIORITY and SO_MARK are carried
+// over, other options set before connect() are lost. Bound sockets are never hedged.
+#define TOR_HEDGE_CONNECT 0
+#define TOR_HEDGE_DELAY_MS 500
+// With a single shard, hedge with the next isolation token instead. Off by default: the stream may then
+// come out of another circuit than its token asked for, which breaks per-token isolation.
+#define TOR_HEDGE_ACROSS_STRIPES 0
+// Destinations hedged right away, as connect() sees them, e.g. "93.184.216.34,2001:db8::1"
+#define TOR_HEDGE_IMMEDIATE ""
+// Remember destinations Tor just failed to reach (unreachable, refused, onion service gone) for
+// NegativeCacheMs, give or take NegativeCacheJitter percent: connect() to them fails at once with the same
+// errno, so an application's retries do not each cost a circuit attempt. NegativeCacheMs 0 turns it off.
+#define TOR_NEGATIVE_CACHE 1
+#define TOR_NEGATIVE_CACHE_MS 2000
+#define TOR_NEGATIVE_CACHE_JITTER 20
+// Host-wide admission control: every preloaded process takes a ticket from a shared segment before it
+// starts a handshake with a SocksPort, and at most AdmissionLimit handshakes per SocksPort are in flight;
+// the rest wait their turn in order, for up to AdmissionWaitMs (0: fail at once with EAGAIN). Keeps a
+// thousand processes starting together from overflowing Tor's SocksPort backlog.
+#define TOR_ADMISSION 0
+#define TOR_ADMISSION_SEGMENT "/dev/shm/torsocks-admission"
+#define TOR_ADMISSION_LIMIT 64
+#define TOR_ADMISSION_WAIT_MS 10000
+// Circuit breaker per SocksPort: BreakerFailures proxy connects failing in a row (Tor restarting) mark the
+// SocksPort down. connect() then moves to another SocksPort that is up, or fails at once with ECONNREFUSED,
+// while a background probe retries the SocksPort every BreakerProbeMs. BreakerFailures 0 turns it off.
+#define TOR_PROXY_BREAKER 1
+#define TOR_BREAKER_FAILURES 3
+#define TOR_BREAKER_PROBE_MS 500
+// Deadlines of the blocking SOCKS handshake: HandshakeTimeoutMs for all of it (Tor's own SocksTimeout is two
+// minutes) and GreetingTimeoutMs for the method reply, which a local Tor sends at once. A socket with
+// SO_SNDTIMEO or SO_RCVTIMEO set gets those where they are shorter. Expiry fails connect() with ETIMEDOUT;
+// 0 means no deadline.
+#define TOR_HANDSHAKE_TIMEOUT_MS 120000
+#define TOR_GREETING_TIMEOUT_MS 10000
+// Record the phases of every proxied connect() as binary records in per-thread rings, mapped from
+// "<TraceFile>.<pid>"; TraceDecode prints per-phase latency histograms from the file. An empty TraceFile
+// turns recording off at runtime.
+#define TOR_TRACE 0
+#define TOR_TRACE_FILE "/tmp/torsocks-trace"
+// Count connects, SOCKS replies, bypasses, stream bytes and connect latency in a shared-memory segment
+// every preloaded process adds to; MetricsExporter serves it to Prometheus. An empty MetricsSegment turns
+// counting off at runtime.
+#define TOR_METRICS 0
+#define TOR_METRICS_SEGMENT "/dev/shm/torsocks-metrics"
+// Startup-optimized mode for exec-heavy workloads (build farms, CI): nothing runs at load time. Each
+// wrapper resolves only its own real function on first use, and the configuration file is read by the
+// first connect() to an IP destination, so a compiler that never connects pays for neither. StartupBench
+// measures what the preload adds between exec() and main().
+#define TOR_LAZY_STARTUP 0
+
+// --- Function Pointers for Original System Calls ---
+static int (*real_connect)(int, const struct sockaddr*, socklen_t) = NULL;
+static int (*real_close)(int) = NULL;
+static int (*real_getsockopt)(int, int, int, void*, socklen_t*) = NULL;
+static int (*real_poll)(struct pollfd*, nfds_t, int) = NULL;
+static int (*real_select)(int, fd_set*, fd_set*, fd_set*, struct timeval*) = NULL;
+static int (*real_epoll_ctl)(int, int, int, struct epoll_event*) = NULL;
+static int (*real_epoll_wait)(int, struct epoll_event*, int, int) = NULL;
+static int (*real_ppoll)(struct pollfd*, nfds_t, const struct timespec*, const sigset_t*) = NULL;
+static int (*real_pselect)(int, fd_set*, fd_set*, fd_set*, const struct timespec*, const sigset_t*) = NULL;
+static int (*real_epoll_pwait)(int, struct epoll_event*, int, int, const sigset_t*) = NULL;
+#if __GLIBC_PREREQ(2, 35)
+static int (*real_epoll_pwait2)(int, struct epoll_event*, int, const struct timespec*, const sigset_t*) = NULL;
+#endif
+static ssize_t (*real_send)(int, const void*, size_t, int) = NULL;
+static ssize_t (*real_recv)(int, void*, size_t, int) = NULL;
+static ssize_t (*real_write)(int, const void*, size_t) = NULL;
+static ssize_t (*real_read)(int, void*, size_t) = NULL;
+static ssize_t (*real_sendmsg)(int, const struct msghdr*, int) = NULL;
+static ssize_t (*real_writev)(int, const struct iovec*, int) = NULL;
+static ssize_t (*real_sendto)(int, const void*, size_t, int, const struct sockaddr*, socklen_t) = NULL;
+static ssize_t (*real_recvmsg)(int, struct msghdr*, int) = NULL;
+static ssize_t (*real_readv)(int, const struct iovec*, int) = NULL;
+static ssize_t (*real_recvfrom)(int, void*, size_t, int, struct sockaddr*, socklen_t*) = NULL;
+static int (*real_getpeername)(int, struct sockaddr*, socklen_t*) = NULL;
+static int (*real_dup)(int) = NULL;
+static int (*real_dup2)(int, int) = NULL;
+static int (*real_dup3)(int, int, int) = NULL;
+static int (*real_fcntl)(int, int, ...) = NULL;
+#if __GLIBC_PREREQ(2, 28)
+static int (*real_fcntl64)(int, int, ...) = NULL;
+#endif
+
+// All of the above are resolved together, exactly once, by socks5_resolve_symbols(): from the constructor,
+// or from the first interposed call when another library's constructor connects before ours has run.
+// symbols_state is published with release ordering after every pointer is stored, so the fast path is a
+// single acquire load, and the pointers are never written again. With TOR_LAZY_STARTUP there is no
+// constructor: socks5_resolve_symbol() fills one pointer at a time, and a proxied connect() resolves the
+// rest of the table, which the SOCKS exchange and the background threads rely on.
+#define SOCKS5_SYMBOLS_UNRESOLVED 0
+#define SOCKS5_SYMBOLS_RESOLVING 1
+#define SOCKS5_SYMBOLS_READY 2
+
+static const struct socks5_symbol {
+    const char *name;
+    void **slot;
+} socks5_symbols[] = {
+    {"connect", (void **)&real_connect},
+#ifdef SOCKS5_WRAPPER_SYMBOLS
+    SOCKS5_WRAPPER_SYMBOLS // Functions only one wrapper interposes, e.g. gethostbyname()
+#endif
+    // The readiness functions are interposed so a non-blocking connect() can finish its SOCKS exchange
+    {"close", (void **)&real_close},
+    {"getsockopt", (void **)&real_getsockopt},
+    {"poll", (void **)&real_poll},
+    {"select", (void **)&real_select},
+    {"epoll_ctl", (void **)&real_epoll_ctl},
+    {"epoll_wait", (void **)&real_epoll_wait},
+    {"ppoll", (void **)&real_ppoll},
+    {"pselect", (void **)&real_pselect},
+    {"epoll_pwait", (void **)&real_epoll_pwait},
+#if __GLIBC_PREREQ(2, 35)
+    {"epoll_pwait2", (void **)&real_epoll_pwait2},
+#endif
+    // The data path is interposed for optimistic data; the shim's own I/O always goes to these
+    {"send", (void **)&real_send},
+    {"recv", (void **)&real_recv},
+    {"write", (void **)&real_write},
+    {"read", (void **)&real_read},
+    {"sendmsg", (void **)&real_sendmsg},
+    {"writev", (void **)&real_writev},
+    {"sendto", (void **)&real_sendto},
+    {"recvmsg", (void **)&real_recvmsg},
+    {"readv", (void **)&real_readv},
+    {"recvfrom", (void **)&real_recvfrom},
+    // The per-fd table follows fds through dup()/dup2()/dup3()/F_DUPFD and answers getpeername() for proxied sockets
+    {"getpeername", (void **)&real_getpeername},
+    {"dup", (void **)&real_dup},
+    {"dup2", (void **)&real_dup2},
+    {"dup3", (void **)&real_dup3},
+    {"fcntl", (void **)&real_fcntl},
+#if __GLIBC_PREREQ(2, 28)
+    {"fcntl64", (void **)&real_fcntl64}, // What fcntl() calls become with _FILE_OFFSET_BITS=64
+#endif
+};
+
+static int symbols_state = SOCKS5_SYMBOLS_UNRESOLVED;
+static __thread int symbols_resolving = 0; // dlsym() calling back into the shim must not wait for itself
+
+// fork() only copies the calling thread: if another thread was halfway through the table, the child starts over
+static void socks5_symbols_postfork_child(void) {
+    int resolving = SOCKS5_SYMBOLS_RESOLVING;
+    __atomic_compare_exchange_n(&symbols_state, &resolving, SOCKS5_SYMBOLS_UNRESOLVED, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * @brief Slow path of socks5_resolve_symbols(): one thread runs dlsym() over the whole table, threads
+ * racing it wait for the table to be published instead of resolving concurrently.
+ */
+static void socks5_resolve_symbols_slow(void) {
+    static int atfork_registered = 0;
+    size_t i;
+
+    for (;;) {
+        int state = __atomic_load_n(&symbols_state, __ATOMIC_ACQUIRE);
+        if (state == SOCKS5_SYMBOLS_READY || symbols_resolving) {
+            return;
+        }
+        if (state == SOCKS5_SYMBOLS_UNRESOLVED &&
+            __atomic_compare_exchange_n(&symbols_state, &state, SOCKS5_SYMBOLS_RESOLVING, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+        sched_yield();
+    }
+    symbols_resolving = 1;
+    if (!atfork_registered) {
+        pthread_atfork(NULL, NULL, socks5_symbols_postfork_child);
+        atfork_registered = 1;
+    }
+    for (i = 0; i < sizeof(socks5_symbols) / sizeof(socks5_symbols[0]); i++) {
+        void *symbol = dlsym(RTLD_NEXT, socks5_symbols[i].name);
+        if (!symbol) {
+            fprintf(stderr, "TORSOCKS_WRAPPER: Could not find real %s() using dlsym.\n", socks5_symbols[i].name);
+        }
+        __atomic_store_n(socks5_symbols[i].slot, symbol, __ATOMIC_RELEASE);
+    }
+    symbols_resolving = 0;
+    __atomic_store_n(&symbols_state, SOCKS5_SYMBOLS_READY, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Makes sure the real_* pointers are resolved; a single acquire load once they are.
+ */
+static inline void socks5_resolve_symbols(void) {
+    if (__builtin_expect(__atomic_load_n(&symbols_state, __ATOMIC_ACQUIRE) != SOCKS5_SYMBOLS_READY, 0)) {
+        socks5_resolve_symbols_slow();
+    }
+}
+
+#if TOR_LAZY_STARTUP
+/**
+ * @brief Slow path of socks5_resolve_symbol(): looks up one function. Threads racing it store the same
+ * pointer, so no lock is needed.
+ */
+static void socks5_resolve_symbol_slow(void **slot) {
+    size_t i;
+    void *symbol;
+
+    if (symbols_resolving) {
+        return;
+    }
+    for (i = 0; socks5_symbols[i].slot != slot; i++) {
+    }
+    symbols_resolving = 1;
+    symbol = dlsym(RTLD_NEXT, socks5_symbols[i].name);
+    symbols_resolving = 0;
+    if (!symbol) {
+        fprintf(stderr, "TORSOCKS_WRAPPER: Could not find real %s() using dlsym.\n", socks5_symbols[i].name);
+    }
+    __atomic_store_n(slot, symbol, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Makes sure one real_* pointer is resolved; a single acquire load once it is.
+ */
+static inline void socks5_resolve_symbol(void **slot) {
+    if (__builtin_expect(__atomic_load_n(slot, __ATOMIC_ACQUIRE) == NULL, 0)) {
+        socks5_resolve_symbol_slow(slot);
+    }
+}
+#else
+// The constructor resolved the whole table
+#define socks5_resolve_symbol(slot) socks5_resolve_symbols()
+#endif
+
+// --- SOCKS5 Negotiation Data Structures (Simplified) ---
+#define SOCKS_CMD_CONNECT 0x01
+#define SOCKS_ATYP_IPV4 0x01
+#define SOCKS_ATYP_DOMAINNAME 0x03
+#define SOCKS_ATYP_IPV6 0x04
+#define SOCKS_VERSION 0x05
+#define SOCKS_REPLY_SUCCESS 0x00
+#define SOCKS5_REPLY_MIN 10  // IPv4 BND.ADDR: Tor's usual reply, and the size of the first read
+#define SOCKS5_REPLY_MAX 262 // Domain BND.ADDR with a 255-byte name
+#define SOCKS5_GREETING_MAX (3 + 2 + 255 + 1 + 255) // Method offer + RFC 1929 username/password request
+
+// --- SOCKS reply codes and errno ---
+// Each RFC 1928 reply code, and each extended code Tor sends for onion services when the SocksPort has
+// the ExtendedErrors flag, maps to its own errno: a client can tell "refused, another circuit may do"
+// from "the onion service is gone" without parsing messages, and torsocks_connect_status() gives the
+// exact code and a retry hint per fd. Failures without a reply keep the errno of the I/O that failed;
+// a malformed or unexpected reply is EPROTO.
+#define SOCKS5_REPLY_NONE -1 // No CONNECT reply received (or still queued, with optimistic data)
+
+struct socks5_reply_code {
+    int code;
+    int error;        // errno connect() reports
+    int retry;        // A new attempt (new circuit, another SocksPort) may succeed
+    int negative;     // The destination failed, not the circuit: kept in the negative cache
+    const char *text;
+};
+
+static const struct socks5_reply_code socks5_reply_codes[] = {
+    {0x01, ECONNABORTED, 1, 0, "general SOCKS server failure"},
+    {0x02, EACCES, 0, 1, "connection not allowed by ruleset"},
+    {0x03, ENETUNREACH, 1, 1, "network unreachable"},
+    {0x04, EHOSTUNREACH, 1, 1, "host unreachable"},
+    {0x05, ECONNREFUSED, 1, 1, "connection refused"},
+    {0x06, ETIMEDOUT, 0, 1, "TTL expired"},
+    {0x07, EOPNOTSUPP, 0, 0, "command not supported"},
+    {0x08, EAFNOSUPPORT, 0, 0, "address type not supported"},
+    // Tor ExtendedErrors (SocksPort flag): onion service failures
+    {0xf0, EHOSTDOWN, 0, 1, "onion service descriptor not found"},
+    {0xf1, EBADMSG, 0, 1, "onion service descriptor invalid"},
+    {0xf2, ENETRESET, 1, 0, "onion service introduction failed"},
+    {0xf3, ECONNRESET, 1, 0, "onion service rendezvous failed"},
+    {0xf4, ENOKEY, 0, 1, "onion service client authorization missing"},
+    {0xf5, EKEYREJECTED, 0, 1, "onion service client authorization wrong"},
+    {0xf6, ENXIO, 0, 1, "onion address invalid"},
+    {0xf7, ETIME, 1, 0, "onion service introduction timed out"},
+};
+// Codes outside the table fail the way every refused CONNECT used to
+static const struct socks5_reply_code socks5_reply_unknown = {SOCKS5_REPLY_NONE, EHOSTUNREACH, 1, 0, "unknown reply"};
+
+/**
+ * @brief Looks up what a SOCKS reply code means.
+ */
+static const struct socks5_reply_code *socks5_reply_lookup(int code) {
+    size_t i;
+
+    for (i = 0; i < sizeof(socks5_reply_codes) / sizeof(socks5_reply_codes[0]); i++) {
+        if (socks5_reply_codes[i].code == code) {
+            return &socks5_reply_codes[i];
+        }
+    }
+    return &socks5_reply_unknown;
+}
+
+/**
+ * @brief Reports a refused CONNECT and sets errno to the errno of its reply code.
+ */
+static void socks5_reply_failed(int code) {
+    const struct socks5_reply_code *reply = socks5_reply_lookup(code);
+
+    fprintf(stderr, "TORSOCKS_WRAPPER: SOCKS connection request failed (Reply: 0x%02x, %s).\n", code, reply->text);
+    errno = reply->error;
+}
+
+/**
+ * @brief Reports a method reply that is missing or not the method offered, and sets errno accordingly.
+ * @param n What the read of the method reply returned (errno is kept if it failed).
+ * @param want Size of the method reply.
+ */
+static void socks5_handshake_failed(ssize_t n, size_t want) {
+    int error = errno;
+
+    fprintf(stderr, n < 0 && error == ETIMEDOUT ? "TORSOCKS_WRAPPER: SOCKS handshake timed out.\n"
+                                                : "TORSOCKS_WRAPPER: SOCKS handshake failed.\n");
+    errno = n < 0 ? error : (size_t)n < want ? ECONNRESET : EPROTO;
+}
+
+static const char socks5_initial_handshake[] = {0x05, 0x01, 0x00}; // Ver | Nmethods | Method (No Auth)
+#if TOR_ISOLATION_STRIPES
+static const char socks5_handshake_success[] = {0x05, 0x02, 0x01, 0x00}; // Ver | Method (User/Pass) | Auth Ver | Status
+#else
+static const char socks5_handshake_success[] = {0x05, 0x00};      // Ver | Method (No Auth)
+#endif
+#define SOCKS_AUTH_USERPASS 0x02    // RFC 1929, only offered with isolation tokens
+#define SOCKS_USERPASS_VERSION 0x01
+
+static void socks5_config_load(void);
+
+#if !TOR_LAZY_STARTUP
+/**
+ * @brief Library constructor: resolves the real functions and loads the configuration before main().
+ */
+static void init_dlsym() __attribute__((constructor));
+
+static void init_dlsym() {
+    socks5_resolve_symbols();
+    // Read the configuration file and environment now, so connect() only ever loads a finished snapshot
+    socks5_config_load();
+}
+#endif
+
+#if TOR_TRACE || TOR_METRICS
+// --- Connect records: per-phase timestamps ---
+// Every proxied connect() fills one fixed-size record: when it started, when the proxy TCP connect, the
+// method reply and the CONNECT reply completed, the target, the reply code and the SocksPort shard.
+// Stamping a phase is a vDSO clock read and a store into the record. A finished record is copied into
+// the calling thread's trace ring and added to the shared metrics (see "Connect tracing: per-thread
+// rings" and "Metrics" below), never written through stdio.
+#define SOCKS5_TRACE_PROXY 0    // Proxy TCP connect completed
+#define SOCKS5_TRACE_GREETING 1 // Method reply received (together with the CONNECT reply when pipelined)
+#define SOCKS5_TRACE_REPLY 2    // CONNECT reply received
+#define SOCKS5_TRACE_PHASES 3
+
+#define SOCKS5_TRACE_ASYNC 0x01      // Non-blocking connect(), finished from poll()/select()/epoll_wait()
+#define SOCKS5_TRACE_POOLED 0x02     // Pre-warmed proxy connection: no proxy connect, no greeting
+#define SOCKS5_TRACE_HEDGED 0x04     // Went through the hedged path, only the winning reply is stamped
+#define SOCKS5_TRACE_OPTIMISTIC 0x08 // Returned with the CONNECT queued; the reply is read on the first read
+#define SOCKS5_TRACE_NEGATIVE 0x10   // Failed from the negative cache, nothing was sent to Tor
+#define SOCKS5_TRACE_BREAKER 0x20    // Failed at once, every SocksPort's breaker was open
+
+// 64 bytes; TraceDecode.c carries a copy of this layout
+struct socks5_trace_record {
+    uint64_t start_ns;                      // CLOCK_MONOTONIC when connect() was called, 0 = no record
+    uint32_t phase_us[SOCKS5_TRACE_PHASES]; // Microseconds after start, 0 = phase not reached
+    uint32_t total_us;                      // Until the socket was usable, or the connect failed
+    int32_t error;                          // errno handed to the application, 0 on success
+    uint16_t family;                        // AF_INET or AF_INET6
+    uint16_t port;                          // Target port, host order
+    uint8_t addr[16];                       // Target address, network order
+    uint8_t shard;                          // SocksPort shard index
+    uint8_t reply;                          // SOCKS reply code, 0xff = none received
+    uint16_t flags;                         // SOCKS5_TRACE_*
+    uint8_t reserved[12];
+};
+
+static __thread struct socks5_trace_record trace_current; // The connect() running on this thread
+
+static uint64_t socks5_trace_now_ns(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+/**
+ * @brief Starts the record of a proxied connect().
+ * @param rec The record to fill, normally trace_current.
+ * @param target The target address (AF_INET or AF_INET6).
+ * @param shard The SocksPort shard picked for it.
+ */
+static void socks5_trace_begin(struct socks5_trace_record *rec, const struct sockaddr *target, int shard) {
+    memset(rec, 0, sizeof(*rec));
+    rec->start_ns = socks5_trace_now_ns();
+    rec->family = target->sa_family;
+    rec->shard = (uint8_t)shard;
+    rec->reply = 0xff;
+    if (target->sa_family == AF_INET6) {
+        const struct sockaddr_in6 *addr6 = (const struct sockaddr_in6 *)target;
+        memcpy(rec->addr, &addr6->sin6_addr, sizeof(addr6->sin6_addr));
+        rec->port = ntohs(addr6->sin6_port);
+    } else {
+        const struct sockaddr_in *addr4 = (const struct sockaddr_in *)target;
+        memcpy(rec->addr, &addr4->sin_addr, sizeof(addr4->sin_addr));
+        rec->port = ntohs(addr4->sin_port);
+    }
+}
+
+/**
+ * @brief Stamps the end of a phase (SOCKS5_TRACE_PROXY, _GREETING or _REPLY).
+ */
+static void socks5_trace_mark(struct socks5_trace_record *rec, int phase) {
+    uint32_t elapsed;
+
+    if (!rec->start_ns) {
+        return;
+    }
+    elapsed = (uint32_t)((socks5_trace_now_ns() - rec->start_ns) / 1000);
+    rec->phase_us[phase] = elapsed ? elapsed : 1;
+}
+
+/**
+ * @brief Stamps the CONNECT reply and records its code.
+ */
+static void socks5_trace_reply(struct socks5_trace_record *rec, int code) {
+    socks5_trace_mark(rec, SOCKS5_TRACE_REPLY);
+    rec->reply = (uint8_t)code;
+}
+
+static inline void socks5_trace_flag(struct socks5_trace_record *rec, int flag) {
+    rec->flags |= (uint16_t)flag;
+}
+
+/**
+ * @brief Moves the record of this thread's connect() into longer-lived state (a non-blocking handshake).
+ */
+static void socks5_trace_handoff(struct socks5_trace_record *dst, struct socks5_trace_record *src, int flag) {
+    *dst = *src;
+    dst->flags |= (uint16_t)flag;
+    src->start_ns = 0;
+}
+#else
+#define socks5_trace_begin(rec, target, shard) ((void)0)
+#define socks5_trace_mark(rec, phase) ((void)0)
+#define socks5_trace_reply(rec, code) ((void)0)
+#define socks5_trace_flag(rec, flag) ((void)0)
+#define socks5_trace_handoff(dst, src, flag) ((void)0)
+#endif
+
+// --- CONNECT request: what a wrapper makes of the application's destination ---
+// The only thing the wrappers do differently. ConnetcInterceptionOnly.c and 1.c send the IP the application
+// connects to (ATYP 0x01 / 0x04); ConnectWithDNSInterception.c sends it as a name for Tor to resolve (ATYP 0x03).
+struct socks5_request {
+    char data[SOCKS5_REPLY_MAX]; // Ver | Cmd | RSV | ATYP | DST.ADDR | DST.PORT
+    size_t len;
+    char host[NI_MAXHOST];       // The destination as text, for TOR_HEDGE_IMMEDIATE and the fd record
+    const void *key;             // Shard and isolation token hash key: what Tor is asked to reach
+    size_t key_len;
+};
+
+/**
+ * @brief Builds the CONNECT request for a proxied destination; each wrapper defines it.
+ * @param addr The application's AF_INET or AF_INET6 destination, of full length.
+ * @param request Receives the request, its destination text and its hash key (which may point into addr).
+ * @return 0, or -1 with errno set if the destination cannot be encoded.
+ */
+static int socks5_request_build(const struct sockaddr *addr, struct socks5_request *request);
+
+// --- Handshake deadlines ---
+// The blocking handshake waits for Tor with poll() and gives up with ETIMEDOUT, rather than hang the
+// application's thread on a wedged Tor or a circuit that never completes. connect() arms the deadline of
+// its thread before the handshake: HandshakeTimeoutMs for all of it and GreetingTimeoutMs for the method
+// reply. Timeouts the application set on the socket are honored where they are shorter: SO_SNDTIMEO, which
+// bounds a plain blocking connect() in the kernel, bounds the whole handshake, and SO_RCVTIMEO bounds each
+// reply, as it bounds each recv(). With no deadline at all the reads block as before.
+struct socks5_deadline {
+    struct timespec end; // CLOCK_MONOTONIC by which the whole handshake must be done, if total_ms
+    int total_ms;        // Budget of the whole handshake, 0 = none
+    int greeting_ms;     // Longest wait for the method reply, 0 = none
+    int reply_ms;        // Longest wait for a reply (the application's SO_RCVTIMEO), 0 = none
+};
+
+static __thread struct socks5_deadline deadline_current; // Deadline of the handshake running on this thread
+
+/**
+ * @brief The shorter of two timeouts in milliseconds, where 0 means none.
+ */
+static int socks5_deadline_min(int a, int b) {
+    return a == 0 || (b != 0 && b < a) ? b : a;
+}
+
+/**
+ * @brief A socket timeout (SO_SNDTIMEO or SO_RCVTIMEO) in milliseconds, 0 if the application did not set it.
+ */
+static int socks5_socket_timeout_ms(int sockfd, int option) {
+    struct timeval timeout;
+    socklen_t len = sizeof(timeout);
+    long ms;
+
+    if (real_getsockopt(sockfd, SOL_SOCKET, option, &timeout, &len) < 0 || (timeout.tv_sec == 0 && timeout.tv_usec == 0)) {
+        return 0;
+    }
+    ms = (long)timeout.tv_sec * 1000 + (timeout.tv_usec + 999) / 1000;
+    return ms > INT_MAX ? INT_MAX : (int)ms;
+}
+
+/**
+ * @brief Arms the deadline of the handshake about to run on this thread.
+ * @param sockfd The application's socket, whose SO_SNDTIMEO and SO_RCVTIMEO are honored; -1 for a
+ * connection of the shim's own.
+ * @param total_ms HandshakeTimeoutMs.
+ * @param greeting_ms GreetingTimeoutMs.
+ */
+static void socks5_deadline_begin(int sockfd, int total_ms, int greeting_ms) {
+    struct socks5_deadline *deadline = &deadline_current;
+
+    deadline->reply_ms = sockfd >= 0 ? socks5_socket_timeout_ms(sockfd, SO_RCVTIMEO) : 0;
+    deadline->greeting_ms = socks5_deadline_min(greeting_ms, deadline->reply_ms);
+    deadline->total_ms = sockfd >= 0 ? socks5_deadline_min(total_ms, socks5_socket_timeout_ms(sockfd, SO_SNDTIMEO)) : total_ms;
+    if (deadline->total_ms) {
+        clock_gettime(CLOCK_MONOTONIC, &deadline->end);
+        deadline->end.tv_sec += deadline->total_ms / 1000;
+        deadline->end.tv_nsec += (long)(deadline->total_ms % 1000) * 1000000;
+        if (deadline->end.tv_nsec >= 1000000000) {
+            deadline->end.tv_sec++;
+            deadline->end.tv_nsec -= 1000000000;
+        }
+    }
+}
+
+/**
+ * @brief How long a wait for Tor may take: what is left of the whole handshake, and of limit_ms after the
+ * phase in progress started.
+ * @param phase_start When the phase started; only read if limit_ms is set.
+ * @param limit_ms The phase's own limit, 0 = none.
+ * @return A poll() timeout: -1 = no deadline, 0 = expired.
+ */
+static int socks5_deadline_wait_ms(const struct timespec *phase_start, int limit_ms) {
+    const struct socks5_deadline *deadline = &deadline_current;
+    struct timespec now;
+    long left = LONG_MAX;
+
+    if (!deadline->total_ms && !limit_ms) {
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (deadline->total_ms) {
+        left = (deadline->end.tv_sec - now.tv_sec) * 1000 + (deadline->end.tv_nsec - now.tv_nsec) / 1000000;
+    }
+    if (limit_ms) {
+        long phase_left = limit_ms - ((now.tv_sec - phase_start->tv_sec) * 1000 + (now.tv_nsec - phase_start->tv_nsec) / 1000000);
+        if (phase_left < left) {
+            left = phase_left;
+        }
+    }
+    return left <= 0 ? 0 : left > INT_MAX ? INT_MAX : (int)left;
+}
+
+/**
+ * @brief recvmsg(MSG_WAITALL) from the SOCKS proxy on a blocking socket, within this thread's deadline.
+ * @param sockfd The socket connected to the SOCKS proxy.
+ * @param msg Where the bytes go; its iovec is advanced past the bytes as they arrive.
+ * @param greeting_len How many of the bytes asked for are the method reply, waited for at most
+ * GreetingTimeoutMs; the rest is a reply to a request.
+ * @return Bytes received (fewer if the proxy ended the stream), or -1 with errno set, ETIMEDOUT once
+ * the deadline passed.
+ */
+static ssize_t socks5_recv_deadline(int sockfd, struct msghdr *msg, size_t greeting_len) {
+    const struct socks5_deadline *deadline = &deadline_current;
+    struct timespec phase_start;
+    size_t want = 0, got = 0;
+    size_t i;
+
+    if (!deadline->total_ms && !deadline->greeting_ms && !deadline->reply_ms) {
+        return real_recvmsg(sockfd, msg, MSG_WAITALL);
+    }
+    for (i = 0; i < (size_t)msg->msg_iovlen; i++) {
+        want += msg->msg_iov[i].iov_len;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &phase_start);
+    while (got < want) {
+        struct pollfd pfd = {sockfd, POLLIN, 0};
+        int limit_ms = got < greeting_len ? deadline->greeting_ms : deadline->reply_ms;
+        int ready = real_poll(&pfd, 1, socks5_deadline_wait_ms(&phase_start, limit_ms));
+        ssize_t n;
+
+        if (ready == 0) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        n = ready < 0 ? -1 : real_recvmsg(sockfd, msg, MSG_DONTWAIT);
+        if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+            continue;
+        }
+        if (n <= 0) {
+            return n < 0 ? -1 : (ssize_t)got;
+        }
+        // The reply's own phase starts once the method reply is in
+        if (got < greeting_len && got + (size_t)n >= greeting_len) {
+            clock_gettime(CLOCK_MONOTONIC, &phase_start);
+        }
+        got += (size_t)n;
+        while (n > 0) {
+            if ((size_t)n >= msg->msg_iov->iov_len) {
+                n -= (ssize_t)msg->msg_iov->iov_len;
+                msg->msg_iov++;
+                msg->msg_iovlen--;
+            } else {
+                msg->msg_iov->iov_base = (char *)msg->msg_iov->iov_base + n;
+                msg->msg_iov->iov_len -= (size_t)n;
+                n = 0;
+            }
+        }
+    }
+    return (ssize_t)got;
+}
+
+/**
+ * @brief socks5_recv_deadline() into one buffer.
+ */
+static ssize_t socks5_recv_all(int sockfd, void *buffer, size_t len, size_t greeting_len) {
+    struct iovec iov = {buffer, len};
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    return socks5_recv_deadline(sockfd, &msg, greeting_len);
+}
+
+/**
+ * @brief Decodes how long the SOCKS5 reply starting at reply[0] is, from the bytes read so far.
+ * Ver | Rep | RSV | ATYP | BND.ADDR | BND.PORT, where ATYP fixes the size of BND.ADDR. The first
+ * SOCKS5_REPLY_MIN bytes always tell the full length, so a reply takes at most two reads. A domain
+ * reply shorter than that (a name under 3 bytes, which Tor never sends) is rejected instead of
+ * swallowing the first bytes of the stream.
+ * @param reply The reply bytes read so far.
+ * @param have Number of bytes in reply.
+ * @return Total reply length (more than have if the caller must keep reading), 0 if malformed.
+ */
+static size_t socks5_reply_length(const unsigned char *reply, size_t have) {
+    if (have < SOCKS5_REPLY_MIN) {
+        return SOCKS5_REPLY_MIN;
+    }
+    if (reply[0] != SOCKS_VERSION) {
+        return 0;
+    }
+    // A failure reply ends the stream anyway: don't wait for a BND.ADDR that may never come
+    if (reply[1] != SOCKS_REPLY_SUCCESS) {
+        return have;
+    }
+    switch (reply[3]) {
+    case SOCKS_ATYP_IPV4:
+        return 10;
+    case SOCKS_ATYP_IPV6:
+        return 22;
+    case SOCKS_ATYP_DOMAINNAME:
+        return reply[4] < 3 ? 0 : 7 + (size_t)reply[4];
+    default:
+        return 0;
+    }
+}
+
+/**
+ * @brief Reads a complete SOCKS5 reply from a blocking socket, and not a byte of stream data after it.
+ * @param sockfd The socket connected to the SOCKS proxy.
+ * @param reply Buffer of SOCKS5_REPLY_MAX bytes; the first have bytes were read already.
+ * @param have Number of reply bytes already in reply.
+ * @return Length of the reply, or -1 with errno set if the stream ended early (ECONNRESET), the
+ * reply is malformed (EPROTO) or did not come before the deadline (ETIMEDOUT).
+ */
+static ssize_t socks5_read_reply(int sockfd, char *reply, size_t have) {
+    size_t need;
+    ssize_t n;
+
+    while ((need = socks5_reply_length((const unsigned char *)reply, have)) > have) {
+        n = socks5_recv_all(sockfd, reply + have, need - have, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && errno == ETIMEDOUT) {
+            fprintf(stderr, "TORSOCKS_WRAPPER: SOCKS handshake timed out.\n");
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        if (n <= 0) {
+            errno = n == 0 ? ECONNRESET : errno;
+            return -1;
+        }
+        have += (size_t)n;
+    }
+    if (need == 0) {
+        fprintf(stderr, "TORSOCKS_WRAPPER: Malformed SOCKS reply.\n");
+        errno = EPROTO;
+        return -1;
+    }
+    return (ssize_t)have;
+}
+
+static size_t socks5_build_greeting(char *buffer, int stripe);
+#if TOR_NEGATIVE_CACHE
+static void socks5_negative_add(const char *request, size_t request_len, int reply);
+#else
+#define socks5_negative_add(request, request_len, reply) ((void)0)
+#endif
+#if TOR_OPTIMISTIC_DATA
+static int socks5_optimistic_start(int sockfd, const char *request, size_t request_len,
+                                   const char *greeting, size_t greeting_len);
+#endif
+
+#if TOR_PIPELINED_HANDSHAKE
+/**
+ * @brief Sends the greeting and the CONNECT request in one sendmsg() and reads both replies in one recvmsg().
+ * Only one method is ever offered, so the request can follow the greeting without waiting for the method reply.
+ * @param sockfd The socket already connected to 127.0.0.1:9050.
+ * @param greeting The greeting, from socks5_build_greeting().
+ * @param greeting_len Length of greeting.
+ * @param request The CONNECT request.
+ * @param request_len Length of request.
+ * @param reply Receives the CONNECT reply, without the method reply in front of it.
+ * @param reply_len Number of CONNECT reply bytes to read.
+ * @return Number of CONNECT reply bytes read, -1 on failure.
+ */
+static ssize_t socks5_pipelined_exchange(int sockfd, const char *greeting, size_t greeting_len,
+                                         const char *request, size_t request_len, char *reply, size_t reply_len) {
+    char method_reply[sizeof(socks5_handshake_success)];
+    struct iovec iov[2];
+    struct msghdr msg;
+    size_t total = greeting_len + request_len;
+    size_t sent;
+    ssize_t n;
+
+    // 1. Greeting | CONNECT request in a single vectored write; MSG_NOSIGNAL, since a SocksPort that
+    // closed on us must fail connect() with EPIPE rather than raise SIGPIPE in the application
+    iov[0].iov_base = (void *)greeting;
+    iov[0].iov_len = greeting_len;
+    iov[1].iov_base = (void *)request;
+    iov[1].iov_len = request_len;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    n = real_sendmsg(sockfd, &msg, MSG_NOSIGNAL);
+    if (n < 0) {
+        return -1;
+    }
+    // A fresh loopback socket takes both at once; finish the write if it ever does not
+    for (sent = (size_t)n; sent < total; sent += (size_t)n) {
+        if (sent < greeting_len) {
+            n = real_send(sockfd, greeting + sent, greeting_len - sent, MSG_NOSIGNAL);
+        } else {
+            n = real_send(sockfd, request + (sent - greeting_len), total - sent, MSG_NOSIGNAL);
+        }
+        if (n < 0) {
+            return -1;
+        }
+    }
+
+    // 2. Method reply | CONNECT reply in a single read, scattered straight into the caller's buffer
+    iov[0].iov_base = method_reply;
+    iov[0].iov_len = sizeof(method_reply);
+    iov[1].iov_base = reply;
+    iov[1].iov_len = reply_len;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    n = socks5_recv_deadline(sockfd, &msg, sizeof(method_reply));
+    if (n < (ssize_t)sizeof(method_reply) || memcmp(method_reply, socks5_handshake_success, sizeof(method_reply)) != 0) {
+        socks5_handshake_failed(n, sizeof(method_reply));
+        return -1;
+    }
+    return n - (ssize_t)sizeof(method_reply);
+}
+#endif
+
+/**
+ * @brief Sends a SOCKS5 CONNECT command and checks the reply.
+ * @param sockfd The socket already connected to 127.0.0.1:9050.
+ * @param request The CONNECT request built by socks5_request_build().
+ * @param request_len Length of request.
+ * @param stripe The isolation token to authenticate with.
+ * @param reply Receives the CONNECT reply code; untouched if no reply was read.
+ * @return 0 on SOCKS success, -1 with errno set on failure.
+ */
+static int perform_socks5_negotiation(int sockfd, const char *request, size_t request_len, int stripe, int *reply) {
+    char buffer[SOCKS5_REPLY_MAX];
+    ssize_t bytes_read;
+
+    // 1. The CONNECT request is built before the greeting, so that the pipelined mode can send both together
+    char greeting[SOCKS5_GREETING_MAX];
+    size_t greeting_len = socks5_build_greeting(greeting, stripe);
+
+#if TOR_OPTIMISTIC_DATA
+    // Optimistic data: greeting + CONNECT leave with the first write, the reply is read on the first read
+    if (socks5_optimistic_start(sockfd, request, request_len, greeting, greeting_len) == 0) {
+        socks5_trace_flag(&trace_current, SOCKS5_TRACE_OPTIMISTIC);
+        return 0;
+    }
+#endif
+
+#if TOR_PIPELINED_HANDSHAKE
+    // 2. Greeting + CONNECT request in one write, method reply + final reply in one read
+    bytes_read = socks5_pipelined_exchange(sockfd, greeting, greeting_len, request, request_len, buffer, SOCKS5_REPLY_MIN);
+    if (bytes_read >= 0) {
+        socks5_trace_mark(&trace_current, SOCKS5_TRACE_GREETING);
+        bytes_read = socks5_read_reply(sockfd, buffer, (size_t)bytes_read);
+    }
+#else
+    char method_reply[sizeof(socks5_handshake_success)];
+
+    // 2. Initial Handshake
+    if (real_send(sockfd, greeting, greeting_len, 0) < 0) {
+        return -1;
+    }
+    bytes_read = socks5_recv_all(sockfd, method_reply, sizeof(method_reply), sizeof(method_reply));
+    if (bytes_read != (ssize_t)sizeof(method_reply) || memcmp(method_reply, socks5_handshake_success, sizeof(method_reply)) != 0) {
+        socks5_handshake_failed(bytes_read, sizeof(method_reply));
+        return -1;
+    }
+
+    socks5_trace_mark(&trace_current, SOCKS5_TRACE_GREETING);
+    if (real_send(sockfd, request, request_len, 0) < 0) {
+        return -1;
+    }
+
+    // 3. Receive final SOCKS reply
+    bytes_read = socks5_read_reply(sockfd, buffer, 0);
+#endif
+    if (bytes_read < 2) {
+        socks5_trace_reply(&trace_current, 0xff);
+        return -1;
+    }
+    *reply = (unsigned char)buffer[1];
+    socks5_trace_reply(&trace_current, *reply);
+    if (*reply != SOCKS_REPLY_SUCCESS) {
+        socks5_reply_failed(*reply);
+        socks5_negative_add(request, request_len, *reply);
+        return -1;
+    }
+
+    return 0; // SOCKS negotiation successful
+}
+
+// --- Runtime configuration snapshot ---
+// Everything connect() takes from the configuration (the parsed SocksPort addresses and hash ring, the
+// bypass trie, the pool bounds) is built once into an immutable snapshot. A reload builds a complete new
+// snapshot and publishes it with one atomic pointer store, RCU-style: readers only load the pointer and
+// never take a lock, and a replaced snapshot stays valid until no connect() can still be using it.
+struct socks5_shard_table;
+struct socks5_bypass_table;
+
+struct socks5_config {
+    unsigned int generation;                  // Bumped by every reload; pooled connections of older ones are dropped
+    const struct socks5_shard_table *shards;  // SocksPorts, strategy and hash ring
+    const struct socks5_bypass_table *bypass; // Destinations connected to directly
+    int pool_min, pool_max;                   // Pre-warmed pool bounds, pool_max <= TOR_POOL_MAX
+    int hedge_delay_ms;
+    int negative_cache_ms, negative_cache_jitter; // Negative cache TTL and its spread in percent
+    char trace_file[PATH_MAX];                // Connect trace, ".<pid>" appended; read once per process
+    char metrics_segment[PATH_MAX];           // Shared counters; read once per process
+    char admission_segment[PATH_MAX];         // Shared admission tickets; read once per process
+    int admission_limit, admission_wait_ms;   // Handshakes in flight per SocksPort, longest wait for a turn
+    int breaker_failures, breaker_probe_ms;   // Failed proxy connects that mark a SocksPort down, probe period
+    int handshake_timeout_ms, greeting_timeout_ms; // Blocking handshake deadlines, 0 = none
+};
+
+static struct socks5_config *config_current = NULL; // Published snapshot (atomic), never modified afterwards
+
+#if TOR_CONFIG_RELOAD
+// Reader epochs: code that dereferences a snapshot runs between socks5_config_enter() and
+// socks5_config_leave(), counted under the epoch it entered in. The watcher moves to the next epoch only
+// when the previous one has no readers left, and frees a replaced snapshot two epochs after replacing
+// it, when every reader that could have loaded it has left. A handshake that waits on Tor for minutes
+// (HandshakeTimeoutMs 0) delays the free instead of racing it.
+static unsigned int config_epoch = 0;              // Advanced by the watcher thread only
+static unsigned int config_readers[2] = {0, 0};    // Threads inside, by parity of the epoch they entered in
+static __thread unsigned int config_depth = 0;     // Nested enters count once
+static __thread unsigned int config_entered = 0;   // Epoch of the outermost enter
+
+/**
+ * @brief Marks this thread as a reader of the configuration until the matching socks5_config_leave().
+ */
+static void socks5_config_enter(void) {
+    if (config_depth++) {
+        return;
+    }
+    for (;;) {
+        unsigned int epoch = __atomic_load_n(&config_epoch, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&config_readers[epoch & 1], 1, __ATOMIC_SEQ_CST);
+        // The watcher may have checked this parity for the epoch before: count again under the new one
+        if (__atomic_load_n(&config_epoch, __ATOMIC_SEQ_CST) == epoch) {
+            config_entered = epoch;
+            return;
+        }
+        __atomic_sub_fetch(&config_readers[epoch & 1], 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+static void socks5_config_leave(void) {
+    if (--config_depth == 0) {
+        __atomic_sub_fetch(&config_readers[config_entered & 1], 1, __ATOMIC_SEQ_CST);
+    }
+}
+#else
+#define socks5_config_enter() ((void)0) // Without reload a snapshot is never freed
+#define socks5_config_leave() ((void)0)
+#endif
+
+/**
+ * @brief The configuration in effect: a single atomic load once the constructor has run.
+ */
+static const struct socks5_config *socks5_config(void) {
+    const struct socks5_config *cfg = __atomic_load_n(&config_current, __ATOMIC_ACQUIRE);
+
+    if (!cfg) {
+        // Another library's constructor connects before ours has run
+        socks5_config_load();
+        cfg = __atomic_load_n(&config_current, __ATOMIC_ACQUIRE);
+    }
+    return cfg;
+}
+
+// --- Bypass list: CIDR radix trie ---
+// Loopback sidecars and other local services must not detour through Tor, which refuses private
+// destinations anyway. Every configuration snapshot compiles BypassRules (TOR_BYPASS_RULES by default)
+// into a binary trie per address family, so a lookup walks at most prefix-length nodes and never allocates. The deepest matching prefix decides:
+// a "!" rule forces its range back through Tor inside a broader bypass. Runs of nodes with a single child
+// and no rule are crossed in one step, so the loopback checks cost a comparison rather than a walk of
+// 8 (127.0.0.0/8) or 128 (::1) nodes.
+#define SOCKS5_BYPASS_RULES_MAX 256
+
+struct socks5_bypass_rule {
+    int family;             // AF_INET or AF_INET6
+    unsigned char addr[16];
+    int prefix_len;
+    uint16_t port_lo, port_hi;
+    int force;              // Proxy even though a shorter prefix is bypassed
+    int next;               // Next rule on the same prefix (index + 1), 0 = none
+};
+
+struct socks5_trie_node {
+    int child[2];   // Node index per next address bit, 0 = none (the roots are never children)
+    int rule;       // First rule ending at this prefix (index + 1), 0 = none
+    int skip;       // Bits of the one-way run starting here (no rule, a single child), 0 = none
+    int skip_node;  // Node at the end of the run
+    int skip_rule;  // Rule whose address spells the run's bits (index)
+};
+
+struct socks5_bypass_table {
+    struct socks5_bypass_rule rules[SOCKS5_BYPASS_RULES_MAX];
+    struct socks5_trie_node *trie; // Node 0: IPv4 root, node 1: IPv6 root; NULL without rules
+};
+
+/**
+ * @brief Parses one rule: "[!]prefix[/len][:port[-port]]", IPv6 in brackets when it has a port,
+ * e.g. "10.0.0.0/8", "192.168.1.5:8080-8090", "!10.1.2.0/24", "[fe80::]/10:5353", "::1".
+ * @return 0 on success, -1 if the rule is malformed.
+ */
+static int socks5_bypass_parse(const char *spec, struct socks5_bypass_rule *rule) {
+    char host[INET6_ADDRSTRLEN];
+    const char *rest;
+    size_t host_len;
+    char *end;
+
+    memset(rule, 0, sizeof(*rule));
+    if (*spec == '!') {
+        rule->force = 1;
+        spec++;
+    }
+    // 1. Split the address from "/len" and ":ports"
+    if (*spec == '[') {
+        rest = strchr(spec, ']');
+        if (!rest) {
+            return -1;
+        }
+        spec++;
+        host_len = (size_t)(rest - spec);
+        rest++;
+    } else if ((rest = strchr(spec, '/')) == NULL) {
+        rest = strchr(spec, ':');
+        // Without brackets a second colon means a bare IPv6 address, not a port
+        if (rest && strchr(rest + 1, ':')) {
+            rest = NULL;
+        }
+        host_len = rest ? (size_t)(rest - spec) : strlen(spec);
+        if (!rest) {
+            rest = spec + host_len;
+        }
+    } else {
+        host_len = (size_t)(rest - spec);
+    }
+    if (host_len == 0 || host_len >= sizeof(host)) {
+        return -1;
+    }
+    memcpy(host, spec, host_len);
+    host[host_len] = '\0';
+    if (inet_pton(AF_INET, host, rule->addr) == 1) {
+        rule->family = AF_INET;
+        rule->prefix_len = 32;
+    } else if (inet_pton(AF_INET6, host, rule->addr) == 1) {
+        rule->family = AF_INET6;
+        rule->prefix_len = 128;
+    } else {
+        return -1;
+    }
+
+    // 2. Prefix length, then the port range (all ports without one)
+    if (*rest == '/') {
+        long len = strtol(rest + 1, &end, 10);
+        if (end == rest + 1 || len < 0 || len > rule->prefix_len) {
+            return -1;
+        }
+        rule->prefix_len = (int)len;
+        rest = end;
+    }
+    rule->port_lo = 0;
+    rule->port_hi = 65535;
+    if (*rest == ':') {
+        long lo = strtol(rest + 1, &end, 10);
+        long hi = lo;
+        if (end == rest + 1) {
+            return -1;
+        }
+        if (*end == '-') {
+            rest = end + 1;
+            hi = strtol(rest, &end, 10);
+            if (end == rest) {
+                return -1;
+            }
+        }
+        if (lo < 0 || hi > 65535 || lo > hi) {
+            return -1;
+        }
+        rule->port_lo = (uint16_t)lo;
+        rule->port_hi = (uint16_t)hi;
+        rest = end;
+    }
+    return *rest == '\0' ? 0 : -1;
+}
+
+/**
+ * @brief Compiles a rule list into the trie of a configuration snapshot.
+ * @param bypass The table to fill (zeroed).
+ * @param rules Rules as "rule,rule,...", may be empty.
+ */
+static void socks5_bypass_build(struct socks5_bypass_table *bypass, const char *rules) {
+    struct socks5_bypass_rule *bypass_rules = bypass->rules;
+    char *list = strdup(rules);
+    char *saveptr = NULL;
+    char *spec;
+    int rule_count = 0;
+    int node_count = 2;
+    int nodes_max = 2;
+    int *node_rule;
+    int i, bit;
+
+    for (spec = list ? strtok_r(list, ", ", &saveptr) : NULL; spec; spec = strtok_r(NULL, ", ", &saveptr)) {
+        if (rule_count == SOCKS5_BYPASS_RULES_MAX) {
+            fprintf(stderr, "TORSOCKS_WRAPPER: More than %d bypass rules, ignoring the rest.\n", SOCKS5_BYPASS_RULES_MAX);
+            break;
+        }
+        if (socks5_bypass_parse(spec, &bypass_rules[rule_count]) < 0) {
+            fprintf(stderr, "TORSOCKS_WRAPPER: Ignoring malformed bypass rule '%s'.\n", spec);
+            continue;
+        }
+        nodes_max += bypass_rules[rule_count].prefix_len;
+        rule_count++;
+    }
+    free(list);
+    if (rule_count == 0) {
+        return;
+    }
+
+    // Every rule adds at most one node per prefix bit, so the trie is allocated once, up front
+    struct socks5_trie_node *trie = calloc((size_t)nodes_max, sizeof(*trie));
+    node_rule = calloc((size_t)nodes_max, sizeof(*node_rule)); // Rule that created each node
+    if (!trie || !node_rule) {
+        fprintf(stderr, "TORSOCKS_WRAPPER: Could not allocate the bypass table.\n");
+        free(trie);
+        free(node_rule);
+        return;
+    }
+    for (i = 0; i < rule_count; i++) {
+        struct socks5_bypass_rule *rule = &bypass_rules[i];
+        int node = rule->family == AF_INET ? 0 : 1;
+        int *link;
+
+        for (bit = 0; bit < rule->prefix_len; bit++) {
+            int b = (rule->addr[bit >> 3] >> (7 - (bit & 7))) & 1;
+            if (!trie[node].child[b]) {
+                node_rule[node_count] = i;
+                trie[node].child[b] = node_count++;
+            }
+            node = trie[node].child[b];
+        }
+        // Keep the configured order among rules on the same prefix
+        for (link = &trie[node].rule; *link; link = &bypass_rules[*link - 1].next) {
+        }
+        *link = i + 1;
+    }
+
+    // Collapse one-way runs: children always come after their parent, so walking the nodes backwards
+    // finds every child's run before its parent's
+    for (i = node_count - 1; i >= 0; i--) {
+        int child = trie[i].child[0] ? trie[i].child[0] : trie[i].child[1];
+        if (trie[i].rule || !child || (trie[i].child[0] && trie[i].child[1])) {
+            continue;
+        }
+        if (trie[child].skip) {
+            trie[i].skip = trie[child].skip + 1;
+            trie[i].skip_node = trie[child].skip_node;
+        } else {
+            trie[i].skip = 1;
+            trie[i].skip_node = child;
+        }
+        // Any rule under the run's end passed through every node of the run
+        trie[i].skip_rule = node_rule[trie[i].skip_node];
+    }
+    free(node_rule);
+    bypass->trie = trie;
+}
+
+/**
+ * @brief Compares bits [from, to) of two addresses, most significant bit first.
+ * @return 1 if they are equal.
+ */
+static int socks5_bits_equal(const unsigned char *a, const unsigned char *b, int from, int to) {
+    int first = from >> 3;
+    int last = (to - 1) >> 3;
+    unsigned int head = 0xffu >> (from & 7);
+    unsigned int tail = (0xffu << (7 - ((to - 1) & 7))) & 0xff;
+
+    if (first == last) {
+        return !((a[first] ^ b[first]) & head & tail);
+    }
+    // Partial first and last bytes, whole bytes in between
+    return !((a[first] ^ b[first]) & head) && !((a[last] ^ b[last]) & tail) &&
+           memcmp(a + first + 1, b + first + 1, (size_t)(last - first - 1)) == 0;
+}
+
+/**
+ * @brief Tells whether a destination is on the bypass list and must be connected to directly.
+ * IPv4-mapped IPv6 addresses (::ffff:a.b.c.d) are looked up as IPv4.
+ * @param addr The destination (AF_INET or AF_INET6).
+ * @return 1 to bypass Tor, 0 to proxy.
+ */
+static int socks5_bypass(const struct sockaddr *addr) {
+    const struct socks5_bypass_table *table = socks5_config()->bypass;
+    const struct socks5_bypass_rule *bypass_rules = table->rules;
+    const struct socks5_trie_node *bypass_trie = table->trie;
+    const unsigned char *bytes;
+    uint16_t port;
+    int bits;
+    int node;
+    int bypass = 0;
+    int depth;
+
+    if (!bypass_trie) {
+        return 0;
+    }
+    if (addr->sa_family == AF_INET6) {
+        const struct sockaddr_in6 *addr6 = (const struct sockaddr_in6 *)addr;
+        bytes = addr6->sin6_addr.s6_addr;
+        port = ntohs(addr6->sin6_port);
+        bits = 128;
+        node = 1;
+        if (IN6_IS_ADDR_V4MAPPED(&addr6->sin6_addr)) {
+            bytes += 12;
+            bits = 32;
+            node = 0;
+        }
+    } else {
+        const struct sockaddr_in *addr4 = (const struct sockaddr_in *)addr;
+        bytes = (const unsigned char *)&addr4->sin_addr;
+        port = ntohs(addr4->sin_port);
+        bits = 32;
+        node = 0;
+    }
+
+    // Walk the address bits; every prefix with a rule for this port overrides the shorter ones
+    for (depth = 0; ; ) {
+        const struct socks5_trie_node *trie_node = &bypass_trie[node];
+        int rule;
+        for (rule = trie_node->rule; rule; rule = bypass_rules[rule - 1].next) {
+            if (port >= bypass_rules[rule - 1].port_lo && port <= bypass_rules[rule - 1].port_hi) {
+                bypass = !bypass_rules[rule - 1].force;
+                break;
+            }
+        }
+        if (depth == bits) {
+            break;
+        }
+        if (trie_node->skip) {
+            // A run without rules: either the address follows all of it, or the walk ends here anyway
+            if (!socks5_bits_equal(bytes, bypass_rules[trie_node->skip_rule].addr, depth, depth + trie_node->skip)) {
+                break;
+            }
+            depth += trie_node->skip;
+            node = trie_node->skip_node;
+            continue;
+        }
+        node = trie_node->child[(bytes[depth >> 3] >> (7 - (depth & 7))) & 1];
+        if (!node) {
+            break;
+        }
+        depth++;
+    }
+    return bypass;
+}
+
+// --- Proxy leg: SocksPort shards (TCP loopback or unix-domain) ---
+// Tor is essentially single-threaded, so one instance caps the throughput of the whole host. Every
+// SocksPort the shim may use is a shard. SocksPorts lists them (several Tor instances); without a list
+// the only shard is TorUnixSocket, or TorAddress:TorPort. ShardStrategy picks the shard of each new
+// connection. The defaults are TOR_SOCKS_SHARDS, TOR_SOCKS_UNIX_PATH, TOR_SOCKS_ADDR:TOR_SOCKS_PORT and
+// TOR_SHARD_STRATEGY.
+#define TOR_SHARD_ROUND_ROBIN 0       // Next shard in turn
+#define TOR_SHARD_LEAST_OUTSTANDING 1 // Shard with the fewest proxied streams open
+#define TOR_SHARD_CONSISTENT_HASH 2   // Hash of the destination host: the same host keeps its Tor instance
+#define TOR_SHARD_MAX 16
+#define TOR_SHARD_VNODES 64           // Points per shard on the hash ring, so shards get even arcs
+
+struct socks5_shard {
+    struct sockaddr_storage addr; // AF_INET, AF_INET6 or AF_UNIX
+    socklen_t addr_len;
+    char name[128];               // As configured, for messages
+};
+
+struct socks5_ring_point {
+    uint32_t hash;
+    int shard;
+};
+
+struct socks5_shard_table {
+    struct socks5_shard shard[TOR_SHARD_MAX];
+    int count;
+    int strategy; // TOR_SHARD_*
+    struct socks5_ring_point ring[TOR_SHARD_MAX * TOR_SHARD_VNODES];
+};
+
+static int shard_outstanding[TOR_SHARD_MAX]; // Proxied streams open per shard index (atomic), across reloads
+static unsigned int shard_cursor = 0; // Round-robin position (atomic)
+
+/**
+ * @brief FNV-1a, for the consistent-hash ring.
+ */
+static uint32_t socks5_hash(const void *data, size_t len, uint32_t hash) {
+    const unsigned char *p = data;
+    while (len--) {
+        hash = (hash ^ *p++) * 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * @brief Parses one SocksPort: "unix:/path", "[v6 literal]:port" or "v4 literal:port".
+ * @return 0 on success, -1 if the entry is malformed.
+ */
+static int socks5_shard_parse(const char *spec, struct socks5_shard *shard) {
+    char host[INET6_ADDRSTRLEN];
+    const char *colon;
+    const char *host_start = spec;
+    size_t host_len;
+    long port;
+    char *end;
+
+    memset(shard, 0, sizeof(*shard));
+    strncpy(shard->name, spec, sizeof(shard->name) - 1);
+    if (strncmp(spec, "unix:", 5) == 0) {
+        struct sockaddr_un *unix_addr = (struct sockaddr_un *)&shard->addr;
+        if (spec[5] == '\0' || strlen(spec + 5) >= sizeof(unix_addr->sun_path)) {
+            return -1;
+        }
+        unix_addr->sun_family = AF_UNIX;
+        strcpy(unix_addr->sun_path, spec + 5);
+        shard->addr_len = sizeof(*unix_addr);
+        return 0;
+    }
+
+    colon = strrchr(spec, ':');
+    if (!colon) {
+        return -1;
+    }
+    host_len = (size_t)(colon - spec);
+    if (spec[0] == '[') {
+        if (host_len < 2 || colon[-1] != ']') {
+            return -1;
+        }
+        host_start = spec + 1;
+        host_len -= 2;
+    }
+    port = strtol(colon + 1, &end, 10);
+    if (host_len == 0 || host_len >= sizeof(host) || *end != '\0' || port <= 0 || port > 65535) {
+        return -1;
+    }
+    memcpy(host, host_start, host_len);
+    host[host_len] = '\0';
+
+    struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *)&shard->addr;
+    struct sockaddr_in *addr4 = (struct sockaddr_in *)&shard->addr;
+    if (inet_pton(AF_INET6, host, &addr6->sin6_addr) == 1) {
+        addr6->sin6_family = AF_INET6;
+        addr6->sin6_port = htons((uint16_t)port);
+        shard->addr_len = sizeof(*addr6);
+    } else if (inet_pton(AF_INET, host, &addr4->sin_addr) == 1) {
+        addr4->sin_family = AF_INET;
+        addr4->sin_port = htons((uint16_t)port);
+        shard->addr_len = sizeof(*addr4);
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+static int socks5_ring_compare(const void *a, const void *b) {
+    uint32_t ha = ((const struct socks5_ring_point *)a)->hash;
+    uint32_t hb = ((const struct socks5_ring_point *)b)->hash;
+    return ha < hb ? -1 : ha > hb;
+}
+
+/**
+ * @brief Builds the shard table (and the hash ring) of a configuration snapshot.
+ * @param table The table to fill (zeroed).
+ * @param list SocksPorts as "spec,spec,...", may be empty.
+ * @param fallback The only SocksPort when the list has no usable entry.
+ * @param strategy TOR_SHARD_*.
+ */
+static void socks5_shards_build(struct socks5_shard_table *table, const char *list, const char *fallback, int strategy) {
+    char *copy = strdup(list);
+    char *saveptr = NULL;
+    char *spec;
+    int i, v;
+
+    table->strategy = strategy;
+    for (spec = copy ? strtok_r(copy, ", ", &saveptr) : NULL; spec; spec = strtok_r(NULL, ", ", &saveptr)) {
+        if (table->count == TOR_SHARD_MAX) {
+            fprintf(stderr, "TORSOCKS_WRAPPER: More than %d SocksPorts configured, ignoring the rest.\n", TOR_SHARD_MAX);
+            break;
+        }
+        if (socks5_shard_parse(spec, &table->shard[table->count]) < 0) {
+            fprintf(stderr, "TORSOCKS_WRAPPER: Ignoring malformed SocksPort '%s'.\n", spec);
+            continue;
+        }
+        table->count++;
+    }
+    free(copy);
+    if (table->count == 0) {
+        if (socks5_shard_parse(fallback, &table->shard[0]) < 0) {
+            fprintf(stderr, "TORSOCKS_WRAPPER: Malformed Tor SOCKS proxy address '%s'.\n", fallback);
+        }
+        table->count = 1;
+    }
+
+    for (i = 0; i < table->count; i++) {
+        for (v = 0; v < TOR_SHARD_VNODES; v++) {
+            uint32_t hash = socks5_hash(table->shard[i].name, strlen(table->shard[i].name), 2166136261u);
+            table->ring[i * TOR_SHARD_VNODES + v].hash = socks5_hash(&v, sizeof(v), hash);
+            table->ring[i * TOR_SHARD_VNODES + v].shard = i;
+        }
+    }
+    qsort(table->ring, (size_t)(table->count * TOR_SHARD_VNODES), sizeof(table->ring[0]), socks5_ring_compare);
+}
+
+/**
+ * @brief Picks the shard for a new connection according to the configured strategy.
+ * @param key Destination host, hashed by TOR_SHARD_CONSISTENT_HASH.
+ * @param key_len Length of key.
+ * @return Index into the current snapshot's shard table.
+ */
+static int socks5_shard_for_key(const void *key, size_t key_len) {
+    const struct socks5_shard_table *table = socks5_config()->shards;
+    int shard_count = table->count;
+
+    if (shard_count == 1) {
+        return 0;
+    }
+    if (table->strategy == TOR_SHARD_CONSISTENT_HASH) {
+        uint32_t hash = socks5_hash(key, key_len, 2166136261u);
+        size_t lo = 0, hi = (size_t)(shard_count * TOR_SHARD_VNODES);
+        // First ring point at or after the key, wrapping around to the start
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (table->ring[mid].hash < hash) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        return table->ring[lo == (size_t)(shard_count * TOR_SHARD_VNODES) ? 0 : lo].shard;
+    }
+
+    int start = (int)(__atomic_fetch_add(&shard_cursor, 1, __ATOMIC_RELAXED) % (unsigned int)shard_count);
+    if (table->strategy == TOR_SHARD_LEAST_OUTSTANDING) {
+        // Scan from the rotating start so ties do not all land on the first shard
+        int best = start;
+        int best_load = __atomic_load_n(&shard_outstanding[start], __ATOMIC_RELAXED);
+        int i;
+        for (i = 1; i < shard_count; i++) {
+            int candidate = (start + i) % shard_count;
+            int load = __atomic_load_n(&shard_outstanding[candidate], __ATOMIC_RELAXED);
+            if (load < best_load) {
+                best = candidate;
+                best_load = load;
+            }
+        }
+        return best;
+    }
+    return start;
+}
+
+/**
+ * @brief Looks up a shard picked earlier. A reload may have shortened the list in between; such a
+ * connection falls back to the first SocksPort.
+ */
+static const struct socks5_shard *socks5_shard_get(int shard) {
+    const struct socks5_shard_table *table = socks5_config()->shards;
+    return &table->shard[shard < table->count ? shard : 0];
+}
+
+/**
+ * @brief Picks the shard for a request; the hash key is the destination Tor is asked to reach.
+ */
+static int socks5_shard_pick(const struct socks5_request *request) {
+    return socks5_shard_for_key(request->key, request->key_len);
+}
+
+/**
+ * @brief Asks for TCP Fast Open on a TCP proxy leg. connect() then returns at once and the first write
+ * carries the greeting in the SYN. Without a cookie the kernel falls back to a normal handshake, and
+ * kernels without TCP_FASTOPEN_CONNECT just reject the option. Tor does not enable Fast Open on its
+ * listener itself, so the SocksPort host needs net.ipv4.tcp_fastopen with the 0x2 and 0x400 bits.
+ * @param fd The socket about to connect to the SocksPort.
+ */
+static void socks5_enable_fastopen(int fd) {
+#if TOR_SOCKS_FASTOPEN && defined(TCP_FASTOPEN_CONNECT)
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &one, sizeof(one));
+#else
+    (void)fd;
+#endif
+}
+
+/**
+ * @brief Opens a new socket connected to a SocksPort shard (TCP or unix-domain).
+ * @param shard Index into the current snapshot's shard table.
+ * @param fl_flags File status flags for the socket, set before connecting; 0 for a blocking connect.
+ * @param connecting Set when an O_NONBLOCK connect is still in progress; may be NULL for a blocking one.
+ * @return The fd (FD_CLOEXEC), or -1 with errno set.
+ */
+static int socks5_open_proxy_socket(int shard, int fl_flags, int *connecting) {
+    const struct socks5_shard *proxy = socks5_shard_get(shard);
+    int fd = socket(proxy->addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int result;
+
+    if (fd < 0) {
+        return -1;
+    }
+    if (proxy->addr.ss_family != AF_UNIX) {
+        socks5_enable_fastopen(fd);
+    }
+    result = fl_flags && fcntl(fd, F_SETFL, fl_flags) < 0 ? -1 :
+             real_connect(fd, (const struct sockaddr *)&proxy->addr, proxy->addr_len);
+    if (result < 0 && (errno != EINPROGRESS || !(fl_flags & O_NONBLOCK))) {
+        int saved_errno = errno;
+        real_close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+    if (connecting) {
+        *connecting = result < 0;
+    }
+    return fd;
+}
+
+/**
+ * @brief Whether the application bound sockfd (bind() or IP_BIND_ADDRESS_NO_PORT), which a socket swap would undo.
+ */
+static inline int socks5_socket_bound(int sockfd) {
+    struct sockaddr_storage local;
+    socklen_t len = sizeof(local);
+
+    if (getsockname(sockfd, (struct sockaddr *)&local, &len) < 0) {
+        return 1;
+    }
+    if (local.ss_family == AF_INET) {
+        const struct sockaddr_in *sin = (const struct sockaddr_in *)&local;
+        return sin->sin_port != 0 || sin->sin_addr.s_addr != htonl(INADDR_ANY);
+    }
+    if (local.ss_family == AF_INET6) {
+        const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)&local;
+        return sin6->sin6_port != 0 || !IN6_IS_ADDR_UNSPECIFIED(&sin6->sin6_addr);
+    }
+    return 1;
+}
+
+/**
+ * @brief Connects the application's socket to a SocksPort shard.
+ * A unix-domain shard gets its own AF_UNIX socket, which is connected and dup3()'d over sockfd, keeping
+ * its file status flags and FD_CLOEXEC. That skips the loopback TCP stack, the ephemeral port and
+ * TIME_WAIT. The same swap lets an AF_INET6 socket reach a SocksPort on 127.0.0.1, or an AF_INET socket
+ * one on [::1]. A non-blocking caller gets a non-blocking connect on the new socket as well.
+ * The swap replaces the socket behind sockfd, which the application can notice:
+ * - getsockname() reports the new socket's address (AF_UNIX, or the other IP family);
+ * - options set before connect() are gone, and TCP-level setsockopt() fails on an AF_UNIX socket;
+ * - the kernel drops epoll registrations of the old socket; the shim adds them back only for a
+ *   handshake it drives from epoll_wait(), i.e. a non-blocking connect().
+ * A full AF_UNIX backlog fails a non-blocking connect with EAGAIN, as it does without the shim.
+ * @param sockfd The application's socket.
+ * @param shard Index into the current snapshot's shard table.
+ * @return Same as connect().
+ */
+static int socks5_connect_proxy(int sockfd, int shard) {
+    const struct socks5_shard *proxy = socks5_shard_get(shard);
+    int fl_flags, fd_flags;
+    int domain = AF_UNSPEC;
+    socklen_t domain_len = sizeof(domain);
+    int proxy_fd;
+    int connecting;
+
+    if (proxy->addr.ss_family != AF_UNIX &&
+        (real_getsockopt(sockfd, SOL_SOCKET, SO_DOMAIN, &domain, &domain_len) < 0 || domain == proxy->addr.ss_family)) {
+        socks5_enable_fastopen(sockfd);
+        return real_connect(sockfd, (const struct sockaddr *)&proxy->addr, proxy->addr_len);
+    }
+
+    fl_flags = fcntl(sockfd, F_GETFL);
+    fd_flags = fcntl(sockfd, F_GETFD);
+    if (fl_flags < 0 || fd_flags < 0) {
+        return -1;
+    }
+
+    // The flags go on before connect(), so a non-blocking caller never waits for the SocksPort here.
+    // Still connecting: swap anyway, the connect finishes on sockfd and the caller sees EINPROGRESS.
+    proxy_fd = socks5_open_proxy_socket(shard, (fl_flags & O_NONBLOCK) ? fl_flags : 0, &connecting);
+    if (proxy_fd < 0) {
+        return -1;
+    }
+    if (real_dup3(proxy_fd, sockfd, (fd_flags & FD_CLOEXEC) ? O_CLOEXEC : 0) < 0) {
+        int saved_errno = errno;
+        real_close(proxy_fd);
+        errno = saved_errno;
+        return -1;
+    }
+    real_close(proxy_fd);
+    if (connecting) {
+        errno = EINPROGRESS;
+        return -1;
+    }
+    return 0;
+}
+
+#if TOR_PROXY_BREAKER
+// --- Proxy health: a circuit breaker per SocksPort ---
+// While Tor restarts, every proxied connect() would pay a proxy connect that is refused, and a line on
+// stderr. Each SocksPort has a breaker instead. Closed: a proxy connect that fails counts, one that succeeds
+// clears the count, and BreakerFailures failures in a row open the breaker, with one message. Open:
+// connect() moves to the next SocksPort whose breaker is closed, or fails at once with ECONNREFUSED,
+// touching neither the SocksPort nor stderr. A probe thread, started when a breaker opens, connects to
+// every open SocksPort each BreakerProbeMs and closes the breaker once it is accepted, then exits. Half-open:
+// every BreakerProbeMs one connect() is let through to an open SocksPort anyway, as the trial that closes
+// or reopens the breaker; this recovers in a fork()ed child, which has no probe thread. Breakers are indexed
+// like the shard table and belong to the configuration generation that used them, so a reload starts closed.
+#define SOCKS5_BREAKER_CLOSED 0
+#define SOCKS5_BREAKER_OPEN 1
+#define SOCKS5_BREAKER_HALF_OPEN 2 // A trial connect() is on its way to the SocksPort
+
+struct socks5_breaker {
+    int state;               // SOCKS5_BREAKER_* (atomic)
+    int failures;            // Proxy connects that failed in a row (atomic)
+    unsigned int generation; // Configuration whose shard index the state belongs to (atomic)
+    uint64_t trial_ms;       // Not closed: CLOCK_MONOTONIC after which the next connect() is a trial (atomic)
+    unsigned int rejected;   // connect() calls failed fast since the breaker opened (atomic)
+};
+
+static struct socks5_breaker shard_breaker[TOR_SHARD_MAX];
+static int breaker_probing = 0; // Probe thread running (atomic)
+
+static uint64_t socks5_breaker_now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000u + (uint64_t)now.tv_nsec / 1000000u;
+}
+
+/**
+ * @brief The breaker of a shard, cleared first if an older configuration left it.
+ */
+static struct socks5_breaker *socks5_breaker_get(int shard, const struct socks5_config *cfg) {
+    struct socks5_breaker *breaker = &shard_breaker[shard];
+
+    if (__atomic_load_n(&breaker->generation, __ATOMIC_ACQUIRE) != cfg->generation) {
+        __atomic_store_n(&breaker->state, SOCKS5_BREAKER_CLOSED, __ATOMIC_RELAXED);
+        __atomic_store_n(&breaker->failures, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&breaker->generation, cfg->generation, __ATOMIC_RELEASE);
+    }
+    return breaker;
+}
+
+/**
+ * @brief Whether a shard's breaker is closed (always, with BreakerFailures 0).
+ */
+static int socks5_breaker_closed(int shard) {
+    const struct socks5_config *cfg = socks5_config();
+    return cfg->breaker_failures == 0 ||
+           __atomic_load_n(&socks5_breaker_get(shard, cfg)->state, __ATOMIC_ACQUIRE) == SOCKS5_BREAKER_CLOSED;
+}
+
+/**
+ * @brief Records a proxy connect that succeeded: clears the failure count and closes the breaker.
+ */
+static void socks5_report_proxy_success(int shard) {
+    struct socks5_breaker *breaker = socks5_breaker_get(shard, socks5_config());
+
+    // An open breaker always has failures counted, so this is the whole cost while Tor is up
+    if (__atomic_load_n(&breaker->failures, __ATOMIC_RELAXED) == 0) {
+        return;
+    }
+    __atomic_store_n(&breaker->failures, 0, __ATOMIC_RELAXED);
+    if (__atomic_exchange_n(&breaker->state, SOCKS5_BREAKER_CLOSED, __ATOMIC_ACQ_REL) != SOCKS5_BREAKER_CLOSED) {
+        fprintf(stderr, "TORSOCKS_WRAPPER: Tor SOCKS proxy at %s is back (%u connects failed fast while it was down).\n",
+                socks5_shard_get(shard)->name, __atomic_exchange_n(&breaker->rejected, 0, __ATOMIC_RELAXED));
+    }
+}
+
+/**
+ * @brief Checks whether a SocksPort accepts connections again, waiting at most BreakerProbeMs.
+ * @return 0 if it does, -1 if not.
+ */
+static int socks5_breaker_probe(int shard, const struct socks5_config *cfg) {
+    const struct socks5_shard *proxy = socks5_shard_get(shard);
+    struct timeval timeout = {cfg->breaker_probe_ms / 1000, (cfg->breaker_probe_ms % 1000) * 1000};
+    int fd = socket(proxy->addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int result;
+
+    if (fd < 0) {
+        return -1;
+    }
+    // Bounds the connect to a SocksPort on another host that drops packets instead of refusing
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    result = real_connect(fd, (const struct sockaddr *)&proxy->addr, proxy->addr_len);
+    real_close(fd);
+    return result < 0 ? -1 : 0;
+}
+
+/**
+ * @brief Probe thread: every BreakerProbeMs, tries each SocksPort whose breaker is not closed, and exits
+ * once all breakers are closed.
+ */
+static void *socks5_breaker_worker(void *arg) {
+    (void)arg;
+    for (;;) {
+        const struct socks5_config *cfg;
+        struct timespec pause;
+        int down = 0;
+        int expected = 0;
+        int shard;
+
+        socks5_config_enter();
+        cfg = socks5_config();
+        pause.tv_sec = cfg->breaker_probe_ms / 1000;
+        pause.tv_nsec = (long)(cfg->breaker_probe_ms % 1000) * 1000000;
+        socks5_config_leave();
+        nanosleep(&pause, NULL);
+        socks5_config_enter();
+        cfg = socks5_config();
+        for (shard = 0; shard < cfg->shards->count; shard++) {
+            if (socks5_breaker_closed(shard)) {
+                continue;
+            }
+            if (socks5_breaker_probe(shard, cfg) == 0) {
+                socks5_report_proxy_success(shard);
+            } else {
+                down = 1;
+            }
+        }
+        if (down) {
+            socks5_config_leave();
+            continue;
+        }
+        // A breaker that opened during the scan saw the thread still running: look once more after leaving
+        __atomic_store_n(&breaker_probing, 0, __ATOMIC_SEQ_CST);
+        for (shard = 0; shard < cfg->shards->count && socks5_breaker_closed(shard); shard++) {
+        }
+        down = shard < cfg->shards->count;
+        socks5_config_leave();
+        if (!down || !__atomic_compare_exchange_n(&breaker_probing, &expected, 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            return NULL;
+        }
+    }
+}
+
+// fork() only copies the calling thread: the child starts without the probe thread
+static void socks5_breaker_postfork_child(void) {
+    __atomic_store_n(&breaker_probing, 0, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Starts the probe thread unless it is running.
+ */
+static void socks5_breaker_start(void) {
+    static int atfork_registered = 0;
+    int expected = 0;
+    pthread_attr_t attr;
+    pthread_t thread;
+    sigset_t all, saved;
+
+    if (__atomic_load_n(&breaker_probing, __ATOMIC_RELAXED) ||
+        !__atomic_compare_exchange_n(&breaker_probing, &expected, 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        return;
+    }
+    if (!atfork_registered) {
+        pthread_atfork(NULL, NULL, socks5_breaker_postfork_child);
+        atfork_registered = 1;
+    }
+    // The application's signal handlers must never run on the shim's thread
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &saved);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setstacksize(&attr, 64 * 1024);
+    if (pthread_create(&thread, &attr, socks5_breaker_worker, NULL) != 0) {
+        // Trial connects still close the breakers
+        fprintf(stderr, "TORSOCKS_WRAPPER: Could not start the SocksPort probe thread.\n");
+    }
+    pthread_attr_destroy(&attr);
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+}
+
+/**
+ * @brief Records a proxy connect that failed, printing where the shim tried to reach the Tor SOCKS proxy
+ * while the breaker is closed. BreakerFailures in a row open it.
+ */
+static void socks5_report_proxy_failure(int shard) {
+    const struct socks5_config *cfg = socks5_config();
+    struct socks5_breaker *breaker = socks5_breaker_get(shard, cfg);
+    const char *name = socks5_shard_get(shard)->name;
+    int state = __atomic_load_n(&breaker->state, __ATOMIC_ACQUIRE);
+    int failures;
+
+    if (state != SOCKS5_BREAKER_CLOSED) {
+        // A failed trial, or a connect that started before the breaker opened: stay open, quietly
+        __atomic_add_fetch(&breaker->failures, 1, __ATOMIC_RELAXED);
+        __atomic_compare_exchange_n(&breaker->state, &state, SOCKS5_BREAKER_OPEN, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+        return;
+    }
+    fprintf(stderr, "TORSOCKS_WRAPPER: Could not connect to Tor SOCKS proxy at %s\n", name);
+    if (cfg->breaker_failures == 0) {
+        return;
+    }
+    failures = __atomic_add_fetch(&breaker->failures, 1, __ATOMIC_ACQ_REL);
+    if (failures < cfg->breaker_failures) {
+        return;
+    }
+    // The first trial is due a probe period from now; set before the state so no caller sees a stale one
+    __atomic_store_n(&breaker->trial_ms, socks5_breaker_now_ms() + (uint64_t)cfg->breaker_probe_ms, __ATOMIC_RELEASE);
+    if (!__atomic_compare_exchange_n(&breaker->state, &state, SOCKS5_BREAKER_OPEN, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        return;
+    }
+    __atomic_store_n(&breaker->rejected, 0, __ATOMIC_RELAXED);
+    fprintf(stderr, "TORSOCKS_WRAPPER: %d connects to %s failed in a row; failing fast until it answers again.\n",
+            failures, name);
+    socks5_breaker_start();
+}
+
+/**
+ * @brief Steers a connect() clear of SocksPorts whose breaker is open.
+ * @param shard The shard picked for the connection. Kept if its breaker is closed, or if this connect()
+ * is its trial; otherwise replaced by the next shard whose breaker is closed.
+ * @return 0 if *shard may be used, -1 if no SocksPort is up.
+ */
+static int socks5_breaker_route(int *shard) {
+    const struct socks5_config *cfg = socks5_config();
+    struct socks5_breaker *breaker;
+    uint64_t trial_ms, now_ms;
+    int state = SOCKS5_BREAKER_OPEN;
+    int i;
+
+    if (socks5_breaker_closed(*shard)) {
+        return 0;
+    }
+    // 1. Once per probe period the SocksPort gets a real connect(), whose outcome closes or reopens it
+    breaker = socks5_breaker_get(*shard, cfg);
+    trial_ms = __atomic_load_n(&breaker->trial_ms, __ATOMIC_ACQUIRE);
+    now_ms = socks5_breaker_now_ms();
+    if (now_ms >= trial_ms && __atomic_compare_exchange_n(&breaker->trial_ms, &trial_ms, now_ms + (uint64_t)cfg->breaker_probe_ms,
+                                                         0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        __atomic_compare_exchange_n(&breaker->state, &state, SOCKS5_BREAKER_HALF_OPEN, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    // 2. Otherwise another SocksPort that is up; a fork()ed child restarts the probe thread here
+    socks5_breaker_start();
+    for (i = 1; i < cfg->shards->count; i++) {
+        int candidate = (*shard + i) % cfg->shards->count;
+        if (socks5_breaker_closed(candidate)) {
+            *shard = candidate;
+            return 0;
+        }
+    }
+    __atomic_add_fetch(&breaker->rejected, 1, __ATOMIC_RELAXED);
+    return -1;
+}
+#else
+#define socks5_breaker_closed(shard) 1
+#define socks5_report_proxy_success(shard) ((void)0)
+
+/**
+ * @brief Prints where the shim tried to reach the Tor SOCKS proxy.
+ */
+static void socks5_report_proxy_failure(int shard) {
+    fprintf(stderr, "TORSOCKS_WRAPPER: Could not connect to Tor SOCKS proxy at %s\n", socks5_shard_get(shard)->name);
+}
+#endif
+
+#if TOR_NEGATIVE_CACHE
+// --- Negative cache: destinations Tor just failed to reach ---
+// A CONNECT refused for a reason that lies with the destination rather than the circuit (see the negative
+// column of socks5_reply_codes) is remembered for NegativeCacheMs, give or take NegativeCacheJitter
+// percent so that entries filled by one burst do not all expire together. Until then connect() to the
+// same destination fails at once with the same errno: no proxy connect, no greeting, no circuit attempt.
+// Entries are keyed by the destination part of the CONNECT request (address type, address or name,
+// port), so every path that builds a request shares them. They are spread over shards with a lock each;
+// a full shard replaces the entry that expires first. While the cache is empty connect() skips it.
+#define SOCKS5_NEGATIVE_SHARDS 16
+#define SOCKS5_NEGATIVE_WAYS 16                   // Entries per shard
+#define SOCKS5_NEGATIVE_KEY_MAX (1 + 1 + 255 + 2) // ATYP 0x03 | Name length | Name | Port
+
+struct socks5_negative_entry {
+    uint64_t expires_ms; // CLOCK_MONOTONIC, 0 = free
+    uint32_t hash;
+    int reply;
+    size_t key_len;
+    unsigned char key[SOCKS5_NEGATIVE_KEY_MAX];
+};
+
+struct socks5_negative_shard {
+    pthread_mutex_t lock;
+    struct socks5_negative_entry entry[SOCKS5_NEGATIVE_WAYS];
+};
+
+static struct socks5_negative_shard negative_shards[SOCKS5_NEGATIVE_SHARDS] = {
+    [0 ... SOCKS5_NEGATIVE_SHARDS - 1] = {.lock = PTHREAD_MUTEX_INITIALIZER}};
+static int negative_entries = 0; // Entries in use (atomic); connect() skips the lookup while it is 0
+
+static uint64_t socks5_negative_now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000u + (uint64_t)now.tv_nsec / 1000000u;
+}
+
+/**
+ * @brief Remembers a refused CONNECT if its reply code says the destination failed.
+ * @param request The CONNECT request Tor refused; everything after Ver | Cmd | Rsv is the key.
+ * @param request_len Length of request.
+ * @param reply The reply code Tor refused it with.
+ */
+static void socks5_negative_add(const char *request, size_t request_len, int reply) {
+    const struct socks5_config *cfg;
+    struct socks5_negative_shard *shard;
+    struct socks5_negative_entry *victim = NULL;
+    size_t key_len = request_len - 3;
+    uint64_t now, ttl, spread;
+    uint32_t hash;
+    int i;
+
+    // Also reached from the first read of an optimistic connect, outside connect()
+    socks5_config_enter();
+    cfg = socks5_config();
+    ttl = (uint64_t)cfg->negative_cache_ms;
+    spread = ttl * (uint64_t)cfg->negative_cache_jitter / 100u;
+    socks5_config_leave();
+    if (ttl == 0 || request_len <= 3 || key_len > SOCKS5_NEGATIVE_KEY_MAX || !socks5_reply_lookup(reply)->negative) {
+        return;
+    }
+    hash = socks5_hash(request + 3, key_len, 2166136261u);
+    now = socks5_negative_now_ms();
+    // 1. Expire somewhere in ttl +/- jitter
+    ttl = ttl - spread + socks5_hash(&now, sizeof(now), hash) % (2 * spread + 1);
+
+    // 2. Refresh the destination's entry, else take a free or expired one, else the one expiring first
+    shard = &negative_shards[hash % SOCKS5_NEGATIVE_SHARDS];
+    pthread_mutex_lock(&shard->lock);
+    for (i = 0; i < SOCKS5_NEGATIVE_WAYS; i++) {
+        struct socks5_negative_entry *entry = &shard->entry[i];
+        if (entry->expires_ms && entry->hash == hash && entry->key_len == key_len &&
+            memcmp(entry->key, request + 3, key_len) == 0) {
+            victim = entry;
+            break;
+        }
+        if (!victim || entry->expires_ms < victim->expires_ms) {
+            victim = entry;
+        }
+    }
+    if (victim->expires_ms == 0) {
+        __atomic_add_fetch(&negative_entries, 1, __ATOMIC_RELAXED);
+    }
+    victim->expires_ms = now + (ttl ? ttl : 1);
+    victim->hash = hash;
+    victim->reply = reply;
+    victim->key_len = key_len;
+    memcpy(victim->key, request + 3, key_len);
+    pthread_mutex_unlock(&shard->lock);
+}
+
+/**
+ * @brief Looks a destination up; expired entries met on the way are freed.
+ * @param request A CONNECT request for the destination.
+ * @param request_len Length of request.
+ * @return The reply code Tor refused the destination with, SOCKS5_REPLY_NONE if it is not cached.
+ */
+static int socks5_negative_check(const char *request, size_t request_len) {
+    struct socks5_negative_shard *shard;
+    size_t key_len = request_len - 3;
+    int reply = SOCKS5_REPLY_NONE;
+    uint64_t now;
+    uint32_t hash;
+    int i;
+
+    if (request_len <= 3 || key_len > SOCKS5_NEGATIVE_KEY_MAX) {
+        return SOCKS5_REPLY_NONE;
+    }
+    hash = socks5_hash(request + 3, key_len, 2166136261u);
+    now = socks5_negative_now_ms();
+    shard = &negative_shards[hash % SOCKS5_NEGATIVE_SHARDS];
+    pthread_mutex_lock(&shard->lock);
+    for (i = 0; i < SOCKS5_NEGATIVE_WAYS; i++) {
+        struct socks5_negative_entry *entry = &shard->entry[i];
+        if (entry->expires_ms == 0) {
+            continue;
+        }
+        if (entry->expires_ms <= now) {
+            entry->expires_ms = 0;
+            __atomic_sub_fetch(&negative_entries, 1, __ATOMIC_RELAXED);
+        } else if (entry->hash == hash && entry->key_len == key_len && memcmp(entry->key, request + 3, key_len) == 0) {
+            reply = entry->reply;
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return reply;
+}
+#endif
+
+#if TOR_ADMISSION
+// --- Admission control: handshakes in flight per SocksPort, across processes ---
+// All shim instances on the host map the same file (AdmissionSegment, in /dev/shm by default). Each
+// SocksPort has an entry there, found by the hash of its name, with two counters: tickets handed out and
+// tickets handed back. Ticket t may start its handshake while t - returned < limit, so tickets are served
+// in the order they were taken and nobody arriving later overtakes a waiter. A free turn costs one
+// compare-and-swap. A ticket is handed back when the handshake ends, succeeded or not, or when the fd is
+// closed during it.
+// A waiter parks its ticket in the SocksPort's queue ring, slot t modulo SOCKS5_ADMISSION_QUEUE, together
+// with the limit of its own process, and sleeps on the returned counter with FUTEX_WAIT_BITSET, one bit
+// per ticket modulo 32. Each hand-back admits exactly one queued ticket per limit in use, and wakes only
+// its bit. A waiter that gives up after AdmissionWaitMs marks its slot abandoned instead of handing the
+// ticket back: its turn is handed back when the queue reaches it, so the limit holds while it is queued.
+// Without a free slot (a queue deeper than the ring) a waiter polls every slice and, timed out, leaves
+// only when its turn comes. Tickets of processes that died are recorded with their pid in a holder table;
+// a waiter whose turn has not come within a slice hands them back, or abandons them if still queued.
+#define SOCKS5_ADMISSION_MAGIC 0x3254494d44415354ull // "TSADMIT2"
+#define SOCKS5_ADMISSION_PORTS 64                    // SocksPorts per segment
+#define SOCKS5_ADMISSION_HOLDERS 16384               // Tickets out at once that can be recovered from dead processes
+#define SOCKS5_ADMISSION_QUEUE 1024                  // Queue ring slots per SocksPort
+#define SOCKS5_ADMISSION_SLICE_MS 100                // A waiter checks for dead holders this often
+#define SOCKS5_ADMISSION_LIMIT_MAX 65535             // AdmissionLimit is clamped to this
+
+// Queue ring slot: ticket in the upper half, the waiter's limit and state below; 0 = free
+#define SOCKS5_ADMISSION_WAITING 1   // Parked, turn not yet come
+#define SOCKS5_ADMISSION_ABANDONED 2 // Gave up; the hand-back that admits it hands its turn back too
+#define SOCKS5_ADMISSION_ADMITTED 3  // Turn came; the waiter clears the slot
+#define SOCKS5_ADMISSION_SLOT(t, limit, state) (((uint64_t)(t) << 32) | ((uint64_t)(limit) << 2) | (state))
+#define SOCKS5_ADMISSION_SLOT_TICKET(slot) ((uint32_t)((slot) >> 32))
+#define SOCKS5_ADMISSION_SLOT_LIMIT(slot) ((uint32_t)(slot) >> 2)
+#define SOCKS5_ADMISSION_SLOT_STATE(slot) ((uint32_t)(slot) & 3)
+
+struct socks5_admission_header {
+    uint64_t magic;   // SOCKS5_ADMISSION_MAGIC once the layout fields are set (atomic)
+    uint32_t ports;   // SOCKS5_ADMISSION_PORTS
+    uint32_t holders; // SOCKS5_ADMISSION_HOLDERS
+    uint32_t queue;   // SOCKS5_ADMISSION_QUEUE
+    uint8_t reserved[44];
+};
+
+struct socks5_admission_port {
+    uint32_t hash;      // FNV-1a of the SocksPort ("127.0.0.1:9050"), never 0; 0 = entry free (atomic)
+    uint32_t limit_min; // Smallest and largest limit any waiter used, 0 = none yet (atomic)
+    uint32_t limit_max;
+    uint32_t tickets;   // Tickets handed out (atomic)
+    uint32_t returned;  // Tickets handed back (atomic); the futex word waiters sleep on
+    uint32_t queued;    // Occupied queue ring slots (atomic)
+} __attribute__((aligned(64)));
+
+struct socks5_admission_holder {
+    int32_t pid;     // Process holding the ticket, 0 = free (atomic)
+    uint32_t port;   // Index of the SocksPort entry the ticket belongs to
+    uint32_t ticket;
+};
+
+// The ticket a proxied socket holds while its handshake runs; all zero = none
+struct socks5_admission_ticket {
+    int port;   // 1 + index of the SocksPort entry, 0 if no ticket
+    int holder; // 1 + index in the holder table, 0 if the table was full
+    pid_t pid;  // Process that took it: a fork()ed child closing the fd must not hand it back
+};
+
+static struct socks5_admission_port *admission_ports = NULL; // NULL until attached, or when admission control is off
+static struct socks5_admission_holder *admission_holders = NULL;
+static uint64_t *admission_queue = NULL; // SOCKS5_ADMISSION_QUEUE slots per SocksPort entry
+static pthread_once_t admission_once = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief Maps the shared segment, creating it if this is the first process. A fork()ed child keeps the mapping.
+ */
+static void socks5_admission_attach(void) {
+    const char *path = socks5_config()->admission_segment;
+    size_t size = sizeof(struct socks5_admission_header) + SOCKS5_ADMISSION_PORTS * sizeof(struct socks5_admission_port) +
+                  SOCKS5_ADMISSION_HOLDERS * sizeof(struct socks5_admission_holder) +
+                  SOCKS5_ADMISSION_PORTS * SOCKS5_ADMISSION_QUEUE * sizeof(uint64_t);
+    struct socks5_admission_header *header;
+    uint64_t magic = 0;
+    struct stat st;
+    void *map;
+    int fd;
+
+    if (path[0] == '\0') {
+        return;
+    }
+    // 1. The first process sizes the segment; later ones must find the same layout
+    fd = open(path, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if (fd < 0 || fstat(fd, &st) < 0 || (st.st_size == 0 && ftruncate(fd, (off_t)size) < 0)) {
+        fprintf(stderr, "TORSOCKS_WRAPPER: Could not open the admission segment %s.\n", path);
+        if (fd >= 0) {
+            real_close(fd);
+        }
+        return;
+    }
+    if (st.st_size != 0 && (size_t)st.st_size != size) {
+        fprintf(stderr, "TORSOCKS_WRAPPER: The admission segment %s has another layout.\n", path);
+        real_close(fd);
+        return;
+    }
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    real_close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "TORSOCKS_WRAPPER: Could not map the admission segment %s.\n", path);
+        return;
+    }
+
+    // 2. Describe the layout, then publish it with the magic; racing processes write the same values
+    header = map;
+    if (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) == 0) {
+        header->ports = SOCKS5_ADMISSION_PORTS;
+        header->holders = SOCKS5_ADMISSION_HOLDERS;
+        header->queue = SOCKS5_ADMISSION_QUEUE;
+        __atomic_compare_exchange_n(&header->magic, &magic, SOCKS5_ADMISSION_MAGIC, 0, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE);
+    }
+    if (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != SOCKS5_ADMISSION_MAGIC ||
+        header->ports != SOCKS5_ADMISSION_PORTS || header->holders != SOCKS5_ADMISSION_HOLDERS ||
+        header->queue != SOCKS5_ADMISSION_QUEUE) {
+        fprintf(stderr, "TORSOCKS_WRAPPER: The admission segment %s has another layout.\n", path);
+        munmap(map, size);
+        return;
+    }
+    admission_holders = (struct socks5_admission_holder *)((struct socks5_admission_port *)(header + 1) + SOCKS5_ADMISSION_PORTS);
+    admission_queue = (uint64_t *)(admission_holders + SOCKS5_ADMISSION_HOLDERS);
+    __atomic_store_n(&admission_ports, (struct socks5_admission_port *)(header + 1), __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Finds, or claims, the segment entry of a shard's SocksPort.
+ * @return Index of the entry, -1 if all entries belong to other SocksPorts.
+ */
+static int socks5_admission_port(int shard) {
+    const char *name = socks5_shard_get(shard)->name;
+    uint32_t hash = socks5_hash(name, strlen(name), 2166136261u) | 1;
+    int i;
+
+    for (i = 0; i < SOCKS5_ADMISSION_PORTS; i++) {
+        int index = (int)((hash + (uint32_t)i) % SOCKS5_ADMISSION_PORTS);
+        uint32_t seen = __atomic_load_n(&admission_ports[index].hash, __ATOMIC_ACQUIRE);
+        if (seen == 0 &&
+            __atomic_compare_exchange_n(&admission_ports[index].hash, &seen, hash, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            return index;
+        }
+        if (seen == hash) {
+            return index;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Records this process as the holder of ticket t of the SocksPort entry port.
+ * @return 1 + index of the holder entry, 0 if the table is full (the ticket is then not recoverable).
+ */
+static int socks5_admission_hold(int port, uint32_t t) {
+    int32_t pid = (int32_t)getpid();
+    uint32_t start = (uint32_t)pid * 2654435761u;
+    int i;
+
+    for (i = 0; i < SOCKS5_ADMISSION_HOLDERS; i++) {
+        struct socks5_admission_holder *holder = &admission_holders[(start + (uint32_t)i) % SOCKS5_ADMISSION_HOLDERS];
+        int32_t free_pid = 0;
+        if (__atomic_load_n(&holder->pid, __ATOMIC_RELAXED) == 0 &&
+            __atomic_compare_exchange_n(&holder->pid, &free_pid, pid, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            holder->port = (uint32_t)port;
+            holder->ticket = t;
+            return (int)((start + (uint32_t)i) % SOCKS5_ADMISSION_HOLDERS) + 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Lets the queued ticket in *slot through, if it is ticket t parked with limit.
+ * @return 1 if the ticket had been abandoned and its turn has to be handed back as well, else 0.
+ */
+static int socks5_admission_admit(struct socks5_admission_port *entry, uint64_t *slot, uint32_t t, uint32_t limit) {
+    uint64_t seen = __atomic_load_n(slot, __ATOMIC_SEQ_CST);
+
+    for (;;) {
+        if (seen == SOCKS5_ADMISSION_SLOT(t, limit, SOCKS5_ADMISSION_WAITING)) {
+            if (__atomic_compare_exchange_n(slot, &seen, SOCKS5_ADMISSION_SLOT(t, limit, SOCKS5_ADMISSION_ADMITTED), 0,
+                                            __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+                syscall(SYS_futex, &entry->returned, FUTEX_WAKE_BITSET, INT_MAX, NULL, NULL, 1u << (t % 32));
+                return 0;
+            }
+        } else if (seen == SOCKS5_ADMISSION_SLOT(t, limit, SOCKS5_ADMISSION_ABANDONED)) {
+            if (__atomic_compare_exchange_n(slot, &seen, 0, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+                __atomic_sub_fetch(&entry->queued, 1, __ATOMIC_SEQ_CST);
+                return 1;
+            }
+        } else {
+            return 0;
+        }
+    }
+}
+
+/**
+ * @brief Gives up queued ticket t: marks it abandoned if its turn has not come yet.
+ * @return 1 if it was abandoned (its turn is handed back when the queue reaches it), 0 if it was already
+ * let through or not queued; an admitted slot is cleared.
+ */
+static int socks5_admission_abandon(struct socks5_admission_port *entry, uint64_t *slot, uint32_t t) {
+    uint64_t seen = __atomic_load_n(slot, __ATOMIC_SEQ_CST);
+
+    while (seen && SOCKS5_ADMISSION_SLOT_TICKET(seen) == t) {
+        uint64_t next = 0;
+        if (SOCKS5_ADMISSION_SLOT_STATE(seen) == SOCKS5_ADMISSION_ABANDONED) {
+            return 1;
+        }
+        if (SOCKS5_ADMISSION_SLOT_STATE(seen) == SOCKS5_ADMISSION_WAITING) {
+            next = (seen & ~(uint64_t)3) | SOCKS5_ADMISSION_ABANDONED;
+        }
+        if (__atomic_compare_exchange_n(slot, &seen, next, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+            if (next) {
+                return 1;
+            }
+            __atomic_sub_fetch(&entry->queued, 1, __ATOMIC_SEQ_CST);
+            return 0;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Hands a ticket back and lets through the queued ticket each limit in use admits next.
+ * @param holder 1 + index of the ticket's holder entry to free, 0 if there is none.
+ */
+static void socks5_admission_give_back(int port, int holder) {
+    struct socks5_admission_port *entry = &admission_ports[port];
+    uint64_t *queue = admission_queue + (size_t)port * SOCKS5_ADMISSION_QUEUE;
+    int turns = 1;
+
+    if (holder) {
+        __atomic_store_n(&admission_holders[holder - 1].pid, 0, __ATOMIC_RELEASE);
+    }
+    while (turns-- > 0) {
+        uint32_t returned = __atomic_add_fetch(&entry->returned, 1, __ATOMIC_SEQ_CST);
+        uint32_t lo, hi, limit;
+        int i;
+
+        // Pairs with the waiter's queued increment before it checks returned: one of the two sees the other
+        if (__atomic_load_n(&entry->queued, __ATOMIC_SEQ_CST) == 0) {
+            continue;
+        }
+        // Under limit, returned admits ticket returned + limit - 1 and no other
+        lo = __atomic_load_n(&entry->limit_min, __ATOMIC_SEQ_CST);
+        hi = __atomic_load_n(&entry->limit_max, __ATOMIC_SEQ_CST);
+        if (lo && hi - lo < SOCKS5_ADMISSION_QUEUE) {
+            for (limit = lo; limit <= hi; limit++) {
+                uint32_t t = returned + limit - 1;
+                turns += socks5_admission_admit(entry, &queue[t % SOCKS5_ADMISSION_QUEUE], t, limit);
+            }
+        } else if (lo) {
+            // Limits too far apart to try one by one: look at every parked ticket instead
+            for (i = 0; i < SOCKS5_ADMISSION_QUEUE; i++) {
+                uint64_t seen = __atomic_load_n(&queue[i], __ATOMIC_SEQ_CST);
+                limit = SOCKS5_ADMISSION_SLOT_LIMIT(seen);
+                if (seen && SOCKS5_ADMISSION_SLOT_TICKET(seen) == returned + limit - 1) {
+                    turns += socks5_admission_admit(entry, &queue[i], returned + limit - 1, limit);
+                }
+            }
+        }
+    }
+}
+
+/**
+ * @brief Hands back the tickets of port whose holders are no longer running; a ticket still queued is
+ * abandoned instead, so its turn is handed back when the queue reaches it.
+ */
+static void socks5_admission_reclaim(int port) {
+    struct socks5_admission_port *entry = &admission_ports[port];
+    uint64_t *queue = admission_queue + (size_t)port * SOCKS5_ADMISSION_QUEUE;
+    int i;
+
+    for (i = 0; i < SOCKS5_ADMISSION_HOLDERS; i++) {
+        struct socks5_admission_holder *holder = &admission_holders[i];
+        int32_t pid = __atomic_load_n(&holder->pid, __ATOMIC_ACQUIRE);
+        if (pid != 0 && holder->port == (uint32_t)port && kill(pid, 0) < 0 && errno == ESRCH &&
+            __atomic_compare_exchange_n(&holder->pid, &pid, 0, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            fprintf(stderr, "TORSOCKS_WRAPPER: Handing back an admission ticket of exited process %d.\n", (int)pid);
+            if (!socks5_admission_abandon(entry, &queue[holder->ticket % SOCKS5_ADMISSION_QUEUE], holder->ticket)) {
+                socks5_admission_give_back(port, 0);
+            }
+        }
+    }
+}
+
+/**
+ * @brief Takes a ticket for a handshake with the shard's SocksPort, waiting for its turn while the
+ * SocksPort has AdmissionLimit handshakes in flight.
+ * @param sockfd The application's socket; a non-blocking one never waits.
+ * @param shard The SocksPort shard the handshake goes to.
+ * @param ticket Receives the ticket, handed back by socks5_admission_leave(); left alone if it holds one.
+ * @return 0 once the handshake may start (also when admission control is off), -1 with errno EAGAIN if
+ * the SocksPort is full and waiting is not allowed, or ETIMEDOUT if no turn came within AdmissionWaitMs.
+ */
+static int socks5_admission_enter(int sockfd, int shard, struct socks5_admission_ticket *ticket) {
+    const struct socks5_config *cfg = socks5_config();
+    struct socks5_admission_port *entry;
+    struct timespec now, deadline, slice;
+    uint32_t limit = (uint32_t)cfg->admission_limit;
+    uint32_t t, returned, seen;
+    uint64_t *slot, waiting;
+    int port, holder, queued, expired = 0;
+
+    // A repeated connect() on the same fd keeps the ticket it has; AdmissionLimit 0 means no limit
+    if (ticket->port || limit == 0) {
+        return 0;
+    }
+    if (limit > SOCKS5_ADMISSION_LIMIT_MAX) {
+        limit = SOCKS5_ADMISSION_LIMIT_MAX;
+    }
+    pthread_once(&admission_once, socks5_admission_attach);
+    if (!__atomic_load_n(&admission_ports, __ATOMIC_ACQUIRE) || (port = socks5_admission_port(shard)) < 0) {
+        return 0;
+    }
+    entry = &admission_ports[port];
+
+    // 1. No queue and a turn free: take the next ticket, admitted at once. Waiters hold the tickets past
+    // the free turns, so this fails whenever anyone is queued.
+    t = __atomic_load_n(&entry->tickets, __ATOMIC_RELAXED);
+    while ((int32_t)(t - __atomic_load_n(&entry->returned, __ATOMIC_ACQUIRE)) < (int32_t)limit) {
+        if (__atomic_compare_exchange_n(&entry->tickets, &t, t + 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            ticket->port = port + 1;
+            ticket->holder = socks5_admission_hold(port, t);
+            ticket->pid = getpid();
+            return 0;
+        }
+    }
+
+    // 2. Full: fail fast, or queue up. The ticket's limit goes into the range hand-backs try, before the
+    // ticket is parked in its queue slot.
+    if (cfg->admission_wait_ms == 0 || (fcntl(sockfd, F_GETFL) & O_NONBLOCK)) {
+        errno = EAGAIN;
+        return -1;
+    }
+    t = __atomic_fetch_add(&entry->tickets, 1, __ATOMIC_ACQ_REL);
+    holder = socks5_admission_hold(port, t);
+    seen = __atomic_load_n(&entry->limit_min, __ATOMIC_SEQ_CST);
+    while ((seen == 0 || limit < seen) &&
+           !__atomic_compare_exchange_n(&entry->limit_min, &seen, limit, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+    }
+    seen = __atomic_load_n(&entry->limit_max, __ATOMIC_SEQ_CST);
+    while (limit > seen &&
+           !__atomic_compare_exchange_n(&entry->limit_max, &seen, limit, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+    }
+    // Pairs with the hand-back's returned increment before it checks queued: one of the two sees the other
+    __atomic_add_fetch(&entry->queued, 1, __ATOMIC_SEQ_CST);
+    slot = &admission_queue[(size_t)port * SOCKS5_ADMISSION_QUEUE + t % SOCKS5_ADMISSION_QUEUE];
+    waiting = 0;
+    queued = __atomic_compare_exchange_n(slot, &waiting, SOCKS5_ADMISSION_SLOT(t, limit, SOCKS5_ADMISSION_WAITING), 0,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    if (!queued) {
+        // The slot still holds a ticket SOCKS5_ADMISSION_QUEUE places earlier: poll every slice instead of parking
+        __atomic_sub_fetch(&entry->queued, 1, __ATOMIC_SEQ_CST);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += cfg->admission_wait_ms / 1000;
+    deadline.tv_nsec += (long)(cfg->admission_wait_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    // 3. Sleep until the turn comes, checking for dead holders after every slice
+    for (;;) {
+        returned = __atomic_load_n(&entry->returned, __ATOMIC_SEQ_CST);
+        if ((int32_t)(t - returned) < (int32_t)limit ||
+            (queued && SOCKS5_ADMISSION_SLOT_STATE(__atomic_load_n(slot, __ATOMIC_SEQ_CST)) == SOCKS5_ADMISSION_ADMITTED)) {
+            break;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (!expired &&
+            (now.tv_sec > deadline.tv_sec || (now.tv_sec == deadline.tv_sec && now.tv_nsec >= deadline.tv_nsec))) {
+            // Leave the ticket in the queue, abandoned; if its turn came meanwhile, take it after all
+            if (queued && socks5_admission_abandon(entry, slot, t)) {
+                if (holder) {
+                    __atomic_store_n(&admission_holders[holder - 1].pid, 0, __ATOMIC_RELEASE);
+                }
+                errno = ETIMEDOUT;
+                return -1;
+            }
+            if (queued) {
+                queued = 0;
+                break;
+            }
+            // Not parked, so nobody hands the turn back for it: wait for it, then hand it back at once
+            expired = 1;
+        }
+        slice = now;
+        slice.tv_nsec += (long)SOCKS5_ADMISSION_SLICE_MS * 1000000;
+        if (slice.tv_nsec >= 1000000000) {
+            slice.tv_sec++;
+            slice.tv_nsec -= 1000000000;
+        }
+        if (!expired &&
+            (slice.tv_sec > deadline.tv_sec || (slice.tv_sec == deadline.tv_sec && slice.tv_nsec > deadline.tv_nsec))) {
+            slice = deadline;
+        }
+        // The kernel compares returned again, so a ticket handed back since the load above is not missed
+        if (syscall(SYS_futex, &entry->returned, FUTEX_WAIT_BITSET, returned, &slice, NULL, 1u << (t % 32)) < 0 &&
+            errno == ETIMEDOUT) {
+            socks5_admission_reclaim(port);
+        }
+    }
+    if (queued) {
+        __atomic_store_n(slot, 0, __ATOMIC_SEQ_CST);
+        __atomic_sub_fetch(&entry->queued, 1, __ATOMIC_SEQ_CST);
+    }
+    if (expired) {
+        socks5_admission_give_back(port, holder);
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    ticket->port = port + 1;
+    ticket->holder = holder;
+    ticket->pid = getpid();
+    return 0;
+}
+
+/**
+ * @brief Hands back the ticket of a handshake that ended; errno is preserved.
+ */
+static void socks5_admission_leave(struct socks5_admission_ticket *ticket) {
+    int error = errno;
+
+    if (ticket->port && ticket->pid == getpid()) {
+        socks5_admission_give_back(ticket->port - 1, ticket->holder);
+    }
+    ticket->port = 0;
+    ticket->holder = 0;
+    errno = error;
+}
+#endif
+
+// --- Runtime configuration: file, environment and hot reload ---
+// The file holds "Key value" lines, '#' starts a comment:
+//     TorAddress 127.0.0.1
+//     TorPort 9150
+//     SocksPorts 127.0.0.1:9050, unix:/run/tor2/socks
+//     ShardStrategy least_outstanding
+//     BypassRules 127.0.0.0/8, ::1, 10.0.0.0/8
+//     PoolMax 16
+// Every key can also be set by its environment variable (TORSOCKS_TOR_PORT=9150), which wins over the
+// file. Keys that are set nowhere keep the compile-time default. With TOR_CONFIG_RELOAD a watcher thread
+// rebuilds the snapshot whenever the file is rewritten or replaced.
+#define SOCKS5_SETTING_MAX 4096 // Longest value accepted
+
+struct socks5_settings {
+    char tor_address[INET6_ADDRSTRLEN];
+    int tor_port;
+    char tor_unix_socket[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    char socks_ports[SOCKS5_SETTING_MAX];
+    int shard_strategy;
+    char bypass_rules[SOCKS5_SETTING_MAX];
+    int pool_min, pool_max;
+    int hedge_delay_ms;
+    int negative_cache_ms, negative_cache_jitter;
+    char trace_file[PATH_MAX];
+    char metrics_segment[PATH_MAX];
+    char admission_segment[PATH_MAX];
+    int admission_limit, admission_wait_ms;
+    int breaker_failures, breaker_probe_ms;
+    int handshake_timeout_ms, greeting_timeout_ms;
+};
+
+#define SOCKS5_SETTING_STRING 0
+#define SOCKS5_SETTING_INT 1      // Non-negative
+#define SOCKS5_SETTING_STRATEGY 2 // TOR_SHARD_* by name
+
+#define SOCKS5_SETTING(key, env, type, field) \
+    { key, env, type, offsetof(struct socks5_settings, field), sizeof(((struct socks5_settings *)0)->field) }
+
+static const struct socks5_setting {
+    const char *key; // In the file, case-insensitive
+    const char *env; // Environment override
+    int type;
+    size_t offset, size;
+} socks5_setting_keys[] = {
+    SOCKS5_SETTING("TorAddress", "TORSOCKS_TOR_ADDRESS", SOCKS5_SETTING_STRING, tor_address),
+    SOCKS5_SETTING("TorPort", "TORSOCKS_TOR_PORT", SOCKS5_SETTING_INT, tor_port),
+    SOCKS5_SETTING("TorUnixSocket", "TORSOCKS_TOR_UNIX_SOCKET", SOCKS5_SETTING_STRING, tor_unix_socket),
+    SOCKS5_SETTING("SocksPorts", "TORSOCKS_SOCKS_PORTS", SOCKS5_SETTING_STRING, socks_ports),
+    SOCKS5_SETTING("ShardStrategy", "TORSOCKS_SHARD_STRATEGY", SOCKS5_SETTING_STRATEGY, shard_strategy),
+    SOCKS5_SETTING("BypassRules", "TORSOCKS_BYPASS_RULES", SOCKS5_SETTING_STRING, bypass_rules),
+    SOCKS5_SETTING("PoolMin", "TORSOCKS_POOL_MIN", SOCKS5_SETTING_INT, pool_min),
+    SOCKS5_SETTING("PoolMax", "TORSOCKS_POOL_MAX", SOCKS5_SETTING_INT, pool_max),
+    SOCKS5_SETTING("HedgeDelayMs", "TORSOCKS_HEDGE_DELAY_MS", SOCKS5_SETTING_INT, hedge_delay_ms),
+    SOCKS5_SETTING("NegativeCacheMs", "TORSOCKS_NEGATIVE_CACHE_MS", SOCKS5_SETTING_INT, negative_cache_ms),
+    SOCKS5_SETTING("NegativeCacheJitter", "TORSOCKS_NEGATIVE_CACHE_JITTER", SOCKS5_SETTING_INT, negative_cache_jitter),
+    SOCKS5_SETTING("TraceFile", "TORSOCKS_TRACE_FILE", SOCKS5_SETTING_STRING, trace_file),
+    SOCKS5_SETTING("MetricsSegment", "TORSOCKS_METRICS_SEGMENT", SOCKS5_SETTING_STRING, metrics_segment),
+    SOCKS5_SETTING("AdmissionSegment", "TORSOCKS_ADMISSION_SEGMENT", SOCKS5_SETTING_STRING, admission_segment),
+    SOCKS5_SETTING("AdmissionLimit", "TORSOCKS_ADMISSION_LIMIT", SOCKS5_SETTING_INT, admission_limit),
+    SOCKS5_SETTING("AdmissionWaitMs", "TORSOCKS_ADMISSION_WAIT_MS", SOCKS5_SETTING_INT, admission_wait_ms),
+    SOCKS5_SETTING("BreakerFailures", "TORSOCKS_BREAKER_FAILURES", SOCKS5_SETTING_INT, breaker_failures),
+    SOCKS5_SETTING("BreakerProbeMs", "TORSOCKS_BREAKER_PROBE_MS", SOCKS5_SETTING_INT, breaker_probe_ms),
+    SOCKS5_SETTING("HandshakeTimeoutMs", "TORSOCKS_HANDSHAKE_TIMEOUT_MS", SOCKS5_SETTING_INT, handshake_timeout_ms),
+    SOCKS5_SETTING("GreetingTimeoutMs", "TORSOCKS_GREETING_TIMEOUT_MS", SOCKS5_SETTING_INT, greeting_timeout_ms),
+};
+#define SOCKS5_SETTING_COUNT (sizeof(socks5_setting_keys) / sizeof(socks5_setting_keys[0]))
+
+// A snapshot and the tables it points to, in one allocation
+struct socks5_config_block {
+    struct socks5_config config; // First member: a published snapshot pointer is also its block
+    struct socks5_shard_table shards;
+    struct socks5_bypass_table bypass;
+    unsigned int retired_epoch; // config_epoch when the snapshot was replaced
+    struct socks5_config_block *next_retired;
+};
+
+static struct socks5_config_block config_boot; // Built by the constructor, never freed
+static char config_path[PATH_MAX];
+static char *config_env[SOCKS5_SETTING_COUNT]; // Overrides copied at load: getenv() races a concurrent setenv()
+static unsigned int config_generation = 0;
+static pthread_once_t config_once = PTHREAD_ONCE_INIT;
+// Scratch of socks5_config_build(), some 20 KB: too much for the watcher's stack or an application thread
+// that makes the first connect() under TOR_LAZY_STARTUP, so it is static and the lock serialises builds
+static struct socks5_settings config_settings;
+static char config_line[SOCKS5_SETTING_MAX + 64];
+static pthread_mutex_t config_build_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Stores one value into settings.
+ * @return 0 on success, -1 if the value is not valid for the key.
+ */
+static int socks5_setting_apply(struct socks5_settings *settings, const struct socks5_setting *setting, const char *value) {
+    char *field = (char *)settings + setting->offset;
+    char *end;
+    long number;
+
+    switch (setting->type) {
+    case SOCKS5_SETTING_STRING:
+        if (strlen(value) >= setting->size) {
+            return -1;
+        }
+        strcpy(field, value);
+        return 0;
+    case SOCKS5_SETTING_INT:
+        number = strtol(value, &end, 10);
+        if (end == value || *end != '\0' || number < 0 || number > INT_MAX) {
+            return -1;
+        }
+        *(int *)field = (int)number;
+        return 0;
+    case SOCKS5_SETTING_STRATEGY:
+        if (strcasecmp(value, "round_robin") == 0) {
+            *(int *)field = TOR_SHARD_ROUND_ROBIN;
+        } else if (strcasecmp(value, "least_outstanding") == 0) {
+            *(int *)field = TOR_SHARD_LEAST_OUTSTANDING;
+        } else if (strcasecmp(value, "consistent_hash") == 0) {
+            *(int *)field = TOR_SHARD_CONSISTENT_HASH;
+        } else {
+            return -1;
+        }
+        return 0;
+    }
+    return -1;
+}
+
+/**
+ * @brief Applies the lines of the configuration file. A missing file leaves the defaults alone.
+ * Called with config_build_lock held: the lines are read into config_line.
+ */
+static void socks5_settings_read(struct socks5_settings *settings, const char *path) {
+    char *line = config_line;
+    int line_no = 0;
+    FILE *file = fopen(path, "re");
+
+    if (!file) {
+        if (errno != ENOENT) {
+            fprintf(stderr, "TORSOCKS_WRAPPER: Could not read %s.\n", path);
+        }
+        return;
+    }
+    while (fgets(line, sizeof(config_line), file)) {
+        char *key = line;
+        char *value;
+        char *end;
+        size_t i;
+
+        // 1. Strip the comment and the surrounding blanks, then split the key off at the first blank
+        line_no++;
+        end = strchr(line, '#');
+        if (end) {
+            *end = '\0';
+        }
+        end = line + strlen(line);
+        while (end > line && isspace((unsigned char)end[-1])) {
+            *--end = '\0';
+        }
+        while (isspace((unsigned char)*key)) {
+            key++;
+        }
+        if (*key == '\0') {
+            continue;
+        }
+        for (value = key; *value && !isspace((unsigned char)*value); value++) {
+        }
+        if (*value) {
+            *value++ = '\0';
+            while (isspace((unsigned char)*value)) {
+                value++;
+            }
+        }
+
+        // 2. Unknown keys and bad values are reported and skipped; the rest of the file still applies
+        for (i = 0; i < SOCKS5_SETTING_COUNT; i++) {
+            if (strcasecmp(key, socks5_setting_keys[i].key) == 0) {
+                break;
+            }
+        }
+        if (i == SOCKS5_SETTING_COUNT) {
+            fprintf(stderr, "TORSOCKS_WRAPPER: %s:%d: unknown key '%s'.\n", path, line_no, key);
+        } else if (socks5_setting_apply(settings, &socks5_setting_keys[i], value) < 0) {
+            fprintf(stderr, "TORSOCKS_WRAPPER: %s:%d: invalid value for %s.\n", path, line_no, socks5_setting_keys[i].key);
+        }
+    }
+    fclose(file);
+}
+
+/**
+ * @brief Builds a snapshot from the compile-time defaults, the file and the environment, in that order.
+ * Takes config_build_lock for the scratch settings.
+ * @param block Zeroed storage for the snapshot.
+ */
+static void socks5_config_build(struct socks5_config_block *block) {
+    char fallback[sizeof(block->shards.shard[0].name)];
+    size_t i;
+
+    pthread_mutex_lock(&config_build_lock);
+    // 1. Compile-time defaults
+    memset(&config_settings, 0, sizeof(config_settings));
+    snprintf(config_settings.tor_address, sizeof(config_settings.tor_address), "%s", TOR_SOCKS_ADDR);
+    config_settings.tor_port = TOR_SOCKS_PORT;
+    snprintf(config_settings.tor_unix_socket, sizeof(config_settings.tor_unix_socket), "%s", TOR_SOCKS_UNIX_PATH);
+    snprintf(config_settings.socks_ports, sizeof(config_settings.socks_ports), "%s", TOR_SOCKS_SHARDS);
+    config_settings.shard_strategy = TOR_SHARD_STRATEGY;
+    snprintf(config_settings.bypass_rules, sizeof(config_settings.bypass_rules), "%s", TOR_BYPASS_RULES);
+    config_settings.pool_min = TOR_POOL_MIN;
+    config_settings.pool_max = TOR_POOL_MAX;
+    config_settings.hedge_delay_ms = TOR_HEDGE_DELAY_MS;
+    config_settings.negative_cache_ms = TOR_NEGATIVE_CACHE_MS;
+    config_settings.negative_cache_jitter = TOR_NEGATIVE_CACHE_JITTER;
+    snprintf(config_settings.trace_file, sizeof(config_settings.trace_file), "%s", TOR_TRACE_FILE);
+    snprintf(config_settings.metrics_segment, sizeof(config_settings.metrics_segment), "%s", TOR_METRICS_SEGMENT);
+    snprintf(config_settings.admission_segment, sizeof(config_settings.admission_segment), "%s", TOR_ADMISSION_SEGMENT);
+    config_settings.admission_limit = TOR_ADMISSION_LIMIT;
+    config_settings.admission_wait_ms = TOR_ADMISSION_WAIT_MS;
+    config_settings.breaker_failures = TOR_BREAKER_FAILURES;
+    config_settings.breaker_probe_ms = TOR_BREAKER_PROBE_MS;
+    config_settings.handshake_timeout_ms = TOR_HANDSHAKE_TIMEOUT_MS;
+    config_settings.greeting_timeout_ms = TOR_GREETING_TIMEOUT_MS;
+
+    // 2. The file, then the environment on top of it
+    socks5_settings_read(&config_settings, config_path);
+    for (i = 0; i < SOCKS5_SETTING_COUNT; i++) {
+        if (config_env[i] && socks5_setting_apply(&config_settings, &socks5_setting_keys[i], config_env[i]) < 0) {
+            fprintf(stderr, "TORSOCKS_WRAPPER: Ignoring invalid %s.\n", socks5_setting_keys[i].env);
+        }
+    }
+
+    // 3. The pool array is sized at compile time
+    if (config_settings.pool_max > TOR_POOL_MAX) {
+        fprintf(stderr, "TORSOCKS_WRAPPER: PoolMax is limited to %d.\n", TOR_POOL_MAX);
+        config_settings.pool_max = TOR_POOL_MAX;
+    }
+    if (config_settings.pool_min > config_settings.pool_max) {
+        config_settings.pool_min = config_settings.pool_max;
+    }
+    if (config_settings.negative_cache_jitter > 100) {
+        fprintf(stderr, "TORSOCKS_WRAPPER: NegativeCacheJitter is limited to 100 percent.\n");
+        config_settings.negative_cache_jitter = 100;
+    }
+    if (config_settings.breaker_probe_ms < 10) {
+        fprintf(stderr, "TORSOCKS_WRAPPER: BreakerProbeMs is at least 10.\n");
+        config_settings.breaker_probe_ms = 10;
+    }
+
+    // 4. Compile the tables connect() works from
+    if (config_settings.tor_unix_socket[0] != '\0') {
+        snprintf(fallback, sizeof(fallback), "unix:%s", config_settings.tor_unix_socket);
+    } else if (strchr(config_settings.tor_address, ':')) {
+        snprintf(fallback, sizeof(fallback), "[%s]:%d", config_settings.tor_address, config_settings.tor_port);
+    } else {
+        snprintf(fallback, sizeof(fallback), "%s:%d", config_settings.tor_address, config_settings.tor_port);
+    }
+    socks5_shards_build(&block->shards, config_settings.socks_ports, fallback, config_settings.shard_strategy);
+    socks5_bypass_build(&block->bypass, config_settings.bypass_rules);
+    block->config.generation = ++config_generation;
+    block->config.shards = &block->shards;
+    block->config.bypass = &block->bypass;
+    block->config.pool_min = config_settings.pool_min;
+    block->config.pool_max = config_settings.pool_max;
+    block->config.hedge_delay_ms = config_settings.hedge_delay_ms;
+    block->config.negative_cache_ms = config_settings.negative_cache_ms;
+    block->config.negative_cache_jitter = config_settings.negative_cache_jitter;
+    memcpy(block->config.trace_file, config_settings.trace_file, sizeof(block->config.trace_file));
+    memcpy(block->config.metrics_segment, config_settings.metrics_segment, sizeof(block->config.metrics_segment));
+    memcpy(block->config.admission_segment, config_settings.admission_segment, sizeof(block->config.admission_segment));
+    block->config.admission_limit = config_settings.admission_limit;
+    block->config.admission_wait_ms = config_settings.admission_wait_ms;
+    block->config.breaker_failures = config_settings.breaker_failures;
+    block->config.breaker_probe_ms = config_settings.breaker_probe_ms;
+    block->config.handshake_timeout_ms = config_settings.handshake_timeout_ms;
+    block->config.greeting_timeout_ms = config_settings.greeting_timeout_ms;
+    pthread_mutex_unlock(&config_build_lock);
+}
+
+/**
+ * @brief Builds and publishes the first snapshot; resolves the file name and copies the overrides first.
+ */
+static void socks5_config_boot(void) {
+    const char *path = getenv("TORSOCKS_CONF_FILE");
+    size_t i;
+
+    snprintf(config_path, sizeof(config_path), "%s", path && path[0] ? path : TOR_CONFIG_FILE);
+    for (i = 0; i < SOCKS5_SETTING_COUNT; i++) {
+        const char *value = getenv(socks5_setting_keys[i].env);
+        config_env[i] = value ? strdup(value) : NULL;
+    }
+    socks5_config_build(&config_boot);
+    __atomic_store_n(&config_current, &config_boot.config, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Loads the configuration once; called from the constructor.
+ */
+static void socks5_config_load(void) {
+    pthread_once(&config_once, socks5_config_boot);
+}
+
+#if TOR_CONFIG_RELOAD
+static int config_watch_started = 0;
+static struct socks5_config_block *config_retired = NULL; // Replaced snapshots; watcher thread only
+
+/**
+ * @brief Moves to the next reader epoch if the previous one has no readers left. Watcher thread only.
+ */
+static void socks5_config_advance(void) {
+    unsigned int epoch = __atomic_load_n(&config_epoch, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&config_readers[(epoch + 1) & 1], __ATOMIC_SEQ_CST) == 0) {
+        __atomic_store_n(&config_epoch, epoch + 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+/**
+ * @brief Publishes a snapshot rebuilt from the file. A reader that loaded the old pointer keeps using
+ * it, so the old snapshot is retired and only freed once no reader can still hold it.
+ */
+static void socks5_config_reload(void) {
+    struct socks5_config_block *fresh = calloc(1, sizeof(*fresh));
+    struct socks5_config_block *old;
+    struct socks5_config_block **link;
+    unsigned int epoch;
+
+    if (!fresh) {
+        fprintf(stderr, "TORSOCKS_WRAPPER: Could not allocate the new configuration, keeping the old one.\n");
+        return;
+    }
+    socks5_config_build(fresh);
+    old = (struct socks5_config_block *)__atomic_exchange_n(&config_current, &fresh->config, __ATOMIC_ACQ_REL);
+    fprintf(stderr, "TORSOCKS_WRAPPER: Reloaded %s.\n", config_path);
+
+    // Readers that could have loaded old entered no later than this epoch; two advances see them gone
+    if (old != &config_boot) {
+        old->retired_epoch = __atomic_load_n(&config_epoch, __ATOMIC_SEQ_CST);
+        old->next_retired = config_retired;
+        config_retired = old;
+    }
+    socks5_config_advance();
+    socks5_config_advance();
+    epoch = __atomic_load_n(&config_epoch, __ATOMIC_SEQ_CST);
+    for (link = &config_retired; *link; ) {
+        struct socks5_config_block *block = *link;
+        if (epoch - block->retired_epoch >= 2) {
+            *link = block->next_retired;
+            free(block->bypass.trie);
+            free(block);
+        } else {
+            link = &block->next_retired;
+        }
+    }
+}
+
+/**
+ * @brief Watcher thread: rebuilds the snapshot whenever the configuration file is written or replaced.
+ */
+static void *socks5_config_watcher(void *arg) {
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    char dir[sizeof(config_path)];
+    const char *name = strrchr(config_path, '/');
+    int fd;
+
+    (void)arg;
+    // 1. Watch the directory rather than the file: editors and config management replace the file by
+    // renaming a new one over it, which would leave a watch on the old inode
+    if (!name) {
+        strcpy(dir, ".");
+        name = config_path;
+    } else {
+        size_t dir_len = (size_t)(name - config_path);
+        memcpy(dir, config_path, dir_len);
+        strcpy(dir + dir_len, dir_len ? "" : "/");
+        name++;
+    }
+    fd = inotify_init1(IN_CLOEXEC);
+    if (fd < 0 || inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        fprintf(stderr, "TORSOCKS_WRAPPER: Could not watch %s, configuration changes need a restart.\n", dir);
+        if (fd >= 0) {
+            real_close(fd);
+        }
+        return NULL;
+    }
+
+    // 2. One rebuild per batch of events that touched the file
+    for (;;) {
+        ssize_t n = real_read(fd, events, sizeof(events));
+        ssize_t off = 0;
+        int changed = 0;
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        while (off < n) {
+            const struct inotify_event *event = (const struct inotify_event *)(events + off);
+            if (event->len && strcmp(event->name, name) == 0) {
+                changed = 1;
+            }
+            off += (ssize_t)(sizeof(*event) + event->len);
+        }
+        if (changed) {
+            socks5_config_reload();
+        }
+    }
+    real_close(fd);
+    return NULL;
+}
+
+// fork() does not copy the watcher thread: the child starts its own with its first proxied connect
+static void socks5_config_postfork_child(void) {
+    // Readers on the parent's other threads do not exist here; only this thread's enter still counts
+    __atomic_store_n(&config_readers[0], 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&config_readers[1], 0, __ATOMIC_RELAXED);
+    if (config_depth) {
+        __atomic_store_n(&config_readers[config_entered & 1], 1, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&config_watch_started, 0, __ATOMIC_RELEASE);
+    // The parent's watcher may have been building a snapshot
+    pthread_mutex_init(&config_build_lock, NULL);
+}
+
+/**
+ * @brief Starts the watcher thread on the first proxied connect, so processes that never connect pay nothing.
+ */
+static void socks5_config_watch_start(void) {
+    static int atfork_registered = 0;
+    int expected = 0;
+    pthread_attr_t attr;
+    pthread_t thread;
+    sigset_t all, saved;
+
+    if (__atomic_load_n(&config_watch_started, __ATOMIC_ACQUIRE) ||
+        !__atomic_compare_exchange_n(&config_watch_started, &expected, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    if (!atfork_registered) {
+        pthread_atfork(NULL, NULL, socks5_config_postfork_child);
+        atfork_registered = 1;
+    }
+    // The application's signal handlers must never run on the shim's thread
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &saved);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setstacksize(&attr, 128 * 1024);
+    if (pthread_create(&thread, &attr, socks5_config_watcher, NULL) != 0) {
+        fprintf(stderr, "TORSOCKS_WRAPPER: Could not start the configuration watcher thread.\n");
+    }
+    pthread_attr_destroy(&attr);
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+}
+#endif
+
+#if TOR_TRACE
+// --- Connect tracing: per-thread rings in a shared mapping ---
+// Finished records go to the committing thread's ring inside a MAP_SHARED file, "<TraceFile>.<pid>": a
+// 64-byte header, then TOR_TRACE_RINGS rings of TOR_TRACE_RING records each. A ring has a single writer,
+// so committing is a 64-byte copy and a release store of the ring head: no lock, no system call. The
+// kernel writes the pages back on its own, and TraceDecode reads the file while the process runs or
+// after it exited. The mutex is only taken when a thread claims its ring.
+#define TOR_TRACE_RING 4096 // Records per ring (power of two); older ones are overwritten
+#define TOR_TRACE_RINGS 64  // Threads recording at the same time; threads beyond that go unrecorded
+#define SOCKS5_TRACE_MAGIC "TSTRACE1"
+
+struct socks5_trace_header {
+    char magic[8];
+    uint32_t record_size;  // sizeof(struct socks5_trace_record)
+    uint32_t ring_records; // TOR_TRACE_RING
+    uint32_t rings;        // TOR_TRACE_RINGS
+    uint32_t pid;
+    uint8_t reserved[40];
+};
+
+struct socks5_trace_ring {
+    uint64_t head;        // Records committed so far (atomic); the newest is records[(head - 1) % TOR_TRACE_RING]
+    uint32_t tid;         // Owning thread, 0 = free
+    uint8_t reserved[52]; // The ring header has its cache line to itself
+    struct socks5_trace_record records[TOR_TRACE_RING];
+};
+
+static struct socks5_trace_header *trace_map = NULL;
+static int trace_state = 0;          // 0 = not opened yet, 1 = mapped, -1 = off or unavailable
+static unsigned int trace_epoch = 1; // Bumped in a fork()ed child, which maps a file of its own (atomic)
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t trace_key;      // Frees the ring when its thread exits
+static __thread struct socks5_trace_ring *trace_ring = NULL;
+static __thread unsigned int trace_ring_epoch = 0; // trace_epoch trace_ring belongs to; NULL ring = none left
+
+static void socks5_trace_thread_exit(void *ring) {
+    if (trace_ring_epoch == __atomic_load_n(&trace_epoch, __ATOMIC_ACQUIRE)) {
+        __atomic_store_n(&((struct socks5_trace_ring *)ring)->tid, 0, __ATOMIC_RELEASE);
+    }
+}
+
+// The child records into "<TraceFile>.<child pid>". The parent's mapping is left in place, unused: the
+// forking thread's ring pointer still points into it.
+static void socks5_trace_prefork(void) {
+    pthread_mutex_lock(&trace_lock);
+}
+
+static void socks5_trace_postfork_parent(void) {
+    pthread_mutex_unlock(&trace_lock);
+}
+
+static void socks5_trace_postfork_child(void) {
+    trace_map = NULL;
+    trace_state = 0;
+    __atomic_add_fetch(&trace_epoch, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&trace_lock);
+}
+
+/**
+ * @brief Creates and maps the trace file of this process. Called with trace_lock held.
+ */
+static void socks5_trace_open(void) {
+    static int once = 0;
+    const char *base = socks5_config()->trace_file;
+    size_t size = sizeof(struct socks5_trace_header) + TOR_TRACE_RINGS * sizeof(struct socks5_trace_ring);
+    char path[PATH_MAX + 16];
+    void *map;
+    int fd;
+
+    trace_state = -1;
+    if (!once) {
+        pthread_key_create(&trace_key, socks5_trace_thread_exit);
+        pthread_atfork(socks5_trace_prefork, socks5_trace_postfork_parent, socks5_trace_postfork_child);
+        once = 1;
+    }
+    if (base[0] == '\0') {
+        return;
+    }
+    snprintf(path, sizeof(path), "%s.%d", base, (int)getpid());
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if (fd < 0 || ftruncate(fd, (off_t)size) < 0) {
+        fprintf(stderr, "TORSOCKS_WRAPPER: Could not create the trace file %s.\n", path);
+        if (fd >= 0) {
+            real_close(fd);
+        }
+        return;
+    }
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    real_close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "TORSOCKS_WRAPPER: Could not map the trace file %s.\n", path);
+        return;
+    }
+    trace_map = map;
+    trace_map->record_size = sizeof(struct socks5_trace_record);
+    trace_map->ring_records = TOR_TRACE_RING;
+    trace_map->rings = TOR_TRACE_RINGS;
+    trace_map->pid = (uint32_t)getpid();
+    // The magic goes last: a decoder never sees a header without its sizes
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(trace_map->magic, SOCKS5_TRACE_MAGIC, sizeof(trace_map->magic));
+    trace_state = 1;
+}
+
+/**
+ * @brief The calling thread's ring; claims a free one on the thread's first commit.
+ * @return The ring, or NULL if tracing is off or every ring is taken.
+ */
+static struct socks5_trace_ring *socks5_trace_ring_get(void) {
+    unsigned int epoch = __atomic_load_n(&trace_epoch, __ATOMIC_ACQUIRE);
+    struct socks5_trace_ring *rings;
+    int i;
+
+    if (trace_ring_epoch == epoch) {
+        return trace_ring;
+    }
+    trace_ring = NULL;
+    pthread_mutex_lock(&trace_lock);
+    if (trace_state == 0) {
+        socks5_config_enter();
+        socks5_trace_open();
+        socks5_config_leave();
+    }
+    if (trace_state == 1) {
+        rings = (struct socks5_trace_ring *)(trace_map + 1);
+        for (i = 0; i < TOR_TRACE_RINGS; i++) {
+            if (__atomic_load_n(&rings[i].tid, __ATOMIC_ACQUIRE) == 0) {
+                __atomic_store_n(&rings[i].tid, (uint32_t)gettid(), __ATOMIC_RELEASE);
+                trace_ring = &rings[i];
+                pthread_setspecific(trace_key, trace_ring);
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&trace_lock);
+    trace_ring_epoch = epoch;
+    return trace_ring;
+}
+
+/**
+ * @brief Copies a finished record into the calling thread's ring.
+ */
+static void socks5_trace_commit(const struct socks5_trace_record *rec) {
+    struct socks5_trace_ring *ring = socks5_trace_ring_get();
+    uint64_t head;
+
+    if (ring) {
+        head = ring->head;
+        ring->records[head & (TOR_TRACE_RING - 1)] = *rec;
+        __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    }
+}
+#endif
+
+// --- Circuit striping: RFC 1929 isolation tokens ---
+// Tor isolates streams by their SOCKS username/password (IsolateSOCKSAuth is on by default), so every
+// token gets its own circuits. With TOR_ISOLATION_STRIPES set, the greeting offers only username/password
+// and carries one of N generated tokens; a bulk transfer spread over N streams then gets N circuits'
+// bandwidth instead of one. Only one method is offered, so the RFC 1929 sub-negotiation is sent right
+// behind the method offer, and the two replies are read together like a single method reply.
+#define TOR_STRIPE_ROUND_ROBIN 0     // Next token in turn
+#define TOR_STRIPE_PER_DESTINATION 1 // Hash of the destination host: a host keeps its circuit
+#define TOR_STRIPE_PER_THREAD 2      // Each thread sticks to one token
+#define SOCKS5_STRIPE_COUNT (TOR_ISOLATION_STRIPES > 1 ? TOR_ISOLATION_STRIPES : 1) // Tokens in use; 1 without striping
+
+static unsigned int stripe_cursor = 0; // Round-robin position (atomic)
+static __thread int thread_stripe = -1;
+
+/**
+ * @brief Builds the greeting for a connection: method offer, plus the credentials of its token.
+ * @param buffer Output buffer, at least SOCKS5_GREETING_MAX bytes.
+ * @param stripe Index of the isolation token, below TOR_ISOLATION_STRIPES.
+ * @return The greeting length. The proxy answers it with socks5_handshake_success.
+ */
+static size_t socks5_build_greeting(char *buffer, int stripe) {
+#if TOR_ISOLATION_STRIPES
+    // The token is per process as well, so unrelated applications never share a stripe's circuits
+    char password[32];
+    size_t user_len = strlen(TOR_ISOLATION_USER);
+    size_t pass_len = (size_t)snprintf(password, sizeof(password), "%x-%d", (unsigned int)getpid(), stripe);
+    size_t len = 0;
+
+    if (user_len > 255) {
+        user_len = 255;
+    }
+    buffer[len++] = SOCKS_VERSION;
+    buffer[len++] = 0x01;                 // Nmethods
+    buffer[len++] = SOCKS_AUTH_USERPASS;
+    buffer[len++] = SOCKS_USERPASS_VERSION;
+    buffer[len++] = (char)user_len;
+    memcpy(buffer + len, TOR_ISOLATION_USER, user_len);
+    len += user_len;
+    buffer[len++] = (char)pass_len;
+    memcpy(buffer + len, password, pass_len);
+    len += pass_len;
+    return len;
+#else
+    (void)stripe;
+    memcpy(buffer, socks5_initial_handshake, sizeof(socks5_initial_handshake));
+    return sizeof(socks5_initial_handshake);
+#endif
+}
+
+/**
+ * @brief Picks the isolation token for a new connection according to TOR_STRIPE_STRATEGY.
+ * @param key Destination host, hashed by TOR_STRIPE_PER_DESTINATION.
+ * @param key_len Length of key.
+ * @return Index of the token.
+ */
+static int socks5_stripe_for_key(const void *key, size_t key_len) {
+    if (SOCKS5_STRIPE_COUNT == 1) {
+        return 0;
+    }
+    if (TOR_STRIPE_STRATEGY == TOR_STRIPE_PER_DESTINATION) {
+        // Salted apart from the shard ring, so the token does not follow the shard choice
+        uint32_t hash = socks5_hash("stripe", 6, socks5_hash(key, key_len, 2166136261u));
+        return (int)(hash % SOCKS5_STRIPE_COUNT);
+    }
+    if (TOR_STRIPE_STRATEGY == TOR_STRIPE_PER_THREAD) {
+        if (thread_stripe < 0) {
+            thread_stripe = (int)(__atomic_fetch_add(&stripe_cursor, 1, __ATOMIC_RELAXED) % SOCKS5_STRIPE_COUNT);
+        }
+        return thread_stripe;
+    }
+    return (int)(__atomic_fetch_add(&stripe_cursor, 1, __ATOMIC_RELAXED) % SOCKS5_STRIPE_COUNT);
+}
+
+/**
+ * @brief Picks the isolation token for a request; the hash key is the destination Tor is asked to reach.
+ */
+static int socks5_stripe_pick(const struct socks5_request *request) {
+    return socks5_stripe_for_key(request->key, request->key_len);
+}
+
+#if TOR_PREWARM_POOL
+// --- Pre-warmed pool of proxy connections ---
+// A background thread keeps sockets that are already connected to the SocksPort and past the method
+// negotiation. connect() dup3()s one over the application's fd, leaving only CONNECT/reply on the
+// critical path. The pool target follows the observed connect rate between PoolMin and PoolMax.
+// The swap replaces the file behind the fd: the socket options and the local address the application
+// set are gone, and getsockname() reports the pooled connection's. Bound sockets therefore always
+// connect on their own; options are not checked, which is why the pool is opt-in.
+#define TOR_POOL_TICK_MS 100       // Refill / resize period of the pool thread
+#define TOR_POOL_MAX_IDLE_SEC 60   // Tor gives up on a silent SOCKS connection after SocksTimeout (2 min)
+
+struct socks5_pool_entry {
+    int fd;
+    int shard; // SocksPort the connection is greeted on
+    int stripe; // Isolation token the greeting carried
+    unsigned int generation; // Configuration snapshot the shard index belongs to
+    time_t created;
+};
+
+static struct socks5_pool_entry pool_entries[TOR_POOL_MAX];
+static int pool_count = 0;
+static int pool_target = TOR_POOL_MIN;
+static unsigned int pool_takes = 0;      // connect() calls since the last tick
+static unsigned int pool_rate_ewma = 0;  // Connects per tick, x16 fixed point
+static int pool_started = 0;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+
+/**
+ * @brief Opens a proxy connection to a shard and completes the method negotiation on it.
+ * @return The fd, or -1 if the SocksPort is unreachable or refused the greeting.
+ */
+static int socks5_pool_open(int shard, int stripe) {
+    char greeting[SOCKS5_GREETING_MAX];
+    size_t greeting_len = socks5_build_greeting(greeting, stripe);
+    char method_reply[sizeof(socks5_handshake_success)];
+    int fd = socks5_open_proxy_socket(shard, 0, NULL);
+
+    if (fd < 0) {
+        return -1;
+    }
+    // A wedged Tor must not stall the pool thread either
+    socks5_deadline_begin(-1, 0, socks5_config()->greeting_timeout_ms);
+    if (real_send(fd, greeting, greeting_len, MSG_NOSIGNAL) != (ssize_t)greeting_len ||
+        socks5_recv_all(fd, method_reply, sizeof(method_reply), sizeof(method_reply)) != (ssize_t)sizeof(method_reply) ||
+        memcmp(method_reply, socks5_handshake_success, sizeof(method_reply)) != 0) {
+        real_close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * @brief Pool thread: resizes the pool to the connect rate, drops stale entries and refills it.
+ * The target is split evenly over the shards, since every strategy spreads connects about evenly, and
+ * new connections take the isolation tokens in turn.
+ */
+static void *socks5_pool_worker(void *arg) {
+    unsigned int stripe_next = 0;
+
+    (void)arg;
+    for (;;) {
+        const struct socks5_config *cfg;
+        int shard_count;
+        int stale[TOR_POOL_MAX];
+        int stale_count = 0;
+        int kept[TOR_SHARD_MAX] = {0};
+        time_t now = time(NULL);
+        struct timespec wake;
+        int per_shard;
+        int shard;
+        int i;
+
+        socks5_config_enter();
+        cfg = socks5_config();
+        shard_count = cfg->shards->count;
+        // 1. Follow the connect rate: keep about two ticks' worth of connects ready
+        pthread_mutex_lock(&pool_lock);
+        pool_rate_ewma = (pool_rate_ewma * 3 + pool_takes * 16) / 4;
+        pool_takes = 0;
+        pool_target = cfg->pool_min + (int)(pool_rate_ewma * 2 / 16);
+        if (pool_target > cfg->pool_max) {
+            pool_target = cfg->pool_max;
+        }
+
+        // 2. Drop connections Tor is about to time out, those greeted under a replaced configuration, and
+        // anything above a shard's share of the target
+        per_shard = (pool_target + shard_count - 1) / shard_count;
+        for (i = 0; i < pool_count; ) {
+            if (now - pool_entries[i].created > TOR_POOL_MAX_IDLE_SEC || pool_entries[i].generation != cfg->generation ||
+                kept[pool_entries[i].shard] >= per_shard) {
+                stale[stale_count++] = pool_entries[i].fd;
+                pool_entries[i] = pool_entries[--pool_count];
+            } else {
+                kept[pool_entries[i].shard]++;
+                i++;
+            }
+        }
+        pthread_mutex_unlock(&pool_lock);
+        for (i = 0; i < stale_count; i++) {
+            real_close(stale[i]);
+        }
+
+        // 3. Top up outside the lock; skip a shard whose breaker is open, and for this tick one whose
+        // SocksPort is down
+        for (shard = 0; shard < shard_count; shard++) {
+            if (!socks5_breaker_closed(shard)) {
+                continue;
+            }
+            while (kept[shard]++ < per_shard) {
+                int stripe = (int)(stripe_next++ % SOCKS5_STRIPE_COUNT);
+                int fd = socks5_pool_open(shard, stripe);
+                if (fd < 0) {
+                    break;
+                }
+                pthread_mutex_lock(&pool_lock);
+                if (pool_count < TOR_POOL_MAX) {
+                    pool_entries[pool_count].fd = fd;
+                    pool_entries[pool_count].shard = shard;
+                    pool_entries[pool_count].stripe = stripe;
+                    pool_entries[pool_count].generation = cfg->generation;
+                    pool_entries[pool_count].created = time(NULL);
+                    pool_count++;
+                    fd = -1;
+                }
+                pthread_mutex_unlock(&pool_lock);
+                if (fd >= 0) {
+                    real_close(fd);
+                }
+            }
+        }
+
+        socks5_config_leave();
+
+        // 4. Sleep until the next tick, or until connect() finds the pool running low
+        clock_gettime(CLOCK_REALTIME, &wake);
+        wake.tv_nsec += (long)TOR_POOL_TICK_MS * 1000000;
+        if (wake.tv_nsec >= 1000000000) {
+            wake.tv_sec++;
+            wake.tv_nsec -= 1000000000;
+        }
+        pthread_mutex_lock(&pool_lock);
+        pthread_cond_timedwait(&pool_cond, &pool_lock, &wake);
+        pthread_mutex_unlock(&pool_lock);
+    }
+    return NULL;
+}
+
+// fork() only copies the calling thread: the child starts without a pool and without pool thread,
+// and must not share the parent's half-open proxy connections.
+static void socks5_pool_prefork(void) {
+    pthread_mutex_lock(&pool_lock);
+}
+
+static void socks5_pool_postfork_parent(void) {
+    pthread_mutex_unlock(&pool_lock);
+}
+
+static void socks5_pool_postfork_child(void) {
+    int i;
+    for (i = 0; i < pool_count; i++) {
+        real_close(pool_entries[i].fd);
+    }
+    pool_count = 0;
+    pool_takes = 0;
+    pool_rate_ewma = 0;
+    pool_target = socks5_config()->pool_min;
+    __atomic_store_n(&pool_started, 0, __ATOMIC_RELEASE);
+    pthread_cond_init(&pool_cond, NULL);
+    pthread_mutex_unlock(&pool_lock);
+}
+
+/**
+ * @brief Starts the pool thread on the first proxied connect, so processes that never connect pay nothing.
+ */
+static void socks5_pool_start(void) {
+    static int atfork_registered = 0;
+    int expected = 0;
+    pthread_attr_t attr;
+    pthread_t thread;
+    sigset_t all, saved;
+
+    if (!__atomic_compare_exchange_n(&pool_started, &expected, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    if (!atfork_registered) {
+        pthread_atfork(socks5_pool_prefork, socks5_pool_postfork_parent, socks5_pool_postfork_child);
+        atfork_registered = 1;
+    }
+    // The application's signal handlers must never run on the shim's thread
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &saved);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setstacksize(&attr, 64 * 1024);
+    if (pthread_create(&thread, &attr, socks5_pool_worker, NULL) != 0) {
+        fprintf(stderr, "TORSOCKS_WRAPPER: Could not start the proxy pool thread.\n");
+    }
+    pthread_attr_destroy(&attr);
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+}
+
+/**
+ * @brief Moves a pre-warmed proxy connection onto the application's socket.
+ * O_NONBLOCK and FD_CLOEXEC of sockfd are preserved; other socket options are not (see above).
+ * @param sockfd The application's socket.
+ * @param shard The SocksPort the connection has to go through.
+ * @param stripe The isolation token the connection has to carry.
+ * @return 0 if sockfd now holds a greeted proxy connection, -1 if sockfd is bound or the pool had none
+ * for shard and stripe.
+ */
+static int socks5_pool_take(int sockfd, int shard, int stripe) {
+    unsigned int generation = socks5_config()->generation;
+    int fl_flags, fd_flags;
+    int fd = -1;
+    int i;
+
+    socks5_pool_start();
+    if (socks5_socket_bound(sockfd)) {
+        return -1;
+    }
+    pthread_mutex_lock(&pool_lock);
+    pool_takes++;
+    for (i = pool_count - 1; i >= 0; i--) {
+        if (pool_entries[i].shard == shard && pool_entries[i].stripe == stripe && pool_entries[i].generation == generation) {
+            fd = pool_entries[i].fd;
+            pool_entries[i] = pool_entries[--pool_count];
+            break;
+        }
+    }
+    if (pool_count < pool_target / 2 + 1) {
+        pthread_cond_signal(&pool_cond);
+    }
+    pthread_mutex_unlock(&pool_lock);
+    if (fd < 0) {
+        return -1;
+    }
+
+    fl_flags = fcntl(sockfd, F_GETFL);
+    fd_flags = fcntl(sockfd, F_GETFD);
+    if (fl_flags < 0 || fd_flags < 0 ||
+        ((fl_flags & O_NONBLOCK) && fcntl(fd, F_SETFL, fl_flags) < 0) ||
+        real_dup3(fd, sockfd, (fd_flags & FD_CLOEXEC) ? O_CLOEXEC : 0) < 0) {
+        real_close(fd);
+        return -1;
+    }
+    real_close(fd);
+    return 0;
+}
+
+/**
+ * @brief Sends the CONNECT request on a pooled proxy connection (greeting already done) and checks the reply.
+ * @param sockfd The application's socket, holding a pooled proxy connection.
+ * @param request The CONNECT request.
+ * @param request_len Length of request.
+ * @param reply Receives the CONNECT reply code; untouched if no reply was read.
+ * @return 0 on SOCKS success, -1 with errno set on failure.
+ */
+static int socks5_pooled_exchange(int sockfd, const char *request, size_t request_len, int *reply) {
+    char buffer[SOCKS5_REPLY_MAX];
+    ssize_t bytes_read;
+
+#if TOR_OPTIMISTIC_DATA
+    if (socks5_optimistic_start(sockfd, request, request_len, NULL, 0) == 0) {
+        socks5_trace_flag(&trace_current, SOCKS5_TRACE_OPTIMISTIC);
+        return 0;
+    }
+#endif
+    if (real_send(sockfd, request, request_len, MSG_NOSIGNAL) < 0) {
+        return -1;
+    }
+    bytes_read = socks5_read_reply(sockfd, buffer, 0);
+    if (bytes_read < 2) {
+        socks5_trace_reply(&trace_current, 0xff);
+        return -1;
+    }
+    *reply = (unsigned char)buffer[1];
+    socks5_trace_reply(&trace_current, *reply);
+    if (*reply != SOCKS_REPLY_SUCCESS) {
+        socks5_reply_failed(*reply);
+        socks5_negative_add(request, request_len, *reply);
+        return -1;
+    }
+    return 0;
+}
+#endif
+
+// --- Per-fd state table ---
+// Everything the shim knows about a socket lives in a slot indexed by fd. Slots come in chunks allocated
+// on first use behind a directory sized from RLIMIT_NOFILE, so a process with 100k sockets pays for the
+// fd ranges it actually uses. Lookups are atomic loads only: send()/recv()/close() on fds the shim never
+// touched take no lock, and a tracked fd only takes the lock of its own slot, so closing or querying one
+// socket never waits for another. Chunks are never freed, so a slot pointer stays valid for the process
+// lifetime.
+#define SOCKS5_FD_CHUNK 1024          // Slots per lazily allocated chunk
+#define SOCKS5_FD_TABLE_CAP (1 << 24) // Table size when RLIMIT_NOFILE is unlimited
+
+enum socks5_fd_phase {
+    SOCKS5_FD_UNUSED,      // Not a proxied socket
+    SOCKS5_FD_NEGOTIATING, // SOCKS handshake in progress
+    SOCKS5_FD_ESTABLISHED, // SOCKS reply accepted, the stream is usable
+    SOCKS5_FD_FAILED       // Handshake failed
+};
+
+// Where a proxied socket was meant to go; getpeername() answers from here
+struct socks5_fd_target {
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    char host[NI_MAXHOST];       // Destination as the CONNECT request names it
+    struct timespec started;     // connect() called (CLOCK_MONOTONIC)
+    struct timespec established; // SOCKS reply accepted (CLOCK_MONOTONIC)
+    int reply;                   // CONNECT reply code, SOCKS5_REPLY_NONE until one arrives
+    int error;                   // errno the connect ended with, 0 on success or while it runs
+};
+
+// One slot per fd. The epoll registration is recorded for every fd because event loops such as nginx
+// register the socket before they call connect().
+struct socks5_fd_slot {
+    pthread_mutex_t lock;             // Guards the non-atomic fields of this slot
+    int phase;                        // enum socks5_fd_phase (atomic)
+    int in_use;                       // Set while the slot holds any state; close() skips the lock while 0 (atomic)
+    struct socks5_fd_target *target;  // Proxied target, or NULL
+    int shard;                        // 1 + index of the SocksPort shard carrying the stream, 0 if none
+    struct socks5_async_state *async; // Handshake in progress, or NULL
+    int error;                        // Failed handshake errno, reported once through SO_ERROR
+    int epoll_registered;             // Set while the application has the fd in an epoll set
+    int epfd;                         // Last epoll set the application added the fd to
+    struct epoll_event app_event;     // What the application asked that epoll set for
+    struct socks5_optimistic_state *optimistic; // Optimistic CONNECT whose reply is not consumed yet
+#if TOR_ADMISSION
+    struct socks5_admission_ticket admission;   // Admission ticket of the handshake in flight
+#endif
+};
+
+struct socks5_fd_dir {
+    size_t chunks;
+    struct socks5_fd_slot *chunk[]; // Each NULL until an fd in its range is used
+};
+
+static struct socks5_fd_dir *fd_table = NULL;
+
+/**
+ * @brief Allocates the chunk directory, sized from the hard RLIMIT_NOFILE (applications raise the soft one).
+ * @return The published directory, or NULL if out of memory.
+ */
+static struct socks5_fd_dir *socks5_fd_table_init(void) {
+    struct socks5_fd_dir *dir;
+    struct socks5_fd_dir *expected = NULL;
+    struct rlimit rl;
+    size_t limit = SOCKS5_FD_TABLE_CAP;
+    size_t chunks;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_max != RLIM_INFINITY && rl.rlim_max < SOCKS5_FD_TABLE_CAP) {
+        limit = (size_t)rl.rlim_max;
+    }
+    chunks = (limit + SOCKS5_FD_CHUNK - 1) / SOCKS5_FD_CHUNK;
+    dir = calloc(1, sizeof(*dir) + chunks * sizeof(dir->chunk[0]));
+    if (!dir) {
+        return NULL;
+    }
+    dir->chunks = chunks;
+    if (!__atomic_compare_exchange_n(&fd_table, &expected, dir, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        free(dir);
+        return expected;
+    }
+    return dir;
+}
+
+/**
+ * @brief Looks up the slot of an fd without taking a lock.
+ * @param fd The file descriptor.
+ * @param create Non-zero to allocate the directory / chunk if it does not exist yet.
+ * @return The slot, or NULL if fd is out of range, untouched (create == 0) or memory ran out.
+ */
+static struct socks5_fd_slot *socks5_fd_slot(int fd, int create) {
+    struct socks5_fd_dir *dir = __atomic_load_n(&fd_table, __ATOMIC_ACQUIRE);
+    struct socks5_fd_slot *chunk;
+    struct socks5_fd_slot *expected = NULL;
+    size_t index;
+
+    if (fd < 0) {
+        return NULL;
+    }
+    if (!dir) {
+        if (!create || !(dir = socks5_fd_table_init())) {
+            return NULL;
+        }
+    }
+    index = (size_t)fd / SOCKS5_FD_CHUNK;
+    if (index >= dir->chunks) {
+        return NULL;
+    }
+    chunk = __atomic_load_n(&dir->chunk[index], __ATOMIC_ACQUIRE);
+    if (!chunk) {
+        if (!create || !(chunk = calloc(SOCKS5_FD_CHUNK, sizeof(*chunk)))) {
+            return NULL;
+        }
+        for (size_t i = 0; i < SOCKS5_FD_CHUNK; i++) {
+            pthread_mutex_init(&chunk[i].lock, NULL);
+        }
+        if (!__atomic_compare_exchange_n(&dir->chunk[index], &expected, chunk, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            free(chunk);
+            chunk = expected;
+        }
+    }
+    return &chunk[(size_t)fd % SOCKS5_FD_CHUNK];
+}
+
+/**
+ * @brief What a repeated connect() on an fd the shim already handled reports, as the kernel would.
+ * A failed fd that starts over is disconnected first (connect() to AF_UNSPEC, which keeps its options and
+ * bind()): it may still be connected to the SocksPort, and the new proxy connect would fail with EISCONN.
+ * @return EISCONN once the stream is up, EALREADY while the handshake runs, a failed asynchronous
+ *         handshake's error once, or 0 if the fd is free for a new proxied connect.
+ */
+static int socks5_fd_repeat(int fd) {
+    struct socks5_fd_slot *slot = socks5_fd_slot(fd, 0);
+    int error = 0;
+
+    if (!slot || !__atomic_load_n(&slot->in_use, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+    pthread_mutex_lock(&slot->lock);
+    switch (__atomic_load_n(&slot->phase, __ATOMIC_ACQUIRE)) {
+    case SOCKS5_FD_ESTABLISHED:
+        error = EISCONN;
+        break;
+    case SOCKS5_FD_NEGOTIATING:
+        error = EALREADY;
+        break;
+    case SOCKS5_FD_FAILED:
+        // Reported once, like SO_ERROR; the connect() after that starts over
+        error = slot->error;
+        slot->error = 0;
+        if (!error) {
+            // An AF_UNIX leg refuses this, but it is swapped for a fresh one by socks5_connect_proxy() anyway
+            struct sockaddr unspec = {.sa_family = AF_UNSPEC};
+            real_connect(fd, &unspec, sizeof(unspec));
+        }
+        break;
+    }
+    pthread_mutex_unlock(&slot->lock);
+    return error;
+}
+
+/**
+ * @brief Records the target of a proxied connect() and marks the fd as negotiating.
+ * @param sockfd The application's socket.
+ * @param addr The target the application asked for.
+ * @param addrlen Length of addr.
+ * @param host The destination as the CONNECT request names it.
+ * @param shard The SocksPort shard the stream goes through; counted until close().
+ * @return The slot of sockfd, or NULL if the fd cannot be tracked (the blocking path still works).
+ */
+static struct socks5_fd_slot *socks5_fd_track(int sockfd, const struct sockaddr *addr, socklen_t addrlen, const char *host,
+                                              int shard) {
+    struct socks5_fd_slot *slot = socks5_fd_slot(sockfd, 1);
+    struct socks5_fd_target *target;
+    struct socks5_fd_target *old;
+
+    if (!slot) {
+        return NULL;
+    }
+    target = calloc(1, sizeof(*target));
+    if (target) {
+        target->addr_len = addrlen < sizeof(target->addr) ? addrlen : sizeof(target->addr);
+        memcpy(&target->addr, addr, target->addr_len);
+        snprintf(target->host, sizeof(target->host), "%s", host);
+        clock_gettime(CLOCK_MONOTONIC, &target->started);
+        target->reply = SOCKS5_REPLY_NONE;
+    }
+    __atomic_add_fetch(&shard_outstanding[shard], 1, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&slot->lock);
+    old = slot->target;
+    slot->target = target;
+    // A repeated connect() on the same fd moves the stream's accounting to the new shard
+    if (slot->shard) {
+        __atomic_sub_fetch(&shard_outstanding[slot->shard - 1], 1, __ATOMIC_RELAXED);
+    }
+    slot->shard = shard + 1;
+    __atomic_store_n(&slot->phase, SOCKS5_FD_NEGOTIATING, __ATOMIC_RELEASE);
+    __atomic_store_n(&slot->in_use, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&slot->lock);
+    free(old);
+    return slot;
+}
+
+/**
+ * @brief Moves a tracked fd to its final phase. Called with the slot's lock held.
+ */
+static void socks5_fd_finish(struct socks5_fd_slot *slot, int phase) {
+    if (phase == SOCKS5_FD_ESTABLISHED && slot->target) {
+        clock_gettime(CLOCK_MONOTONIC, &slot->target->established);
+    }
+    __atomic_store_n(&slot->phase, phase, __ATOMIC_RELEASE);
+#if TOR_ADMISSION
+    socks5_admission_leave(&slot->admission);
+#endif
+}
+
+/**
+ * @brief Records how a blocking proxied connect() ended; slot may be NULL.
+ * @param reply The CONNECT reply code, SOCKS5_REPLY_NONE if none was read (or it is still queued).
+ * @param error 0 if the stream is usable, else the errno connect() reports.
+ */
+static void socks5_fd_result(struct socks5_fd_slot *slot, int reply, int error) {
+    if (slot) {
+        pthread_mutex_lock(&slot->lock);
+        if (slot->target) {
+            slot->target->reply = reply;
+            slot->target->error = error;
+        }
+        socks5_fd_finish(slot, error ? SOCKS5_FD_FAILED : SOCKS5_FD_ESTABLISHED);
+        pthread_mutex_unlock(&slot->lock);
+    }
+}
+
+/**
+ * @brief Gives a dup()ed fd the target record of the original. Handshake state stays with oldfd.
+ */
+static void socks5_fd_copy(int oldfd, int newfd) {
+    struct socks5_fd_slot *from = socks5_fd_slot(oldfd, 0);
+    struct socks5_fd_slot *to;
+    struct socks5_fd_target *target;
+    struct socks5_fd_target *old;
+    int phase = SOCKS5_FD_UNUSED;
+
+    if (!from || !__atomic_load_n(&from->in_use, __ATOMIC_ACQUIRE) || !(to = socks5_fd_slot(newfd, 1))) {
+        return;
+    }
+    target = malloc(sizeof(*target));
+    if (!target) {
+        return;
+    }
+    // One slot lock at a time: two threads dup()ing in opposite directions must not deadlock
+    pthread_mutex_lock(&from->lock);
+    if (from->target) {
+        memcpy(target, from->target, sizeof(*target));
+        phase = __atomic_load_n(&from->phase, __ATOMIC_ACQUIRE);
+    }
+    pthread_mutex_unlock(&from->lock);
+    if (phase == SOCKS5_FD_UNUSED) {
+        free(target);
+        return;
+    }
+    pthread_mutex_lock(&to->lock);
+    old = to->target;
+    to->target = target;
+    __atomic_store_n(&to->phase, phase, __ATOMIC_RELEASE);
+    __atomic_store_n(&to->in_use, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&to->lock);
+    free(old);
+}
+
+// --- Connect status query ---
+// errno alone cannot say which SOCKS reply a connect() got or whether retrying makes sense. Applications
+// look this up with dlsym(RTLD_DEFAULT, "torsocks_connect_status"), so they run unchanged without the
+// shim, and declare struct torsocks_connect_status with the same layout. The answer stays available
+// until the fd is closed.
+struct torsocks_connect_status {
+    int reply; // CONNECT reply code (0x00-0x08, Tor's 0xf0-0xf7), -1 if none was received
+    int error; // errno connect() or SO_ERROR reported, 0 on success or while the handshake runs
+    int retry; // 1 if a new attempt may succeed (new circuit, another SocksPort), 0 if it will not
+};
+
+/**
+ * @brief Tells how the proxied connect() on fd ended.
+ * @param fd The application's socket.
+ * @param status Receives the reply code, the errno and the retry hint.
+ * @return 0 on success, -1 with errno ENOENT if fd never went through Tor (bypassed, untouched, closed).
+ */
+int torsocks_connect_status(int fd, struct torsocks_connect_status *status) {
+    struct socks5_fd_slot *slot = socks5_fd_slot(fd, 0);
+    int found = 0;
+
+    if (slot && __atomic_load_n(&slot->in_use, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&slot->lock);
+        if (slot->target) {
+            status->reply = slot->target->reply;
+            status->error = slot->target->error;
+            found = 1;
+        }
+        pthread_mutex_unlock(&slot->lock);
+    }
+    if (!found) {
+        errno = ENOENT;
+        return -1;
+    }
+    if (status->error == 0 || status->reply == SOCKS_REPLY_SUCCESS) {
+        status->retry = 0;
+    } else if (status->reply == SOCKS5_REPLY_NONE) {
+        status->retry = 1; // The proxy leg failed: another SocksPort, or Tor once it is back, may do
+    } else {
+        status->retry = socks5_reply_lookup(status->reply)->retry;
+    }
+    return 0;
+}
+
+#if TOR_METRICS
+// --- Metrics: per-CPU counters in a segment shared by every preloaded process ---
+// All shim instances on the host map the same file (MetricsSegment, in /dev/shm by default) and add to
+// it. The counters are split per CPU, so processes running on different CPUs never write the same cache
+// line: an update is a sched_getcpu() (vDSO) and one relaxed atomic add, no lock and no system call.
+// Connect latency goes into log-linear histograms with 8 sub-buckets per power of two, i.e. 3 significant
+// bits like HdrHistogram. MetricsExporter sums the CPUs and serves the Prometheus text format;
+// MetricsExporter.c carries a copy of this layout.
+#define TOR_METRICS_CPUS 256                      // CPUs beyond this share slots
+#define SOCKS5_METRICS_MAGIC 0x31435254454d5354ull // "TSMETRC1"
+#define SOCKS5_METRICS_BUCKETS 240                // Microseconds, 0 up to 2^32
+#define SOCKS5_METRICS_REPLIES 19                 // 0x00-0x08, Tor's 0xf0-0xf7, any other code, no reply
+
+#define SOCKS5_METRICS_PROXIED 0
+#define SOCKS5_METRICS_BYPASSED 1
+#define SOCKS5_METRICS_SENT 0
+#define SOCKS5_METRICS_RECEIVED 1
+#define SOCKS5_METRICS_SUCCESS 0
+#define SOCKS5_METRICS_FAILURE 1
+
+struct socks5_metrics_header {
+    uint64_t magic;    // SOCKS5_METRICS_MAGIC once the layout fields are set (atomic)
+    uint32_t cpus;     // TOR_METRICS_CPUS
+    uint32_t buckets;  // SOCKS5_METRICS_BUCKETS
+    uint32_t replies;  // SOCKS5_METRICS_REPLIES
+    uint32_t reserved0;
+    uint64_t attached; // Processes that attached since the segment was created (atomic)
+    uint8_t reserved[32];
+};
+
+struct socks5_metrics_cpu {
+    uint64_t connects[2];                    // By SOCKS5_METRICS_PROXIED / _BYPASSED
+    uint64_t succeeded;                      // Proxied connects that became usable
+    uint64_t failed[SOCKS5_METRICS_REPLIES]; // Proxied connects that failed, by SOCKS reply
+    uint64_t bytes[2];                       // Proxied stream payload, by _SENT / _RECEIVED
+    uint64_t latency_sum_us[2];              // By _SUCCESS / _FAILURE
+    uint64_t latency[2][SOCKS5_METRICS_BUCKETS];
+} __attribute__((aligned(64)));
+
+static struct socks5_metrics_cpu *metrics_cpus = NULL; // NULL until attached, or when metrics are off
+static pthread_once_t metrics_once = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief Maps the shared segment, creating it if this is the first process. A fork()ed child keeps the mapping.
+ */
+static void socks5_metrics_attach(void) {
+    const char *path = socks5_config()->metrics_segment;
+    size_t size = sizeof(struct socks5_metrics_header) + TOR_METRICS_CPUS * sizeof(struct socks5_metrics_cpu);
+    struct socks5_metrics_header *header;
+    uint64_t magic = 0;
+    struct stat st;
+    void *map;
+    int fd;
+
+    if (path[0] == '\0') {
+        return;
+    }
+    // 1. The first process sizes the segment; later ones must find the same layout
+    fd = open(path, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if (fd < 0 || fstat(fd, &st) < 0 || (st.st_size == 0 && ftruncate(fd, (off_t)size) < 0)) {
+        fprintf(stderr, "TORSOCKS_WRAPPER: Could not open the metrics segment %s.\n", path);
+        if (fd >= 0) {
+            real_close(fd);
+        }
+        return;
+    }
+    if (st.st_size != 0 && (size_t)st.st_size != size) {
+        fprintf(stderr, "TORSOCKS_WRAPPER: The metrics segment %s has another layout.\n", path);
+        real_close(fd);
+        return;
+    }
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    real_close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "TORSOCKS_WRAPPER: Could not map the metrics segment %s.\n", path);
+        return;
+    }
+
+    // 2. Describe the layout, then publish it with the magic; racing processes write the same values
+    header = map;
+    if (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) == 0) {
+        header->cpus = TOR_METRICS_CPUS;
+        header->buckets = SOCKS5_METRICS_BUCKETS;
+        header->replies = SOCKS5_METRICS_REPLIES;
+        __atomic_compare_exchange_n(&header->magic, &magic, SOCKS5_METRICS_MAGIC, 0, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE);
+    }
+    if (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != SOCKS5_METRICS_MAGIC || header->cpus != TOR_METRICS_CPUS ||
+        header->buckets != SOCKS5_METRICS_BUCKETS || header->replies != SOCKS5_METRICS_REPLIES) {
+        fprintf(stderr, "TORSOCKS_WRAPPER: The metrics segment %s has another layout.\n", path);
+        munmap(map, size);
+        return;
+    }
+    __atomic_add_fetch(&header->attached, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&metrics_cpus, (struct socks5_metrics_cpu *)(header + 1), __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief The counters of the CPU this thread runs on, or NULL if metrics are off.
+ */
+static struct socks5_metrics_cpu *socks5_metrics_cpu(void) {
+    struct socks5_metrics_cpu *cpus = __atomic_load_n(&metrics_cpus, __ATOMIC_ACQUIRE);
+    int cpu;
+
+    if (!cpus) {
+        socks5_config_enter();
+        pthread_once(&metrics_once, socks5_metrics_attach);
+        socks5_config_leave();
+        cpus = __atomic_load_n(&metrics_cpus, __ATOMIC_ACQUIRE);
+        if (!cpus) {
+            return NULL;
+        }
+    }
+    // Migrating between the call and the add only lands the count on a neighbour's slot
+    cpu = sched_getcpu();
+    return &cpus[cpu > 0 ? cpu % TOR_METRICS_CPUS : 0];
+}
+
+static void socks5_metrics_add(uint64_t *counter, uint64_t value) {
+    __atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Counts a connect() that goes through Tor (SOCKS5_METRICS_PROXIED) or directly (_BYPASSED).
+ */
+static void socks5_metrics_count(int route) {
+    struct socks5_metrics_cpu *cpu = socks5_metrics_cpu();
+
+    if (cpu) {
+        socks5_metrics_add(&cpu->connects[route], 1);
+    }
+}
+
+/**
+ * @brief Histogram bucket of a latency: exact below 8 us, then 8 buckets per power of two.
+ */
+static int socks5_metrics_bucket(uint32_t us) {
+    int exponent;
+
+    if (us < 8) {
+        return (int)us;
+    }
+    exponent = 31 - __builtin_clz(us);
+    return (exponent - 2) * 8 + (int)((us >> (exponent - 3)) & 7);
+}
+
+/**
+ * @brief Slot of a SOCKS reply code in the failure counters.
+ */
+static int socks5_metrics_reply(int code) {
+    if (code <= 0x08) {
+        return code;
+    }
+    if (code >= 0xf0 && code <= 0xf7) {
+        return 9 + (code - 0xf0);
+    }
+    return code == 0xff ? SOCKS5_METRICS_REPLIES - 1 : SOCKS5_METRICS_REPLIES - 2;
+}
+
+/**
+ * @brief Adds a finished proxied connect: its outcome, SOCKS reply and latency.
+ */
+static void socks5_metrics_connect(const struct socks5_trace_record *rec) {
+    struct socks5_metrics_cpu *cpu = socks5_metrics_cpu();
+    int outcome = rec->error ? SOCKS5_METRICS_FAILURE : SOCKS5_METRICS_SUCCESS;
+
+    if (!cpu) {
+        return;
+    }
+    if (outcome == SOCKS5_METRICS_SUCCESS) {
+        socks5_metrics_add(&cpu->succeeded, 1);
+    } else {
+        socks5_metrics_add(&cpu->failed[socks5_metrics_reply(rec->reply)], 1);
+    }
+    socks5_metrics_add(&cpu->latency_sum_us[outcome], rec->total_us);
+    socks5_metrics_add(&cpu->latency[outcome][socks5_metrics_bucket(rec->total_us)], 1);
+}
+
+/**
+ * @brief Counts payload moved by send()/write()/recv()/read() if fd is an established proxied stream.
+ * @param fd The application's fd.
+ * @param n What the real call returned.
+ * @param direction SOCKS5_METRICS_SENT or SOCKS5_METRICS_RECEIVED.
+ */
+static void socks5_metrics_io(int fd, ssize_t n, int direction) {
+    struct socks5_fd_slot *slot;
+    struct socks5_metrics_cpu *cpu;
+
+    if (n <= 0 || !(slot = socks5_fd_slot(fd, 0)) ||
+        __atomic_load_n(&slot->phase, __ATOMIC_ACQUIRE) != SOCKS5_FD_ESTABLISHED) {
+        return;
+    }
+    cpu = socks5_metrics_cpu();
+    if (cpu) {
+        socks5_metrics_add(&cpu->bytes[direction], (uint64_t)n);
+    }
+}
+#else
+#define socks5_metrics_count(route) ((void)0)
+#define socks5_metrics_io(fd, n, direction) ((void)0)
+#endif
+
+#if TOR_TRACE || TOR_METRICS
+/**
+ * @brief Finishes a connect record: commits it to the trace ring and adds it to the metrics.
+ * @param rec The record, started by socks5_trace_begin().
+ * @param flag SOCKS5_TRACE_* describing the path taken, or 0.
+ * @param error errno handed to the application, 0 on success.
+ */
+static void socks5_trace_end(struct socks5_trace_record *rec, int flag, int error) {
+    if (!rec->start_ns) {
+        return;
+    }
+    rec->total_us = (uint32_t)((socks5_trace_now_ns() - rec->start_ns) / 1000);
+    rec->flags |= (uint16_t)flag;
+    rec->error = error;
+#if TOR_TRACE
+    socks5_trace_commit(rec);
+#endif
+#if TOR_METRICS
+    socks5_metrics_connect(rec);
+#endif
+    rec->start_ns = 0;
+}
+#else
+#define socks5_trace_end(rec, flag, error) ((void)0)
+#endif
+
+// --- Non-blocking connect(): asynchronous SOCKS5 state machine ---
+// A non-blocking socket only starts the TCP connect to the proxy inside connect(); the greeting, CONNECT
+// request and reply are then moved forward from the interposed poll()/select()/epoll_wait() whenever the
+// socket is ready. The application is told the socket is writable only once the SOCKS reply is accepted.
+// While the handshake runs, the fd sits in the application's epoll set under the shim's own data word
+// (SOCKS5_EPOLL_TAG | fd), so epoll_wait() finds the socket from the event alone; the application's
+// registration, data word included, is put back when the handshake ends.
+#define SOCKS5_ASYNC_BUF 1024 // Greeting with an isolation token + CONNECT request
+#define SOCKS5_EPOLL_TAG (0x534f4b35ull << 32) // "SOK5" in the upper half of the data word, the fd below
+
+enum socks5_async_phase {
+    SOCKS5_PHASE_PROXY_CONNECT, // TCP connect to the proxy still in flight
+    SOCKS5_PHASE_METHOD_REPLY,  // Greeting queued, waiting for Ver | Method
+    SOCKS5_PHASE_CONNECT_REPLY  // CONNECT request queued, waiting for the final reply
+};
+
+// Result of socks5_async_advance()
+enum socks5_async_result {
+    SOCKS5_ASYNC_NONE,    // fd has no handshake in progress
+    SOCKS5_ASYNC_PENDING, // still waiting on the proxy, see *need
+    SOCKS5_ASYNC_DONE,    // SOCKS reply accepted, the socket is usable
+    SOCKS5_ASYNC_FAILED   // handshake failed, error waits in SO_ERROR
+};
+
+struct socks5_async_state {
+    int fd;
+    int phase;
+    int shard;                      // SocksPort shard the proxy leg goes to
+    int stripe;                     // Isolation token the greeting carries
+    char request[SOCKS5_ASYNC_BUF]; // CONNECT request, sent once the method reply arrives
+    size_t request_len;
+    char out[SOCKS5_ASYNC_BUF];     // Bytes queued for the proxy
+    size_t out_len, out_off;
+    char in[SOCKS5_ASYNC_BUF];      // Bytes of the reply read so far
+    size_t in_len, in_need;
+    size_t reply_off;               // Where the CONNECT reply starts in in[] (behind the method reply when pipelined)
+#if TOR_TRACE || TOR_METRICS
+    struct socks5_trace_record trace; // Started by connect(), committed when the handshake ends
+#endif
+};
+
+static int async_pending = 0; // Handshakes in flight; readiness calls skip all of this while it is 0
+
+/**
+ * @brief Re-registers the fd in the application's epoll set. Called with the slot's lock held.
+ */
+static void socks5_async_rearm(int fd, struct socks5_fd_slot *slot, uint32_t events) {
+    if (!slot->epoll_registered) {
+        return;
+    }
+    struct epoll_event ev = slot->app_event;
+    int saved_errno = errno;
+    ev.events = events;
+    if (slot->async) {
+        ev.data.u64 = SOCKS5_EPOLL_TAG | (uint32_t)fd;
+    }
+    // A unix-domain proxy leg replaces the file behind the fd, which drops it from the epoll set
+    if (real_epoll_ctl(slot->epfd, EPOLL_CTL_MOD, fd, &ev) < 0 && errno == ENOENT) {
+        real_epoll_ctl(slot->epfd, EPOLL_CTL_ADD, fd, &ev);
+    }
+    errno = saved_errno;
+}
+
+/**
+ * @brief Drops the handshake state of an fd. Called with the slot's lock held.
+ */
+static void socks5_async_release(struct socks5_fd_slot *slot) {
+    struct socks5_async_state *st = slot->async;
+
+    if (!st) {
+        return;
+    }
+    slot->async = NULL;
+    __atomic_sub_fetch(&async_pending, 1, __ATOMIC_RELEASE);
+    free(st);
+}
+
+/**
+ * @brief Ends a handshake with an error. Called with the slot's lock held.
+ */
+static int socks5_async_fail(int fd, struct socks5_fd_slot *slot, int error) {
+    socks5_trace_end(&slot->async->trace, 0, error);
+    socks5_async_release(slot);
+    socks5_fd_finish(slot, SOCKS5_FD_FAILED);
+    slot->error = error;
+    if (slot->target) {
+        slot->target->error = error;
+    }
+    // Make further I/O on the half-negotiated stream fail instead of talking raw SOCKS
+    shutdown(fd, SHUT_RDWR);
+    socks5_async_rearm(fd, slot, slot->app_event.events);
+    return SOCKS5_ASYNC_FAILED;
+}
+
+/**
+ * @brief Moves the SOCKS5 exchange of an fd forward without blocking. Called with the slot's lock held.
+ * @param fd The application's socket.
+ * @param need Set to POLLIN or POLLOUT when the handshake is still pending.
+ * @return One of enum socks5_async_result.
+ */
+static int socks5_async_advance(int fd, short *need) {
+    struct socks5_fd_slot *slot;
+    struct socks5_async_state *st;
+    ssize_t n;
+
+    slot = socks5_fd_slot(fd, 0);
+    if (!slot) {
+        return SOCKS5_ASYNC_NONE;
+    }
+    st = slot->async;
+    if (!st) {
+        return slot->error ? SOCKS5_ASYNC_FAILED : SOCKS5_ASYNC_NONE;
+    }
+
+    for (;;) {
+        // 1. Wait for the TCP connect to the proxy, then queue the greeting
+        if (st->phase == SOCKS5_PHASE_PROXY_CONNECT) {
+            struct pollfd pfd = { fd, POLLOUT, 0 };
+            int err = 0;
+            socklen_t len = sizeof(err);
+
+            if (real_poll(&pfd, 1, 0) == 0) {
+                *need = POLLOUT;
+                return SOCKS5_ASYNC_PENDING;
+            }
+            if (real_getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) {
+                err = errno;
+            }
+            if (err) {
+                socks5_report_proxy_failure(st->shard);
+                return socks5_async_fail(fd, slot, err);
+            }
+            socks5_report_proxy_success(st->shard);
+            socks5_trace_mark(&st->trace, SOCKS5_TRACE_PROXY);
+            st->out_len = socks5_build_greeting(st->out, st->stripe);
+            st->out_off = 0;
+            st->in_len = 0;
+            st->in_need = sizeof(socks5_handshake_success);
+            st->phase = SOCKS5_PHASE_METHOD_REPLY;
+#if TOR_PIPELINED_HANDSHAKE
+            // The CONNECT request rides along with the greeting; both replies are collected together
+            memcpy(st->out + st->out_len, st->request, st->request_len);
+            st->out_len += st->request_len;
+            st->reply_off = sizeof(socks5_handshake_success);
+            st->in_need = st->reply_off + SOCKS5_REPLY_MIN;
+            st->phase = SOCKS5_PHASE_CONNECT_REPLY;
+#endif
+        }
+
+        // 2. Flush whatever is queued for the proxy
+        while (st->out_off < st->out_len) {
+            n = real_send(fd, st->out + st->out_off, st->out_len - st->out_off, MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                // EINPROGRESS: Fast Open had no cookie and sent a bare SYN, retry once connected
+                if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINPROGRESS) {
+                    *need = POLLOUT;
+                    return SOCKS5_ASYNC_PENDING;
+                }
+                return socks5_async_fail(fd, slot, errno);
+            }
+            st->out_off += (size_t)n;
+        }
+
+        // 3. Collect the reply of the current phase
+        while (st->in_len < st->in_need) {
+            n = real_recv(fd, st->in + st->in_len, st->in_need - st->in_len, MSG_DONTWAIT);
+            if (n == 0) {
+                return socks5_async_fail(fd, slot, ECONNRESET);
+            }
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    *need = POLLIN;
+                    return SOCKS5_ASYNC_PENDING;
+                }
+                return socks5_async_fail(fd, slot, errno);
+            }
+            st->in_len += (size_t)n;
+            // The first bytes of the CONNECT reply tell how much BND.ADDR follows; never read past it
+            if (st->phase == SOCKS5_PHASE_CONNECT_REPLY && st->in_len == st->in_need) {
+                size_t len = socks5_reply_length((const unsigned char *)st->in + st->reply_off, st->in_len - st->reply_off);
+                if (len == 0) {
+                    fprintf(stderr, "TORSOCKS_WRAPPER: Malformed SOCKS reply.\n");
+                    return socks5_async_fail(fd, slot, EPROTO);
+                }
+                st->in_need = st->reply_off + len;
+            }
+        }
+
+        // 4. Method reply accepted: queue the CONNECT request
+        if (st->phase == SOCKS5_PHASE_METHOD_REPLY) {
+            if (memcmp(st->in, socks5_handshake_success, sizeof(socks5_handshake_success)) != 0) {
+                socks5_handshake_failed((ssize_t)st->in_len, st->in_len);
+                return socks5_async_fail(fd, slot, errno);
+            }
+            socks5_trace_mark(&st->trace, SOCKS5_TRACE_GREETING);
+            memcpy(st->out, st->request, st->request_len);
+            st->out_len = st->request_len;
+            st->out_off = 0;
+            st->in_len = 0;
+            st->in_need = SOCKS5_REPLY_MIN;
+            st->phase = SOCKS5_PHASE_CONNECT_REPLY;
+            continue;
+        }
+
+        // 5. Final reply (behind the method reply when pipelined): the application may use the socket now
+        if (st->reply_off) {
+            socks5_trace_mark(&st->trace, SOCKS5_TRACE_GREETING);
+        }
+        socks5_trace_reply(&st->trace, (unsigned char)st->in[st->reply_off + 1]);
+        if (st->reply_off && memcmp(st->in, socks5_handshake_success, st->reply_off) != 0) {
+            socks5_handshake_failed((ssize_t)st->reply_off, st->reply_off);
+            return socks5_async_fail(fd, slot, errno);
+        }
+        if (slot->target) {
+            slot->target->reply = (unsigned char)st->in[st->reply_off + 1];
+        }
+        if (st->in[st->reply_off + 1] != SOCKS_REPLY_SUCCESS) {
+            socks5_reply_failed((unsigned char)st->in[st->reply_off + 1]);
+            socks5_negative_add(st->request, st->request_len, (unsigned char)st->in[st->reply_off + 1]);
+            return socks5_async_fail(fd, slot, errno);
+        }
+        socks5_trace_end(&st->trace, 0, 0);
+        socks5_async_release(slot);
+        socks5_fd_finish(slot, SOCKS5_FD_ESTABLISHED);
+        socks5_async_rearm(fd, slot, slot->app_event.events);
+        return SOCKS5_ASYNC_DONE;
+    }
+}
+
+/**
+ * @brief socks5_async_advance() for callers that do not hold the slot's lock. Lock-free for untracked fds.
+ */
+static int socks5_async_step(int fd, short *need) {
+    struct socks5_fd_slot *slot = socks5_fd_slot(fd, 0);
+    int result;
+
+    if (!slot || !__atomic_load_n(&slot->in_use, __ATOMIC_ACQUIRE)) {
+        return SOCKS5_ASYNC_NONE;
+    }
+    socks5_config_enter();
+    pthread_mutex_lock(&slot->lock);
+    result = socks5_async_advance(fd, need);
+    pthread_mutex_unlock(&slot->lock);
+    socks5_config_leave();
+    return result;
+}
+
+#if TOR_ASYNC_CONNECT
+/**
+ * @brief Starts the proxy connect on a non-blocking socket and returns without waiting for Tor.
+ * @param sockfd The application's socket (O_NONBLOCK).
+ * @param shard The SocksPort shard to go through.
+ * @param stripe The isolation token to authenticate with.
+ * @param request The CONNECT request to send after the greeting.
+ * @param request_len Length of request.
+ * @return -1 with errno EINPROGRESS while the handshake runs, 0 if it already finished.
+ */
+static int socks5_async_connect(int sockfd, int shard, int stripe, const char *request, size_t request_len) {
+    struct socks5_fd_slot *slot = socks5_fd_slot(sockfd, 1);
+    struct socks5_async_state *st;
+    short need = POLLOUT;
+    int result;
+
+    // A second connect() while the handshake runs reports progress like the kernel would
+    pthread_mutex_lock(&slot->lock);
+    result = slot->async ? EALREADY : slot->error;
+    slot->error = 0;
+    pthread_mutex_unlock(&slot->lock);
+    if (result) {
+        errno = result;
+        return -1;
+    }
+
+    st = calloc(1, sizeof(*st));
+    if (!st) {
+        errno = ENOMEM;
+        return -1;
+    }
+    st->fd = sockfd;
+    st->phase = SOCKS5_PHASE_PROXY_CONNECT;
+    st->shard = shard;
+    st->stripe = stripe;
+    memcpy(st->request, request, request_len);
+    st->request_len = request_len;
+    // The record connect() started follows the handshake into poll()/select()/epoll_wait()
+    socks5_trace_handoff(&st->trace, &trace_current, SOCKS5_TRACE_ASYNC);
+#if TOR_PREWARM_POOL
+    if (socks5_pool_take(sockfd, shard, stripe) == 0) {
+        // A pooled connection already did the greeting: start straight at the CONNECT request
+        socks5_trace_flag(&st->trace, SOCKS5_TRACE_POOLED);
+        memcpy(st->out, request, request_len);
+        st->out_len = request_len;
+        st->in_need = SOCKS5_REPLY_MIN;
+        st->phase = SOCKS5_PHASE_CONNECT_REPLY;
+    }
+#endif
+    if (st->phase == SOCKS5_PHASE_PROXY_CONNECT &&
+        socks5_connect_proxy(sockfd, shard) < 0 && errno != EINPROGRESS) {
+        int error = errno;
+        socks5_trace_end(&st->trace, 0, error);
+        if (error != EISCONN && error != EALREADY) {
+            socks5_report_proxy_failure(shard);
+        }
+        free(st);
+        socks5_fd_result(slot, SOCKS5_REPLY_NONE, error);
+        errno = error;
+        return -1;
+    }
+
+    pthread_mutex_lock(&slot->lock);
+    socks5_async_release(slot);
+    slot->error = 0;
+    slot->async = st;
+    __atomic_add_fetch(&async_pending, 1, __ATOMIC_RELEASE);
+
+    // Loopback connects usually complete at once, so the greeting can often go out right away
+    result = socks5_async_advance(sockfd, &need);
+    if (result == SOCKS5_ASYNC_PENDING) {
+        socks5_async_rearm(sockfd, slot, need);
+    } else if (result == SOCKS5_ASYNC_FAILED) {
+        errno = slot->error;
+        slot->error = 0;
+    }
+    pthread_mutex_unlock(&slot->lock);
+
+    if (result == SOCKS5_ASYNC_DONE) {
+        return 0;
+    }
+    if (result == SOCKS5_ASYNC_PENDING) {
+        errno = EINPROGRESS;
+    }
+    return -1;
+}
+#endif
+
+/**
+ * @brief Milliseconds left until deadline, for poll-style timeouts (-1 = infinite).
+ */
+static int socks5_remaining_ms(int timeout, const struct timespec *deadline) {
+    struct timespec now;
+    long ms;
+
+    if (timeout < 0) {
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ms = (deadline->tv_sec - now.tv_sec) * 1000 + (deadline->tv_nsec - now.tv_nsec) / 1000000;
+    return ms > 0 ? (int)ms : 0;
+}
+
+/**
+ * @brief A ppoll()/pselect()/epoll_pwait2() timeout in poll-style milliseconds, rounded up (NULL = -1).
+ */
+static int socks5_timespec_ms(const struct timespec *timeout) {
+    long long ms;
+
+    if (!timeout) {
+        return -1;
+    }
+    ms = (long long)timeout->tv_sec * 1000 + (timeout->tv_nsec + 999999) / 1000000;
+    return ms > INT_MAX ? INT_MAX : (int)ms;
+}
+
+/**
+ * @brief One poll() round of the async loop; with a signal mask it is ppoll(), so the mask applies while waiting.
+ */
+static int socks5_poll_masked(struct pollfd *fds, nfds_t nfds, int timeout, const sigset_t *sigmask) {
+    struct timespec ts;
+
+    if (!sigmask) {
+        return real_poll(fds, nfds, timeout);
+    }
+    ts.tv_sec = timeout / 1000;
+    ts.tv_nsec = (long)(timeout % 1000) * 1000000;
+    return real_ppoll(fds, nfds, timeout < 0 ? NULL : &ts, sigmask);
+}
+
+/**
+ * @brief poll() that hides sockets still negotiating with the proxy from the application.
+ * A non-NULL sigmask is installed for each wait, as ppoll() and pselect() do.
+ */
+static int socks5_async_poll(struct pollfd *fds, nfds_t nfds, int timeout, const sigset_t *sigmask) {
+    short app_events_small[64];
+    signed char state_small[64];
+    short *app_events = app_events_small;
+    signed char *state = state_small;
+    struct timespec deadline;
+    int wait_ms = timeout;
+    int ready;
+    nfds_t i;
+
+    if (nfds > 64) {
+        app_events = malloc(nfds * sizeof(*app_events));
+        state = malloc(nfds * sizeof(*state));
+        if (!app_events || !state) {
+            free(app_events);
+            free(state);
+            return real_poll(fds, nfds, timeout);
+        }
+    }
+    if (timeout > 0) {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += timeout / 1000;
+        deadline.tv_nsec += (long)(timeout % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+    }
+
+    for (;;) {
+        int forced = 0;
+
+        // 1. Step every negotiating socket and wait on what the handshake needs instead
+        for (i = 0; i < nfds; i++) {
+            short need = 0;
+            app_events[i] = fds[i].events;
+            state[i] = (signed char)socks5_async_step(fds[i].fd, &need);
+            if (state[i] == SOCKS5_ASYNC_PENDING) {
+                fds[i].events = need;
+            } else if (state[i] != SOCKS5_ASYNC_NONE) {
+                forced++;
+            }
+        }
+
+        ready = socks5_poll_masked(fds, nfds, forced ? 0 : wait_ms, sigmask);
+
+        // 2. Translate the results back into what the application asked for
+        for (i = 0; i < nfds; i++) {
+            short need = 0;
+            fds[i].events = app_events[i];
+            if (state[i] == SOCKS5_ASYNC_NONE || ready < 0) {
+                continue;
+            }
+            if (state[i] == SOCKS5_ASYNC_PENDING) {
+                state[i] = fds[i].revents ? (signed char)socks5_async_step(fds[i].fd, &need) : SOCKS5_ASYNC_PENDING;
+            }
+            if (state[i] == SOCKS5_ASYNC_DONE) {
+                fds[i].revents = app_events[i] & (POLLOUT | POLLWRNORM);
+            } else if (state[i] == SOCKS5_ASYNC_FAILED) {
+                fds[i].revents = POLLERR | POLLHUP | (app_events[i] & (POLLOUT | POLLWRNORM));
+            } else {
+                fds[i].revents = 0;
+            }
+        }
+        if (ready < 0) {
+            break;
+        }
+
+        ready = 0;
+        for (i = 0; i < nfds; i++) {
+            if (fds[i].revents) {
+                ready++;
+            }
+        }
+        // Only handshake progress happened: keep waiting for the rest of the timeout
+        if (ready > 0 || timeout == 0 || (wait_ms = socks5_remaining_ms(timeout, &deadline)) == 0) {
+            break;
+        }
+    }
+
+    if (app_events != app_events_small) {
+        free(app_events);
+        free(state);
+    }
+    return ready;
+}
+
+#if TOR_OPTIMISTIC_DATA
+// --- Optimistic data: the CONNECT reply is consumed on the application's first read ---
+// Tor accepts stream data right behind the CONNECT request. In this mode a blocking connect() returns as
+// soon as the request is queued: the first send()/write() carries greeting + CONNECT + payload in one
+// segment, and the first recv()/read() consumes the SOCKS replies before handing out application data.
+// sendmsg()/writev()/sendto() send the queued request on its own first, and recvmsg()/readv()/recvfrom()
+// consume the replies like recv(). If the application waits for input first (server-speaks-first
+// protocols), the queued request is flushed as soon as it calls poll()/select()/epoll_wait() or reads.
+// I/O the shim does not see (sendfile(), splice(), io_uring) would bypass the replies: such applications
+// must leave this mode off.
+#define SOCKS5_OPTIMISTIC_COALESCE 16384 // Payload bytes sent together with the queued request
+
+struct socks5_optimistic_state {
+    int fd;
+    char header[SOCKS5_ASYNC_BUF]; // Greeting (unless pooled) + CONNECT request
+    size_t header_len, header_off;
+    size_t request_off;            // Where the CONNECT request starts in header[]
+    char reply[SOCKS5_ASYNC_BUF];  // Method reply (unless pooled) + CONNECT reply
+    size_t reply_len, reply_got;
+    size_t reply_off;              // Where the CONNECT reply starts in reply[]
+    struct socks5_optimistic_state *next; // Unsent list, flushed before the application blocks
+};
+
+static struct socks5_optimistic_state *optimistic_unsent_list = NULL;
+// Guards the unsent list. Taken after a slot's lock, never before it, and held only to link or unlink an entry
+static pthread_mutex_t optimistic_lock = PTHREAD_MUTEX_INITIALIZER;
+static int optimistic_unsent = 0;  // Queued requests not on the wire yet
+static int optimistic_pending = 0; // Replies not consumed yet; I/O calls skip all of this while it is 0
+
+/**
+ * @brief Takes a state off the unsent list once its request is on the wire. Called with the slot's lock held.
+ */
+static void socks5_optimistic_sent(struct socks5_optimistic_state *st) {
+    struct socks5_optimistic_state **link = &optimistic_unsent_list;
+
+    pthread_mutex_lock(&optimistic_lock);
+    while (*link && *link != st) {
+        link = &(*link)->next;
+    }
+    if (*link) {
+        *link = st->next;
+        __atomic_sub_fetch(&optimistic_unsent, 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&optimistic_lock);
+}
+
+/**
+ * @brief Detaches the optimistic state of an fd. Called with the slot's lock held.
+ */
+static struct socks5_optimistic_state *socks5_optimistic_detach(struct socks5_fd_slot *slot) {
+    struct socks5_optimistic_state *st = slot->optimistic;
+
+    if (st) {
+        socks5_optimistic_sent(st);
+        slot->optimistic = NULL;
+        __atomic_sub_fetch(&optimistic_pending, 1, __ATOMIC_RELEASE);
+    }
+    return st;
+}
+
+/**
+ * @brief Queues the greeting and CONNECT request instead of negotiating now.
+ * @param sockfd The socket connected to the SOCKS proxy (blocking).
+ * @param request The CONNECT request.
+ * @param request_len Length of request.
+ * @param greeting The greeting, or NULL on a pooled connection that already sent it.
+ * @param greeting_len Length of greeting.
+ * @return 0 if the request was queued, -1 if the caller has to negotiate synchronously.
+ */
+static int socks5_optimistic_start(int sockfd, const char *request, size_t request_len,
+                                   const char *greeting, size_t greeting_len) {
+    struct socks5_optimistic_state *st;
+    struct socks5_fd_slot *slot;
+
+    slot = socks5_fd_slot(sockfd, 1);
+    if (!slot) {
+        return -1;
+    }
+    st = calloc(1, sizeof(*st));
+    if (!st) {
+        return -1;
+    }
+    st->fd = sockfd;
+    if (greeting) {
+        memcpy(st->header, greeting, greeting_len);
+        st->header_len = greeting_len;
+        st->reply_off = sizeof(socks5_handshake_success);
+    }
+    st->request_off = st->header_len;
+    memcpy(st->header + st->header_len, request, request_len);
+    st->header_len += request_len;
+    st->reply_len = st->reply_off + SOCKS5_REPLY_MIN;
+
+    pthread_mutex_lock(&slot->lock);
+    free(socks5_optimistic_detach(slot));
+    slot->optimistic = st;
+    __atomic_store_n(&slot->in_use, 1, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&optimistic_lock);
+    st->next = optimistic_unsent_list;
+    optimistic_unsent_list = st;
+    pthread_mutex_unlock(&optimistic_lock);
+    __atomic_add_fetch(&optimistic_unsent, 1, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&optimistic_pending, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&slot->lock);
+    return 0;
+}
+
+/**
+ * @brief Puts every queued request on the wire; called before the application blocks in a readiness wait.
+ */
+static void socks5_optimistic_flush_all(void) {
+    for (;;) {
+        struct socks5_optimistic_state *st;
+        struct socks5_fd_slot *slot;
+        int fd;
+
+        // Take the first queued fd, then lock its slot: the list lock is never held around a slot's
+        pthread_mutex_lock(&optimistic_lock);
+        st = optimistic_unsent_list;
+        fd = st ? st->fd : -1;
+        pthread_mutex_unlock(&optimistic_lock);
+        if (!st || !(slot = socks5_fd_slot(fd, 0))) {
+            return;
+        }
+        pthread_mutex_lock(&slot->lock);
+        if (slot->optimistic != st) {
+            // Detached (and off the list) in between; st may be freed already
+            pthread_mutex_unlock(&slot->lock);
+            continue;
+        }
+        while (st->header_off < st->header_len) {
+            ssize_t n = real_send(st->fd, st->header + st->header_off, st->header_len - st->header_off, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                break; // The first read reports the broken connection
+            }
+            st->header_off += (size_t)n;
+        }
+        socks5_optimistic_sent(st);
+        pthread_mutex_unlock(&slot->lock);
+    }
+}
+
+/**
+ * @brief send()/write() on a socket whose CONNECT request is still queued: request and payload go out together.
+ * @param from_write Non-zero when called for write(), which must also work on non-socket fds.
+ * @return Bytes of payload sent, or -1.
+ */
+static ssize_t socks5_optimistic_send(int fd, const void *buf, size_t len, int flags, int from_write) {
+    struct socks5_fd_slot *slot = socks5_fd_slot(fd, 0);
+    struct socks5_optimistic_state *st;
+    struct iovec iov[2];
+    struct msghdr msg;
+    ssize_t n;
+
+    if (!slot || !__atomic_load_n(&slot->in_use, __ATOMIC_ACQUIRE)) {
+        return from_write ? real_write(fd, buf, len) : real_send(fd, buf, len, flags);
+    }
+    pthread_mutex_lock(&slot->lock);
+    st = slot->optimistic;
+    if (!st || st->header_off == st->header_len) {
+        pthread_mutex_unlock(&slot->lock);
+        return from_write ? real_write(fd, buf, len) : real_send(fd, buf, len, flags);
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    iov[1].iov_base = (void *)buf;
+    iov[1].iov_len = len < SOCKS5_OPTIMISTIC_COALESCE ? len : SOCKS5_OPTIMISTIC_COALESCE;
+    for (;;) {
+        size_t rest = st->header_len - st->header_off;
+        iov[0].iov_base = st->header + st->header_off;
+        iov[0].iov_len = rest;
+        n = real_sendmsg(fd, &msg, flags);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if ((size_t)n < rest) {
+            st->header_off += (size_t)n;
+            continue;
+        }
+        st->header_off = st->header_len;
+        socks5_optimistic_sent(st);
+        n -= (ssize_t)rest;
+        break;
+    }
+    pthread_mutex_unlock(&slot->lock);
+    return n;
+}
+
+/**
+ * @brief Puts the queued request on the wire ahead of a write that is not coalesced with it.
+ * @param fd The application's socket.
+ * @param flags Send flags; only MSG_DONTWAIT is honoured while sending the request.
+ * @return 0 when application data may follow, -1 with errno set otherwise.
+ */
+static int socks5_optimistic_push(int fd, int flags) {
+    struct socks5_fd_slot *slot = socks5_fd_slot(fd, 0);
+    struct socks5_optimistic_state *st;
+
+    if (!slot || !__atomic_load_n(&slot->in_use, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+    pthread_mutex_lock(&slot->lock);
+    st = slot->optimistic;
+    while (st && st->header_off < st->header_len) {
+        ssize_t n = real_send(fd, st->header + st->header_off, st->header_len - st->header_off, MSG_NOSIGNAL | (flags & MSG_DONTWAIT));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            pthread_mutex_unlock(&slot->lock);
+            return -1;
+        }
+        st->header_off += (size_t)n;
+        if (st->header_off == st->header_len) {
+            socks5_optimistic_sent(st);
+        }
+    }
+    pthread_mutex_unlock(&slot->lock);
+    return 0;
+}
+
+/**
+ * @brief Consumes the SOCKS replies before the first application read.
+ * @param fd The application's socket.
+ * @param flags recv() flags; only MSG_DONTWAIT is honoured while reading the replies.
+ * @return 0 when application data may be read, -1 with errno set otherwise.
+ */
+static int socks5_optimistic_settle(int fd, int flags) {
+    struct socks5_fd_slot *slot = socks5_fd_slot(fd, 0);
+    struct socks5_optimistic_state *st;
+    int reply, error;
+    ssize_t n;
+
+    if (!slot || !__atomic_load_n(&slot->in_use, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+    pthread_mutex_lock(&slot->lock);
+    st = slot->optimistic;
+    if (!st) {
+        pthread_mutex_unlock(&slot->lock);
+        return 0;
+    }
+    // 1. The application reads before it ever wrote: put the request on the wire first
+    while (st->header_off < st->header_len) {
+        n = real_send(fd, st->header + st->header_off, st->header_len - st->header_off, MSG_NOSIGNAL | (flags & MSG_DONTWAIT));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            pthread_mutex_unlock(&slot->lock);
+            return -1;
+        }
+        st->header_off += (size_t)n;
+    }
+    // Later writes go straight out; only this reader still needs the state
+    socks5_optimistic_detach(slot);
+    pthread_mutex_unlock(&slot->lock);
+
+    // 2. Collect method reply + CONNECT reply
+    while (st->reply_got < st->reply_len) {
+        n = real_recv(fd, st->reply + st->reply_got, st->reply_len - st->reply_got, flags & MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            // Non-blocking read before the reply arrived: keep the state for the next one
+            pthread_mutex_lock(&slot->lock);
+            if (!slot->optimistic) {
+                slot->optimistic = st;
+                __atomic_add_fetch(&optimistic_pending, 1, __ATOMIC_RELEASE);
+                st = NULL;
+            }
+            pthread_mutex_unlock(&slot->lock);
+            free(st);
+            errno = EAGAIN;
+            return -1;
+        }
+        if (n <= 0) {
+            free(st);
+            errno = n == 0 ? ECONNRESET : errno;
+            return -1;
+        }
+        st->reply_got += (size_t)n;
+        if (st->reply_got == st->reply_len) {
+            size_t len = socks5_reply_length((const unsigned char *)st->reply + st->reply_off, st->reply_got - st->reply_off);
+            if (len == 0) {
+                fprintf(stderr, "TORSOCKS_WRAPPER: Malformed SOCKS reply.\n");
+                free(st);
+                socks5_fd_result(slot, SOCKS5_REPLY_NONE, EPROTO);
+                shutdown(fd, SHUT_RDWR);
+                errno = EPROTO;
+                return -1;
+            }
+            st->reply_len = st->reply_off + len;
+        }
+    }
+
+    // 3. Check both replies; on failure the stream is unusable
+    reply = (unsigned char)st->reply[st->reply_off + 1];
+    if (st->reply_off && memcmp(st->reply, socks5_handshake_success, st->reply_off) != 0) {
+        socks5_handshake_failed((ssize_t)st->reply_off, st->reply_off);
+        reply = SOCKS5_REPLY_NONE;
+    } else if (reply != SOCKS_REPLY_SUCCESS) {
+        socks5_reply_failed(reply);
+        socks5_negative_add(st->header + st->request_off, st->header_len - st->request_off, reply);
+    } else {
+        free(st);
+        socks5_fd_result(slot, reply, 0);
+        return 0;
+    }
+    error = errno;
+    free(st);
+    socks5_fd_result(slot, reply, error);
+    shutdown(fd, SHUT_RDWR);
+    errno = error;
+    return -1;
+}
+#endif
+
+#if TOR_HEDGE_CONNECT
+// --- Hedged connects: race a second CONNECT on another circuit ---
+// Circuit setup dominates the tail latency of a blocking connect(). When the first CONNECT has no reply
+// after HedgeDelayMs (at once for destinations in TOR_HEDGE_IMMEDIATE), a second one for the same
+// target goes out through the next SocksPort shard with the same isolation token. With one shard it goes
+// out with the next isolation token, only if TOR_HEDGE_ACROSS_STRIPES allows it. The first successful
+// reply wins and is dup3()'d onto the application's fd; closing the other leg makes Tor drop its stream.
+// Both legs are new sockets: the options socks5_hedge_inherit() copies survive the swap, others the
+// application set before connect() do not, and neither do epoll registrations of the old socket.
+struct socks5_hedge_leg {
+    int fd;                                     // -1 when not started or failed
+    int shard;
+    char out[SOCKS5_GREETING_MAX + SOCKS5_REPLY_MAX]; // Greeting + CONNECT request
+    size_t out_len, out_off;
+    char in[sizeof(socks5_handshake_success) + SOCKS5_REPLY_MAX]; // Method reply + CONNECT reply
+    size_t in_len, in_need;
+    int reply;                                  // CONNECT reply code, SOCKS5_REPLY_NONE until it arrives
+};
+
+/**
+ * @brief Tells whether host is listed in TOR_HEDGE_IMMEDIATE.
+ */
+static int socks5_hedge_immediate(const char *host) {
+    const char *p = TOR_HEDGE_IMMEDIATE;
+    size_t host_len = strlen(host);
+
+    p += strspn(p, ", ");
+    while (*p) {
+        size_t len = strcspn(p, ", ");
+        if (len == host_len && memcmp(p, host, len) == 0) {
+            return 1;
+        }
+        p += len;
+        p += strspn(p, ", ");
+    }
+    return 0;
+}
+
+/**
+ * @brief Copies the socket options applications commonly set before connect() onto a leg. Options the
+ * leg cannot take (TCP ones on an AF_UNIX leg, SO_MARK without CAP_NET_ADMIN) are skipped.
+ */
+static void socks5_hedge_inherit(int sockfd, int fd) {
+    static const int options[][2] = {
+        {SOL_SOCKET, SO_KEEPALIVE}, {SOL_SOCKET, SO_PRIORITY}, {SOL_SOCKET, SO_MARK}, {IPPROTO_TCP, TCP_NODELAY},
+    };
+    size_t i;
+
+    for (i = 0; i < sizeof(options) / sizeof(options[0]); i++) {
+        int value = 0;
+        socklen_t len = sizeof(value);
+        if (real_getsockopt(sockfd, options[i][0], options[i][1], &value, &len) == 0 && value != 0) {
+            setsockopt(fd, options[i][0], options[i][1], &value, sizeof(value));
+        }
+    }
+}
+
+/**
+ * @brief Opens a leg: a non-blocking proxy connection with greeting and CONNECT request queued.
+ * @param sockfd The application's socket, whose options the leg takes over.
+ * @return 0, or -1 if the SocksPort is unreachable.
+ */
+static int socks5_hedge_start(struct socks5_hedge_leg *leg, int sockfd, int shard, int stripe, const char *request,
+                              size_t request_len) {
+    int flags;
+
+    memset(leg, 0, sizeof(*leg));
+    leg->shard = shard;
+    leg->reply = SOCKS5_REPLY_NONE;
+    leg->fd = socks5_open_proxy_socket(shard, 0, NULL);
+    if (leg->fd < 0) {
+        socks5_report_proxy_failure(shard);
+        return -1;
+    }
+    socks5_report_proxy_success(shard);
+    socks5_hedge_inherit(sockfd, leg->fd);
+    flags = fcntl(leg->fd, F_GETFL);
+    if (flags < 0 || fcntl(leg->fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        real_close(leg->fd);
+        leg->fd = -1;
+        return -1;
+    }
+    leg->out_len = socks5_build_greeting(leg->out, stripe);
+    memcpy(leg->out + leg->out_len, request, request_len);
+    leg->out_len += request_len;
+    leg->in_need = sizeof(socks5_handshake_success) + SOCKS5_REPLY_MIN;
+    return 0;
+}
+
+/**
+ * @brief Closes a leg that lost or failed.
+ * @return -1, for socks5_hedge_advance().
+ */
+static int socks5_hedge_drop(struct socks5_hedge_leg *leg) {
+    if (leg->fd >= 0) {
+        real_close(leg->fd);
+        leg->fd = -1;
+    }
+    return -1;
+}
+
+/**
+ * @brief Moves a leg forward without blocking.
+ * @return 1 once its CONNECT succeeded, 0 while it waits for the proxy, -1 if it failed (and was closed).
+ */
+static int socks5_hedge_advance(struct socks5_hedge_leg *leg) {
+    const size_t reply_off = sizeof(socks5_handshake_success);
+    ssize_t n;
+
+    // 1. Greeting and CONNECT request
+    while (leg->out_off < leg->out_len) {
+        n = real_send(leg->fd, leg->out + leg->out_off, leg->out_len - leg->out_off, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // EINPROGRESS: Fast Open had no cookie and sent a bare SYN, retry once connected
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINPROGRESS) {
+                return 0;
+            }
+            return socks5_hedge_drop(leg);
+        }
+        leg->out_off += (size_t)n;
+    }
+
+    // 2. Method reply and CONNECT reply, sized by its ATYP once the first bytes are in
+    while (leg->in_len < leg->in_need) {
+        n = real_recv(leg->fd, leg->in + leg->in_len, leg->in_need - leg->in_len, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        }
+        if (n <= 0) {
+            return socks5_hedge_drop(leg);
+        }
+        leg->in_len += (size_t)n;
+        if (leg->in_len == leg->in_need) {
+            size_t len = socks5_reply_length((const unsigned char *)leg->in + reply_off, leg->in_len - reply_off);
+            if (len == 0) {
+                return socks5_hedge_drop(leg);
+            }
+            leg->in_need = reply_off + len;
+        }
+    }
+
+    // 3. Only a successful reply wins; a refused leg leaves the race to the other one
+    if (memcmp(leg->in, socks5_handshake_success, reply_off) != 0) {
+        return socks5_hedge_drop(leg);
+    }
+    leg->reply = (unsigned char)leg->in[reply_off + 1];
+    if (leg->reply != SOCKS_REPLY_SUCCESS) {
+        return socks5_hedge_drop(leg);
+    }
+    return 1;
+}
+
+/**
+ * @brief Blocking proxied connect that races a second CONNECT when the first one is slow.
+ * @param sockfd The application's socket (blocking).
+ * @param shard The SocksPort shard of the first CONNECT.
+ * @param stripe The isolation token of the first CONNECT.
+ * @param request The CONNECT request.
+ * @param request_len Length of request.
+ * @param host The destination as text, looked up in TOR_HEDGE_IMMEDIATE.
+ * @param reply Receives the CONNECT reply code of a failed leg (the hedge's if both got one).
+ * @return The shard of the winning leg, which now sits on sockfd; -1 with errno set if both legs failed.
+ */
+static int socks5_hedged_connect(int sockfd, int shard, int stripe, const char *request, size_t request_len,
+                                 const char *host, int *reply) {
+    const struct socks5_config *cfg = socks5_config();
+    struct socks5_hedge_leg legs[2];
+    int shard_count = cfg->shards->count;
+    int hedge_shard = shard_count > 1 ? (shard + 1) % shard_count : shard;
+    int hedge_stripe = shard_count > 1 ? stripe : (stripe + 1) % SOCKS5_STRIPE_COUNT;
+    int delay_ms = socks5_hedge_immediate(host) ? 0 : cfg->hedge_delay_ms;
+    struct timespec hedge_at;
+    int hedged = 0;
+    int timed_out = 0;
+    int winner = -1;
+    int fd_flags, fl_flags;
+    int i;
+
+    // 1. First leg right away
+    socks5_hedge_start(&legs[0], sockfd, shard, stripe, request, request_len);
+    legs[1].fd = -1;
+    legs[1].reply = SOCKS5_REPLY_NONE;
+    clock_gettime(CLOCK_MONOTONIC, &hedge_at);
+    hedge_at.tv_sec += delay_ms / 1000;
+    hedge_at.tv_nsec += (long)(delay_ms % 1000) * 1000000;
+    if (hedge_at.tv_nsec >= 1000000000) {
+        hedge_at.tv_sec++;
+        hedge_at.tv_nsec -= 1000000000;
+    }
+
+    // 2. Multiplex the legs until one has a successful reply or all of them failed
+    while (winner < 0) {
+        struct pollfd pfds[2];
+        nfds_t count = 0;
+        int wait_ms = -1;
+        int left_ms;
+
+        // The hedge goes out when the delay ran out, or at once if the first leg already failed
+        if (!hedged && (legs[0].fd < 0 || socks5_remaining_ms(delay_ms, &hedge_at) == 0)) {
+            socks5_hedge_start(&legs[1], sockfd, hedge_shard, hedge_stripe, request, request_len);
+            hedged = 1;
+        }
+        if (!hedged) {
+            wait_ms = socks5_remaining_ms(delay_ms, &hedge_at);
+        }
+        for (i = 0; i < 2; i++) {
+            if (legs[i].fd >= 0) {
+                pfds[count].fd = legs[i].fd;
+                pfds[count].events = legs[i].out_off < legs[i].out_len ? POLLOUT : POLLIN;
+                pfds[count].revents = 0;
+                count++;
+            }
+        }
+        if (count == 0) {
+            break;
+        }
+        // The handshake deadline bounds the race as a whole
+        left_ms = socks5_deadline_wait_ms(NULL, 0);
+        if (left_ms == 0) {
+            timed_out = 1;
+            break;
+        }
+        if (left_ms > 0 && (wait_ms < 0 || left_ms < wait_ms)) {
+            wait_ms = left_ms;
+        }
+        if (real_poll(pfds, count, wait_ms) < 0 && errno != EINTR) {
+            break;
+        }
+        for (i = 0; i < 2 && winner < 0; i++) {
+            if (legs[i].fd >= 0 && socks5_hedge_advance(&legs[i]) == 1) {
+                winner = i;
+            }
+        }
+    }
+
+    // 3. Close the loser and move the winner onto the application's fd, blocking again
+    for (i = 0; i < 2; i++) {
+        if (i != winner) {
+            socks5_hedge_drop(&legs[i]);
+        }
+    }
+    if (winner < 0) {
+        *reply = legs[1].reply != SOCKS5_REPLY_NONE ? legs[1].reply : legs[0].reply;
+        if (*reply != SOCKS5_REPLY_NONE) {
+            socks5_reply_failed(*reply);
+            socks5_negative_add(request, request_len, *reply);
+        } else if (timed_out) {
+            fprintf(stderr, "TORSOCKS_WRAPPER: SOCKS handshake timed out.\n");
+            errno = ETIMEDOUT;
+        } else {
+            errno = EHOSTUNREACH; // Neither leg got as far as a reply
+        }
+        return -1;
+    }
+    fd_flags = fcntl(sockfd, F_GETFD);
+    fl_flags = fcntl(legs[winner].fd, F_GETFL);
+    if (fd_flags < 0 || fl_flags < 0 || fcntl(legs[winner].fd, F_SETFL, fl_flags & ~O_NONBLOCK) < 0 ||
+        real_dup3(legs[winner].fd, sockfd, (fd_flags & FD_CLOEXEC) ? O_CLOEXEC : 0) < 0) {
+        socks5_hedge_drop(&legs[winner]);
+        errno = EHOSTUNREACH;
+        return -1;
+    }
+    socks5_hedge_drop(&legs[winner]);
+    return legs[winner].shard;
+}
+
+/**
+ * @brief Moves the stream's shard accounting, e.g. to the SocksPort whose hedged CONNECT won.
+ */
+static void socks5_fd_reshard(struct socks5_fd_slot *slot, int shard) {
+    if (!slot) {
+        return;
+    }
+    pthread_mutex_lock(&slot->lock);
+    if (slot->shard != shard + 1) {
+        __atomic_add_fetch(&shard_outstanding[shard], 1, __ATOMIC_RELAXED);
+        if (slot->shard) {
+            __atomic_sub_fetch(&shard_outstanding[slot->shard - 1], 1, __ATOMIC_RELAXED);
+        }
+        slot->shard = shard + 1;
+    }
+    pthread_mutex_unlock(&slot->lock);
+}
+#endif
+
+/**
+ * @brief Forgets everything about an fd that is being closed or replaced. Lock-free for untracked fds.
+ */
+static void socks5_fd_clear(int fd) {
+    struct socks5_fd_slot *slot = socks5_fd_slot(fd, 0);
+    struct socks5_fd_target *target;
+
+    if (!slot || !__atomic_load_n(&slot->in_use, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    pthread_mutex_lock(&slot->lock);
+    socks5_async_release(slot);
+#if TOR_OPTIMISTIC_DATA
+    free(socks5_optimistic_detach(slot));
+#endif
+    target = slot->target;
+    slot->target = NULL;
+    if (slot->shard) {
+        __atomic_sub_fetch(&shard_outstanding[slot->shard - 1], 1, __ATOMIC_RELAXED);
+        slot->shard = 0;
+    }
+    slot->error = 0;
+    slot->epoll_registered = 0;
+#if TOR_ADMISSION
+    socks5_admission_leave(&slot->admission);
+#endif
+    __atomic_store_n(&slot->phase, SOCKS5_FD_UNUSED, __ATOMIC_RELEASE);
+    __atomic_store_n(&slot->in_use, 0, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&slot->lock);
+    free(target);
+}
+
+/**
+ * @brief connect() to an IP destination: bypassed, or proxied through Tor. Runs as a configuration reader.
+ */
+static int socks5_ip_connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
+    // 1. The intended target address (AF_INET or AF_INET6) is kept as passed in; destinations on the
+    // bypass list (loopback sidecars, local services) keep a direct connection
+    if (addr->sa_family == AF_INET6 && addrlen < sizeof(struct sockaddr_in6)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (socks5_bypass(addr)) {
+        socks5_metrics_count(SOCKS5_METRICS_BYPASSED);
+        return real_connect(sockfd, addr, addrlen);
+    }
+    // The SOCKS exchange needs the whole table; a single load unless TOR_LAZY_STARTUP left it unresolved
+    socks5_resolve_symbols();
+#if TOR_CONFIG_RELOAD
+    // From here on the process proxies: follow the configuration file for changes
+    socks5_config_watch_start();
+#endif
+
+    // A socket the shim already connected keeps its stream: tracking it again would reset its state, and
+    // a new proxy leg would be dup3()'d over it or fail with EISCONN
+    int repeat = socks5_fd_repeat(sockfd);
+    if (repeat) {
+        errno = repeat;
+        return -1;
+    }
+
+    // 2. Build the CONNECT request once; every path below sends the same bytes
+    struct socks5_request request;
+    if (socks5_request_build(addr, &request) < 0) {
+        return -1;
+    }
+
+    // 3. Pick the Tor SOCKS proxy address (127.0.0.1:9050 unless several SocksPorts are configured)
+    int shard = socks5_shard_pick(&request);
+#if TOR_PROXY_BREAKER
+    // Steer clear of SocksPorts whose breaker is open; if none is up, connect() fails below at once
+    int shard_down = socks5_breaker_route(&shard) < 0;
+#endif
+    int stripe = socks5_stripe_pick(&request);
+
+    // Time each phase of the proxied connect; the record is committed wherever connect() returns
+    socks5_trace_begin(&trace_current, addr, shard);
+    socks5_metrics_count(SOCKS5_METRICS_PROXIED);
+    // 3a. Remember where the socket was meant to go; getpeername() answers from this record
+    struct socks5_fd_slot *slot = socks5_fd_track(sockfd, addr, addrlen, request.host, shard);
+#if TOR_NEGATIVE_CACHE
+    // A destination Tor failed to reach a moment ago fails again right away, without touching the proxy
+    if (__atomic_load_n(&negative_entries, __ATOMIC_RELAXED)) {
+        int cached = socks5_negative_check(request.data, request.len);
+        if (cached != SOCKS5_REPLY_NONE) {
+            int error = socks5_reply_lookup(cached)->error;
+            socks5_trace_reply(&trace_current, cached);
+            socks5_trace_end(&trace_current, SOCKS5_TRACE_NEGATIVE, error);
+            socks5_fd_result(slot, cached, error);
+            errno = error;
+            return -1;
+        }
+    }
+#endif
+#if TOR_PROXY_BREAKER
+    // Every SocksPort is down (Tor restarting): fail as the proxy connect would, without trying it
+    if (shard_down) {
+        socks5_trace_end(&trace_current, SOCKS5_TRACE_BREAKER, ECONNREFUSED);
+        socks5_fd_result(slot, SOCKS5_REPLY_NONE, ECONNREFUSED);
+        errno = ECONNREFUSED;
+        return -1;
+    }
+#endif
+#if TOR_ADMISSION
+    // Host-wide cap on handshakes in flight to this SocksPort (AdmissionLimit): wait for a turn in ticket
+    // order, or fail fast; the ticket is handed back when the handshake ends
+    if (slot && socks5_admission_enter(sockfd, shard, &slot->admission) < 0) {
+        int error = errno;
+        socks5_trace_end(&trace_current, 0, error);
+        socks5_fd_result(slot, SOCKS5_REPLY_NONE, error);
+        errno = error;
+        return -1;
+    }
+#endif
+
+#if TOR_ASYNC_CONNECT
+    // 3b. Non-blocking socket: start the proxy connect and let poll()/epoll_wait() drive the handshake
+    int fd_flags = slot ? fcntl(sockfd, F_GETFL) : -1;
+    if (fd_flags >= 0 && (fd_flags & O_NONBLOCK)) {
+        return socks5_async_connect(sockfd, shard, stripe, request.data, request.len);
+    }
+#endif
+
+    // Blocking handshake from here on: bound it by HandshakeTimeoutMs and GreetingTimeoutMs, or by the
+    // socket's own SO_SNDTIMEO / SO_RCVTIMEO where the application set shorter ones
+    socks5_deadline_begin(sockfd, socks5_config()->handshake_timeout_ms, socks5_config()->greeting_timeout_ms);
+#if TOR_HEDGE_CONNECT
+    // 3c. Blocking socket: race a second CONNECT on another SocksPort (or isolation token, if allowed) if
+    // Tor is slow. A bound socket keeps its own connection: the swap to the winning leg would unbind it.
+    if ((socks5_config()->shards->count > 1 || (TOR_HEDGE_ACROSS_STRIPES && SOCKS5_STRIPE_COUNT > 1)) &&
+        !socks5_socket_bound(sockfd)) {
+        int reply = SOCKS5_REPLY_NONE;
+        int winner = socks5_hedged_connect(sockfd, shard, stripe, request.data, request.len, request.host, &reply);
+        if (winner < 0) {
+            int error = errno;
+            socks5_trace_end(&trace_current, SOCKS5_TRACE_HEDGED, error);
+            socks5_fd_result(slot, reply, error);
+            shutdown(sockfd, SHUT_RDWR);
+            errno = error;
+            return -1;
+        }
+        socks5_trace_reply(&trace_current, SOCKS_REPLY_SUCCESS);
+        socks5_trace_end(&trace_current, SOCKS5_TRACE_HEDGED, 0);
+        socks5_fd_reshard(slot, winner);
+        socks5_fd_result(slot, SOCKS_REPLY_SUCCESS, 0);
+        return 0;
+    }
+#endif
+#if TOR_PREWARM_POOL
+    // 3d. A pre-warmed proxy connection already finished the greeting: only CONNECT/reply is left
+    if (socks5_pool_take(sockfd, shard, stripe) == 0) {
+        int reply = SOCKS5_REPLY_NONE;
+        if (socks5_pooled_exchange(sockfd, request.data, request.len, &reply) < 0) {
+            int error = errno;
+            socks5_trace_end(&trace_current, SOCKS5_TRACE_POOLED, error);
+            socks5_fd_result(slot, reply, error);
+            shutdown(sockfd, SHUT_RDWR);
+            errno = error;
+            return -1;
+        }
+        socks5_trace_end(&trace_current, SOCKS5_TRACE_POOLED, 0);
+        socks5_fd_result(slot, reply, 0);
+        return 0;
+    }
+#endif
+
+    // 4. Use the REAL connect() to connect the socket to the LOCAL TOR PROXY
+    int connect_result = socks5_connect_proxy(sockfd, shard);
+
+    if (connect_result < 0) {
+        int error = errno;
+        socks5_trace_end(&trace_current, 0, error);
+        // EISCONN and EALREADY are about the application's socket, not the SocksPort: keep them off the breaker
+        if (error != EISCONN && error != EALREADY) {
+            socks5_report_proxy_failure(shard);
+        }
+        socks5_fd_result(slot, SOCKS5_REPLY_NONE, error);
+        errno = error;
+        return -1;
+    }
+    socks5_report_proxy_success(shard);
+    socks5_trace_mark(&trace_current, SOCKS5_TRACE_PROXY);
+
+    // 5. Perform the SOCKS5 handshake and connection request
+    int reply = SOCKS5_REPLY_NONE;
+    if (perform_socks5_negotiation(sockfd, request.data, request.len, stripe, &reply) < 0) {
+        int error = errno;
+        socks5_trace_end(&trace_current, 0, error);
+        // The application owns the fd: leave it open, with the proxy stream shut down
+        socks5_fd_result(slot, reply, error);
+        shutdown(sockfd, SHUT_RDWR);
+        errno = error;
+        return -1;
+    }
+
+    socks5_trace_end(&trace_current, 0, 0);
+    socks5_fd_result(slot, reply, 0);
+    return 0; 
+}
+
+/**
+ * @brief Torsocks' intercepted version of the connect() function.
+ */
+int connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
+    int result;
+
+    socks5_resolve_symbol((void **)&real_connect);
+    if (!real_connect) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    // --- Passthrough for non-IP addresses (e.g., AF_UNIX) ---
+    // IPv6 targets go through Tor as well (ATYP 0x04), so dual-stack apps never try a doomed direct v6 connect
+    if (addr->sa_family != AF_INET && addr->sa_family != AF_INET6) {
+        return real_connect(sockfd, addr, addrlen);
+    }
+
+    // A reload must not free the snapshot this connect() reads, however long Tor takes to answer
+    socks5_config_enter();
+    result = socks5_ip_connect(sockfd, addr, addrlen);
+    socks5_config_leave();
+    return result;
+}
+
+/**
+ * @brief Torsocks' intercepted version of poll().
+ */
+int poll(struct pollfd *fds, nfds_t nfds, int timeout) {
+    socks5_resolve_symbol((void **)&real_poll);
+    if (!real_poll) {
+        errno = EFAULT;
+        return -1;
+    }
+#if TOR_OPTIMISTIC_DATA
+    // The application is about to wait for input: queued CONNECT requests must be on the wire first
+    if (__atomic_load_n(&optimistic_unsent, __ATOMIC_ACQUIRE) != 0) {
+        socks5_optimistic_flush_all();
+    }
+#endif
+    if (__atomic_load_n(&async_pending, __ATOMIC_ACQUIRE) == 0) {
+        return real_poll(fds, nfds, timeout);
+    }
+    return socks5_async_poll(fds, nfds, timeout, NULL);
+}
+
+/**
+ * @brief Torsocks' intercepted version of ppoll(): poll() with a signal mask, so libraries that wait
+ * through ppoll() still drive and hide pending handshakes.
+ */
+int ppoll(struct pollfd *fds, nfds_t nfds, const struct timespec *timeout, const sigset_t *sigmask) {
+    socks5_resolve_symbol((void **)&real_ppoll);
+    if (!real_ppoll) {
+        errno = EFAULT;
+        return -1;
+    }
+#if TOR_OPTIMISTIC_DATA
+    // The application is about to wait for input: queued CONNECT requests must be on the wire first
+    if (__atomic_load_n(&optimistic_unsent, __ATOMIC_ACQUIRE) != 0) {
+        socks5_optimistic_flush_all();
+    }
+#endif
+    if (__atomic_load_n(&async_pending, __ATOMIC_ACQUIRE) == 0) {
+        return real_ppoll(fds, nfds, timeout, sigmask);
+    }
+    return socks5_async_poll(fds, nfds, socks5_timespec_ms(timeout), sigmask);
+}
+
+/**
+ * @brief select()/pselect() mapped onto poll() while handshakes are pending; -2 asks the caller to pass through.
+ */
+static int socks5_async_select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds, int timeout,
+                               const sigset_t *sigmask) {
+    struct pollfd *pfds;
+    int count = 0;
+    int ready;
+    int fd;
+
+    if (__atomic_load_n(&async_pending, __ATOMIC_ACQUIRE) == 0 || nfds <= 0 || nfds > FD_SETSIZE ||
+        !(pfds = malloc((size_t)nfds * sizeof(*pfds)))) {
+        return -2;
+    }
+    for (fd = 0; fd < nfds; fd++) {
+        short events = 0;
+        if (readfds && FD_ISSET(fd, readfds)) events |= POLLIN;
+        if (writefds && FD_ISSET(fd, writefds)) events |= POLLOUT;
+        if (exceptfds && FD_ISSET(fd, exceptfds)) events |= POLLPRI;
+        if (events) {
+            pfds[count].fd = fd;
+            pfds[count].events = events;
+            pfds[count].revents = 0;
+            count++;
+        }
+    }
+
+    ready = socks5_async_poll(pfds, (nfds_t)count, timeout, sigmask);
+    if (ready >= 0) {
+        int i;
+        if (readfds) FD_ZERO(readfds);
+        if (writefds) FD_ZERO(writefds);
+        if (exceptfds) FD_ZERO(exceptfds);
+        ready = 0;
+        for (i = 0; i < count; i++) {
+            if (pfds[i].revents & POLLNVAL) {
+                errno = EBADF;
+                ready = -1;
+                break;
+            }
+            if ((pfds[i].events & POLLIN) && (pfds[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+                FD_SET(pfds[i].fd, readfds);
+                ready++;
+            }
+            if ((pfds[i].events & POLLOUT) && (pfds[i].revents & (POLLOUT | POLLERR))) {
+                FD_SET(pfds[i].fd, writefds);
+                ready++;
+            }
+            if ((pfds[i].events & POLLPRI) && (pfds[i].revents & POLLPRI)) {
+                FD_SET(pfds[i].fd, exceptfds);
+                ready++;
+            }
+        }
+    }
+    free(pfds);
+    return ready;
+}
+
+/**
+ * @brief Torsocks' intercepted version of select(), mapped onto poll() while handshakes are pending.
+ */
+int select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds, struct timeval *timeout) {
+    int ready;
+
+    socks5_resolve_symbol((void **)&real_select);
+    if (!real_select) {
+        errno = EFAULT;
+        return -1;
+    }
+#if TOR_OPTIMISTIC_DATA
+    // The application is about to wait for input: queued CONNECT requests must be on the wire first
+    if (__atomic_load_n(&optimistic_unsent, __ATOMIC_ACQUIRE) != 0) {
+        socks5_optimistic_flush_all();
+    }
+#endif
+    ready = socks5_async_select(nfds, readfds, writefds, exceptfds,
+                                timeout ? (int)(timeout->tv_sec * 1000 + (timeout->tv_usec + 999) / 1000) : -1, NULL);
+    return ready == -2 ? real_select(nfds, readfds, writefds, exceptfds, timeout) : ready;
+}
+
+/**
+ * @brief Torsocks' intercepted version of pselect(): select() with a signal mask and a timespec timeout.
+ */
+int pselect(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds, const struct timespec *timeout,
+            const sigset_t *sigmask) {
+    int ready;
+
+    socks5_resolve_symbol((void **)&real_pselect);
+    if (!real_pselect) {
+        errno = EFAULT;
+        return -1;
+    }
+#if TOR_OPTIMISTIC_DATA
+    // The application is about to wait for input: queued CONNECT requests must be on the wire first
+    if (__atomic_load_n(&optimistic_unsent, __ATOMIC_ACQUIRE) != 0) {
+        socks5_optimistic_flush_all();
+    }
+#endif
+    ready = socks5_async_select(nfds, readfds, writefds, exceptfds, socks5_timespec_ms(timeout), sigmask);
+    return ready == -2 ? real_pselect(nfds, readfds, writefds, exceptfds, timeout, sigmask) : ready;
+}
+
+/**
+ * @brief Torsocks' intercepted version of epoll_ctl().
+ * Records the application's registration and keeps a negotiating socket registered for what the
+ * handshake needs until the SOCKS reply has been accepted.
+ */
+int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event) {
+    struct socks5_fd_slot *slot;
+    int result;
+
+    socks5_resolve_symbol((void **)&real_epoll_ctl);
+    if (!real_epoll_ctl) {
+        errno = EFAULT;
+        return -1;
+    }
+    slot = socks5_fd_slot(fd, op != EPOLL_CTL_DEL);
+    if (!slot) {
+        return real_epoll_ctl(epfd, op, fd, event);
+    }
+
+    pthread_mutex_lock(&slot->lock);
+    if ((op == EPOLL_CTL_ADD || op == EPOLL_CTL_MOD) && event) {
+        __atomic_store_n(&slot->in_use, 1, __ATOMIC_RELEASE);
+        slot->epoll_registered = 1;
+        slot->epfd = epfd;
+        slot->app_event = *event;
+        if (slot->async) {
+            struct epoll_event ev = *event;
+            short need = POLLOUT;
+            int pending;
+            socks5_config_enter();
+            pending = socks5_async_advance(fd, &need) == SOCKS5_ASYNC_PENDING;
+            socks5_config_leave();
+            if (pending) {
+                ev.events = need;
+                ev.data.u64 = SOCKS5_EPOLL_TAG | (uint32_t)fd;
+            }
+            result = real_epoll_ctl(epfd, op, fd, &ev);
+            pthread_mutex_unlock(&slot->lock);
+            return result;
+        }
+    } else if (op == EPOLL_CTL_DEL && slot->epfd == epfd) {
+        slot->epoll_registered = 0;
+    }
+    pthread_mutex_unlock(&slot->lock);
+    return real_epoll_ctl(epfd, op, fd, event);
+}
+
+/**
+ * @brief epoll_wait() while handshakes are pending: events of negotiating sockets drive the handshake and
+ * are only passed on once it finished. A non-NULL sigmask is installed for each wait, as epoll_pwait() does.
+ */
+static int socks5_async_epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout,
+                                   const sigset_t *sigmask) {
+    struct timespec deadline;
+    int wait_ms = timeout;
+
+    if (timeout > 0) {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += timeout / 1000;
+        deadline.tv_nsec += (long)(timeout % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+    }
+
+    for (;;) {
+        // With a NULL mask epoll_pwait() is epoll_wait(); the whole table is resolved once a handshake is pending
+        int ready = real_epoll_pwait(epfd, events, maxevents, wait_ms, sigmask);
+        int kept = 0;
+        int i;
+
+        if (ready <= 0) {
+            return ready;
+        }
+        for (i = 0; i < ready; i++) {
+            struct socks5_fd_slot *slot;
+            struct epoll_event app_event;
+            short need = 0;
+            int result;
+            int fd;
+
+            // Only the shim's own registrations carry the tag; everything else is the application's
+            if ((events[i].data.u64 & ~(uint64_t)UINT32_MAX) != SOCKS5_EPOLL_TAG) {
+                events[kept++] = events[i];
+                continue;
+            }
+            fd = (int)(uint32_t)events[i].data.u64;
+            if (!(slot = socks5_fd_slot(fd, 0))) {
+                continue;
+            }
+            socks5_config_enter();
+            pthread_mutex_lock(&slot->lock);
+            app_event = slot->app_event;
+            result = socks5_async_advance(fd, &need);
+            if (result == SOCKS5_ASYNC_NONE && __atomic_load_n(&slot->phase, __ATOMIC_ACQUIRE) == SOCKS5_FD_ESTABLISHED) {
+                // Another thread finished the handshake after the kernel queued this event
+                result = SOCKS5_ASYNC_DONE;
+            }
+            switch (result) {
+            case SOCKS5_ASYNC_PENDING:
+                socks5_async_rearm(fd, slot, need);
+                break;
+            case SOCKS5_ASYNC_DONE:
+                if (app_event.events & EPOLLOUT) {
+                    events[kept].events = EPOLLOUT;
+                    events[kept++].data = app_event.data;
+                }
+                break;
+            case SOCKS5_ASYNC_FAILED:
+                events[kept].events = EPOLLERR | EPOLLHUP | (app_event.events & EPOLLOUT);
+                events[kept++].data = app_event.data;
+                break;
+            }
+            pthread_mutex_unlock(&slot->lock);
+            socks5_config_leave();
+        }
+
+        if (kept > 0 || timeout == 0 || (wait_ms = socks5_remaining_ms(timeout, &deadline)) == 0) {
+            return kept;
+        }
+    }
+}
+
+/**
+ * @brief Torsocks' intercepted version of epoll_wait().
+ */
+int epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout) {
+    socks5_resolve_symbol((void **)&real_epoll_wait);
+    if (!real_epoll_wait) {
+        errno = EFAULT;
+        return -1;
+    }
+#if TOR_OPTIMISTIC_DATA
+    // The application is about to wait for input: queued CONNECT requests must be on the wire first
+    if (__atomic_load_n(&optimistic_unsent, __ATOMIC_ACQUIRE) != 0) {
+        socks5_optimistic_flush_all();
+    }
+#endif
+    if (__atomic_load_n(&async_pending, __ATOMIC_ACQUIRE) == 0) {
+        return real_epoll_wait(epfd, events, maxevents, timeout);
+    }
+    return socks5_async_epoll_wait(epfd, events, maxevents, timeout, NULL);
+}
+
+/**
+ * @brief Torsocks' intercepted version of epoll_pwait(), the wait libuv and other event loops use.
+ */
+int epoll_pwait(int epfd, struct epoll_event *events, int maxevents, int timeout, const sigset_t *sigmask) {
+    socks5_resolve_symbol((void **)&real_epoll_pwait);
+    if (!real_epoll_pwait) {
+        errno = EFAULT;
+        return -1;
+    }
+#if TOR_OPTIMISTIC_DATA
+    // The application is about to wait for input: queued CONNECT requests must be on the wire first
+    if (__atomic_load_n(&optimistic_unsent, __ATOMIC_ACQUIRE) != 0) {
+        socks5_optimistic_flush_all();
+    }
+#endif
+    if (__atomic_load_n(&async_pending, __ATOMIC_ACQUIRE) == 0) {
+        return real_epoll_pwait(epfd, events, maxevents, timeout, sigmask);
+    }
+    return socks5_async_epoll_wait(epfd, events, maxevents, timeout, sigmask);
+}
+
+#if __GLIBC_PREREQ(2, 35)
+/**
+ * @brief Torsocks' intercepted version of epoll_pwait2(); while handshakes are pending the timeout is
+ * rounded up to whole milliseconds.
+ */
+int epoll_pwait2(int epfd, struct epoll_event *events, int maxevents, const struct timespec *timeout,
+                 const sigset_t *sigmask) {
+    socks5_resolve_symbol((void **)&real_epoll_pwait2);
+    if (!real_epoll_pwait2) {
+        errno = EFAULT;
+        return -1;
+    }
+#if TOR_OPTIMISTIC_DATA
+    // The application is about to wait for input: queued CONNECT requests must be on the wire first
+    if (__atomic_load_n(&optimistic_unsent, __ATOMIC_ACQUIRE) != 0) {
+        socks5_optimistic_flush_all();
+    }
+#endif
+    if (__atomic_load_n(&async_pending, __ATOMIC_ACQUIRE) == 0) {
+        return real_epoll_pwait2(epfd, events, maxevents, timeout, sigmask);
+    }
+    return socks5_async_epoll_wait(epfd, events, maxevents, socks5_timespec_ms(timeout), sigmask);
+}
+#endif
+
+/**
+ * @brief Torsocks' intercepted version of getsockopt(): SO_ERROR reports a failed asynchronous handshake.
+ */
+int getsockopt(int sockfd, int level, int optname, void *optval, socklen_t *optlen) {
+    struct socks5_fd_slot *slot;
+
+    socks5_resolve_symbol((void **)&real_getsockopt);
+    if (!real_getsockopt) {
+        errno = EFAULT;
+        return -1;
+    }
+    if (level == SOL_SOCKET && optname == SO_ERROR && optval && optlen && *optlen >= sizeof(int) &&
+        (slot = socks5_fd_slot(sockfd, 0)) && __atomic_load_n(&slot->in_use, __ATOMIC_ACQUIRE)) {
+        int error;
+
+        pthread_mutex_lock(&slot->lock);
+        error = slot->error;
+        slot->error = 0;
+        pthread_mutex_unlock(&slot->lock);
+        if (error) {
+            *(int *)optval = error;
+            *optlen = sizeof(int);
+            return 0;
+        }
+    }
+    return real_getsockopt(sockfd, level, optname, optval, optlen);
+}
+
+/**
+ * @brief Torsocks' intercepted version of close(): forgets everything the shim knew about the fd.
+ */
+int close(int fd) {
+    socks5_resolve_symbol((void **)&real_close);
+    if (!real_close) {
+        errno = EFAULT;
+        return -1;
+    }
+    socks5_fd_clear(fd);
+    return real_close(fd);
+}
+
+/**
+ * @brief Torsocks' intercepted version of send(): optimistic data rides along with a queued CONNECT.
+ */
+ssize_t send(int sockfd, const void *buf, size_t len, int flags) {
+    ssize_t n;
+
+    socks5_resolve_symbol((void **)&real_send);
+    if (!real_send) {
+        errno = EFAULT;
+        return -1;
+    }
+#if TOR_OPTIMISTIC_DATA
+    if (__atomic_load_n(&optimistic_pending, __ATOMIC_ACQUIRE) != 0) {
+        n = socks5_optimistic_send(sockfd, buf, len, flags, 0);
+        socks5_metrics_io(sockfd, n, SOCKS5_METRICS_SENT);
+        return n;
+    }
+#endif
+    n = real_send(sockfd, buf, len, flags);
+    socks5_metrics_io(sockfd, n, SOCKS5_METRICS_SENT);
+    return n;
+}
+
+/**
+ * @brief Torsocks' intercepted version of write().
+ */
+ssize_t write(int fd, const void *buf, size_t count) {
+    ssize_t n;
+
+    socks5_resolve_symbol((void **)&real_write);
+    if (!real_write) {
+        errno = EFAULT;
+        return -1;
+    }
+#if TOR_OPTIMISTIC_DATA
+    if (__atomic_load_n(&optimistic_pending, __ATOMIC_ACQUIRE) != 0) {
+        n = socks5_optimistic_send(fd, buf, count, 0, 1);
+        socks5_metrics_io(fd, n, SOCKS5_METRICS_SENT);
+        return n;
+    }
+#endif
+    n = real_write(fd, buf, count);
+    socks5_metrics_io(fd, n, SOCKS5_METRICS_SENT);
+    return n;
+}
+
+/**
+ * @brief Torsocks' intercepted version of recv(): the pending SOCKS reply is consumed first.
+ */
+ssize_t recv(int sockfd, void *buf, size_t len, int flags) {
+    ssize_t n;
+
+    socks5_resolve_symbol((void **)&real_recv);
+    if (!real_recv) {
+        errno = EFAULT;
+        return -1;
+    }
+#if TOR_OPTIMISTIC_DATA
+    if (__atomic_load_n(&optimistic_pending, __ATOMIC_ACQUIRE) != 0 && socks5_optimistic_settle(sockfd, flags) < 0) {
+        return -1;
+    }
+#endif
+    n = real_recv(sockfd, buf, len, flags);
+    socks5_metrics_io(sockfd, n, SOCKS5_METRICS_RECEIVED);
+    return n;
+}
+
+/**
+ * @brief Torsocks' intercepted version of read().
+ */
+ssize_t read(int fd, void *buf, size_t count) {
+    ssize_t n;
+
+    socks5_resolve_symbol((void **)&real_read);
+    if (!real_read) {
+        errno = EFAULT;
+        return -1;
+    }
+#if TOR_OPTIMISTIC_DATA
+    if (__atomic_load_n(&optimistic_pending, __ATOMIC_ACQUIRE) != 0 && socks5_optimistic_settle(fd, 0) < 0) {
+        return -1;
+    }
+#endif
+    n = real_read(fd, buf, count);
+    socks5_metrics_io(fd, n, SOCKS5_METRICS_RECEIVED);
+    return n;
+}
+
+/**
+ * @brief Torsocks' intercepted version of sendmsg().
+ */
+ssize_t sendmsg(int sockfd, const struct msghdr *msg, int flags) {
+    ssize_t n;
+
+    socks5_resolve_symbol((void **)&real_sendmsg);
+    if (!real_sendmsg) {
+        errno = EFAULT;
+        return -1;
+    }
+#if TOR_OPTIMISTIC_DATA
+    if (__atomic_load_n(&optimistic_pending, __ATOMIC_ACQUIRE) != 0 && socks5_optimistic_push(sockfd, flags) < 0) {
+        return -1;
+    }
+#endif
+    n = real_sendmsg(sockfd, msg, flags);
+    socks5_metrics_io(sockfd, n, SOCKS5_METRICS_SENT);
+    return n;
+}
+
+/**
+ * @brief Torsocks' intercepted version of writev().
+ */
+ssize_t writev(int fd, const struct iovec *iov, int iovcnt) {
+    ssize_t n;
+
+    socks5_resolve_symbol((void **)&real_writev);
+    if (!real_writev) {
+        errno = EFAULT;
+        return -1;
+    }
+#if TOR_OPTIMISTIC_DATA
+    if (__atomic_load_n(&optimistic_pending, __ATOMIC_ACQUIRE) != 0 && socks5_optimistic_push(fd, 0) < 0) {
+        return -1;
+    }
+#endif
+    n = real_writev(fd, iov, iovcnt);
+    socks5_metrics_io(fd, n, SOCKS5_METRICS_SENT);
+    return n;
+}
+
+/**
+ * @brief Torsocks' intercepted version of sendto().
+ */
+ssize_t sendto(int sockfd, const void *buf, size_t len, int flags, const struct sockaddr *dest_addr, socklen_t addrlen) {
+    ssize_t n;
+
+    socks5_resolve_symbol((void **)&real_sendto);
+    if (!real_sendto) {
+        errno = EFAULT;
+        return -1;
+    }
+#if TOR_OPTIMISTIC_DATA
+    if (__atomic_load_n(&optimistic_pending, __ATOMIC_ACQUIRE) != 0 && socks5_optimistic_push(sockfd, flags) < 0) {
+        return -1;
+    }
+#endif
+    n = real_sendto(sockfd, buf, len, flags, dest_addr, addrlen);
+    socks5_metrics_io(sockfd, n, SOCKS5_METRICS_SENT);
+    return n;
+}
+
+/**
+ * @brief Torsocks' intercepted version of recvmsg(): the pending SOCKS reply is consumed first.
+ */
+ssize_t recvmsg(int sockfd, struct msghdr *msg, int flags) {
+    ssize_t n;
+
+    socks5_resolve_symbol((void **)&real_recvmsg);
+    if (!real_recvmsg) {
+        errno = EFAULT;
+        return -1;
+    }
+#if TOR_OPTIMISTIC_DATA
+    if (__atomic_load_n(&optimistic_pending, __ATOMIC_ACQUIRE) != 0 && socks5_optimistic_settle(sockfd, flags) < 0) {
+        return -1;
+    }
+#endif
+    n = real_recvmsg(sockfd, msg, flags);
+    socks5_metrics_io(sockfd, n, SOCKS5_METRICS_RECEIVED);
+    return n;
+}
+
+/**
+ * @brief Torsocks' intercepted version of readv().
+ */
+ssize_t readv(int fd, const struct iovec *iov, int iovcnt) {
+    ssize_t n;
+
+    socks5_resolve_symbol((void **)&real_readv);
+    if (!real_readv) {
+        errno = EFAULT;
+        return -1;
+    }
+#if TOR_OPTIMISTIC_DATA
+    if (__atomic_load_n(&optimistic_pending, __ATOMIC_ACQUIRE) != 0 && socks5_optimistic_settle(fd, 0) < 0) {
+        return -1;
+    }
+#endif
+    n = real_readv(fd, iov, iovcnt);
+    socks5_metrics_io(fd, n, SOCKS5_METRICS_RECEIVED);
+    return n;
+}
+
+/**
+ * @brief Torsocks' intercepted version of recvfrom().
+ */
+ssize_t recvfrom(int sockfd, void *buf, size_t len, int flags, struct sockaddr *src_addr, socklen_t *addrlen) {
+    ssize_t n;
+
+    socks5_resolve_symbol((void **)&real_recvfrom);
+    if (!real_recvfrom) {
+        errno = EFAULT;
+        return -1;
+    }
+#if TOR_OPTIMISTIC_DATA
+    if (__atomic_load_n(&optimistic_pending, __ATOMIC_ACQUIRE) != 0 && socks5_optimistic_settle(sockfd, flags) < 0) {
+        return -1;
+    }
+#endif
+    n = real_recvfrom(sockfd, buf, len, flags, src_addr, addrlen);
+    socks5_metrics_io(sockfd, n, SOCKS5_METRICS_RECEIVED);
+    return n;
+}
+
+/**
+ * @brief Torsocks' intercepted version of getpeername(): a proxied socket reports its real target, not Tor.
+ */
+int getpeername(int sockfd, struct sockaddr *addr, socklen_t *addrlen) {
+    struct socks5_fd_slot *slot;
+
+    socks5_resolve_symbol((void **)&real_getpeername);
+    if (!real_getpeername) {
+        errno = EFAULT;
+        return -1;
+    }
+    slot = socks5_fd_slot(sockfd, 0);
+    if (slot && __atomic_load_n(&slot->phase, __ATOMIC_ACQUIRE) != SOCKS5_FD_UNUSED && addr && addrlen) {
+        int result = 1;
+
+        pthread_mutex_lock(&slot->lock);
+        if (slot->target && slot->phase != SOCKS5_FD_ESTABLISHED) {
+            errno = ENOTCONN;
+            result = -1;
+        } else if (slot->target) {
+            memcpy(addr, &slot->target->addr, *addrlen < slot->target->addr_len ? *addrlen : slot->target->addr_len);
+            *addrlen = slot->target->addr_len;
+            result = 0;
+        }
+        pthread_mutex_unlock(&slot->lock);
+        if (result <= 0) {
+            return result;
+        }
+    }
+    return real_getpeername(sockfd, addr, addrlen);
+}
+
+/**
+ * @brief Torsocks' intercepted version of dup(): the copy shares the proxied target.
+ */
+int dup(int oldfd) {
+    int newfd;
+
+    socks5_resolve_symbol((void **)&real_dup);
+    if (!real_dup) {
+        errno = EFAULT;
+        return -1;
+    }
+    newfd = real_dup(oldfd);
+    if (newfd >= 0) {
+        socks5_fd_clear(newfd);
+        socks5_fd_copy(oldfd, newfd);
+    }
+    return newfd;
+}
+
+/**
+ * @brief Torsocks' intercepted version of dup2(): newfd is closed first, so its state goes too.
+ */
+int dup2(int oldfd, int newfd) {
+    int result;
+
+    socks5_resolve_symbol((void **)&real_dup2);
+    if (!real_dup2) {
+        errno = EFAULT;
+        return -1;
+    }
+    if (oldfd == newfd) {
+        return real_dup2(oldfd, newfd);
+    }
+    result = real_dup2(oldfd, newfd);
+    if (result >= 0) {
+        socks5_fd_clear(newfd);
+        socks5_fd_copy(oldfd, newfd);
+    }
+    return result;
+}
+
+/**
+ * @brief Torsocks' intercepted version of dup3(): like dup2(), newfd's state goes and the copy shares the target.
+ */
+int dup3(int oldfd, int newfd, int flags) {
+    int result;
+
+    socks5_resolve_symbol((void **)&real_dup3);
+    if (!real_dup3) {
+        errno = EFAULT;
+        return -1;
+    }
+    result = real_dup3(oldfd, newfd, flags);
+    if (result >= 0) {
+        socks5_fd_clear(newfd);
+        socks5_fd_copy(oldfd, newfd);
+    }
+    return result;
+}
+
+/**
+ * @brief Follows an fd duplicated by fcntl(F_DUPFD / F_DUPFD_CLOEXEC) into the per-fd table.
+ */
+static int socks5_fcntl_dup(int fd, int cmd, int result) {
+    if (result >= 0 && (cmd == F_DUPFD || cmd == F_DUPFD_CLOEXEC)) {
+        socks5_fd_clear(result);
+        socks5_fd_copy(fd, result);
+    }
+    return result;
+}
+
+/**
+ * @brief Torsocks' intercepted version of fcntl(): F_DUPFD copies share the proxied target like dup().
+ */
+int fcntl(int fd, int cmd, ...) {
+    va_list ap;
+    void *arg;
+
+    // Every fcntl() argument is an int or a pointer; like glibc, pass it on as a pointer-sized word
+    va_start(ap, cmd);
+    arg = va_arg(ap, void *);
+    va_end(ap);
+    socks5_resolve_symbol((void **)&real_fcntl);
+    if (!real_fcntl) {
+        errno = EFAULT;
+        return -1;
+    }
+    return socks5_fcntl_dup(fd, cmd, real_fcntl(fd, cmd, arg));
+}
+
+#if __GLIBC_PREREQ(2, 28)
+/**
+ * @brief Torsocks' intercepted version of fcntl64(), which fcntl() becomes with _FILE_OFFSET_BITS=64.
+ */
+int fcntl64(int fd, int cmd, ...) {
+    va_list ap;
+    void *arg;
+
+    va_start(ap, cmd);
+    arg = va_arg(ap, void *);
+    va_end(ap);
+    socks5_resolve_symbol((void **)&real_fcntl64);
+    if (!real_fcntl64) {
+        errno = EFAULT;
+        return -1;
+    }
+    return socks5_fcntl_dup(fd, cmd, real_fcntl64(fd, cmd, arg));
+}
+#endif
+
+#endif // TORSOCKS_WRAPPER_H
\ No newline at end of file
@@ -0,0 +1,373 @@
+// TraceDecode: per-phase latency histograms from the connect traces the wrappers record with TOR_TRACE
+// (see "Connect tracing" in TorsocksWrapper.h). Each traced process writes "<TraceFile>.<pid>";
+// the files can be read while the process is still running.
+//     gcc -O2 -Wall -o TraceDecode TraceDecode.c
+//     ./TraceDecode /tmp/torsocks-trace.*
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// --- Trace file layout: keep in sync with the wrappers ---
+#define SOCKS5_TRACE_MAGIC "TSTRACE1"
+#define SOCKS5_TRACE_PROXY 0
+#define SOCKS5_TRACE_GREETING 1
+#define SOCKS5_TRACE_REPLY 2
+#define SOCKS5_TRACE_PHASES 3
+
+#define SOCKS5_TRACE_ASYNC 0x01
+#define SOCKS5_TRACE_POOLED 0x02
+#define SOCKS5_TRACE_HEDGED 0x04
+#define SOCKS5_TRACE_OPTIMISTIC 0x08
+#define SOCKS5_TRACE_NEGATIVE 0x10
+#define SOCKS5_TRACE_BREAKER 0x20
+#define SOCKS5_TRACE_PATHS 0x40
+
+struct socks5_trace_record {
+    uint64_t start_ns;
+    uint32_t phase_us[SOCKS5_TRACE_PHASES];
+    uint32_t total_us;
+    int32_t error;
+    uint16_t family;
+    uint16_t port;
+    uint8_t addr[16];
+    uint8_t shard;
+    uint8_t reply;
+    uint16_t flags;
+    uint8_t reserved[12];
+};
+
+struct socks5_trace_header {
+    char magic[8];
+    uint32_t record_size;
+    uint32_t ring_records;
+    uint32_t rings;
+    uint32_t pid;
+    uint8_t reserved[40];
+};
+
+struct socks5_trace_ring {
+    uint64_t head;
+    uint32_t tid;
+    uint8_t reserved[52];
+    // ring_records records follow
+};
+
+// --- Statistics ---
+#define HIST_BUCKETS 32 // Power-of-two microsecond buckets: [0, 1), [1, 2), [2, 4) ... up to 35 minutes
+#define SHARD_MAX 256
+
+enum metric {
+    METRIC_PROXY,    // connect() to the proxy TCP connect completing
+    METRIC_GREETING, // proxy connected to the method reply
+    METRIC_REPLY,    // method reply (or proxy connect, pooled: connect()) to the CONNECT reply
+    METRIC_TOTAL,    // connect() to the socket being usable or the failure being returned
+    METRIC_COUNT
+};
+
+static const char *metric_names[METRIC_COUNT] = {
+    "proxy TCP connect", "method reply", "CONNECT reply", "total"
+};
+
+struct series {
+    uint32_t *values;
+    size_t count, capacity;
+};
+
+static struct series metrics[METRIC_COUNT];
+static struct series shard_total[SHARD_MAX];
+static unsigned long shard_failed[SHARD_MAX];
+static unsigned long reply_counts[256];
+static unsigned long path_counts[SOCKS5_TRACE_PATHS];
+static unsigned long records_total = 0;
+static unsigned long records_failed = 0;
+
+struct error_count {
+    int error;
+    unsigned long count;
+};
+static struct error_count errors[64];
+static size_t error_kinds = 0;
+
+static void series_add(struct series *series, uint32_t value) {
+    if (series->count == series->capacity) {
+        series->capacity = series->capacity ? series->capacity * 2 : 1024;
+        series->values = realloc(series->values, series->capacity * sizeof(*series->values));
+        if (!series->values) {
+            fprintf(stderr, "TraceDecode: out of memory.\n");
+            exit(1);
+        }
+    }
+    series->values[series->count++] = value;
+}
+
+static int compare_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * @brief The value below which the given fraction of a sorted series lies.
+ */
+static uint32_t series_percentile(const struct series *series, double fraction) {
+    size_t index = (size_t)(fraction * (double)(series->count - 1) + 0.5);
+    return series->values[index];
+}
+
+/**
+ * @brief Adds one finished connect to the statistics.
+ */
+static void record_add(const struct socks5_trace_record *rec) {
+    uint32_t proxy = rec->phase_us[SOCKS5_TRACE_PROXY];
+    uint32_t greeting = rec->phase_us[SOCKS5_TRACE_GREETING];
+    uint32_t reply = rec->phase_us[SOCKS5_TRACE_REPLY];
+    uint32_t before_reply = greeting ? greeting : proxy;
+    size_t i;
+
+    records_total++;
+    if (proxy) {
+        series_add(&metrics[METRIC_PROXY], proxy);
+    }
+    if (greeting && greeting >= proxy) {
+        series_add(&metrics[METRIC_GREETING], greeting - proxy);
+    }
+    if (reply && reply >= before_reply) {
+        series_add(&metrics[METRIC_REPLY], reply - before_reply);
+    }
+    series_add(&metrics[METRIC_TOTAL], rec->total_us);
+    series_add(&shard_total[rec->shard], rec->total_us);
+    reply_counts[rec->reply]++;
+    path_counts[rec->flags & (SOCKS5_TRACE_PATHS - 1)]++;
+    if (rec->error == 0) {
+        return;
+    }
+    records_failed++;
+    shard_failed[rec->shard]++;
+    for (i = 0; i < error_kinds && errors[i].error != rec->error; i++) {
+    }
+    if (i < sizeof(errors) / sizeof(errors[0])) {
+        errors[i].error = rec->error;
+        errors[i].count++;
+        if (i == error_kinds) {
+            error_kinds++;
+        }
+    }
+}
+
+/**
+ * @brief Reads every ring of one trace file.
+ * @return 0 on success, -1 if the file is not a trace file.
+ */
+static int decode_file(const char *path) {
+    const struct socks5_trace_header *header;
+    struct stat st;
+    unsigned long before = records_total;
+    unsigned int rings_used = 0;
+    size_t ring_size;
+    uint32_t i;
+    void *map;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "TraceDecode: %s: %s\n", path, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    if ((size_t)st.st_size < sizeof(*header)) {
+        fprintf(stderr, "TraceDecode: %s: not a trace file\n", path);
+        close(fd);
+        return -1;
+    }
+    map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "TraceDecode: %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    // 1. The header must match this decoder's record layout
+    header = map;
+    ring_size = sizeof(struct socks5_trace_ring) + (size_t)header->ring_records * sizeof(struct socks5_trace_record);
+    if (memcmp(header->magic, SOCKS5_TRACE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->record_size != sizeof(struct socks5_trace_record) ||
+        header->ring_records == 0 || (header->ring_records & (header->ring_records - 1)) != 0 ||
+        sizeof(*header) + (size_t)header->rings * ring_size > (size_t)st.st_size) {
+        fprintf(stderr, "TraceDecode: %s: not a trace file of this version\n", path);
+        munmap(map, (size_t)st.st_size);
+        return -1;
+    }
+
+    // 2. Each ring holds its last ring_records records; a live writer may be overwriting the oldest ones
+    for (i = 0; i < header->rings; i++) {
+        const char *base = (const char *)(header + 1) + (size_t)i * ring_size;
+        const struct socks5_trace_ring *ring = (const struct socks5_trace_ring *)base;
+        const struct socks5_trace_record *records = (const struct socks5_trace_record *)(ring + 1);
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t first = head > header->ring_records ? head - header->ring_records : 0;
+        uint64_t n;
+
+        if (head == 0) {
+            continue;
+        }
+        rings_used++;
+        // Skip the slot the writer may be filling right now
+        if (head - first == header->ring_records) {
+            first++;
+        }
+        for (n = first; n < head; n++) {
+            record_add(&records[n & (header->ring_records - 1)]);
+        }
+    }
+    printf("%s: pid %u, %lu records from %u threads\n", path, header->pid, records_total - before, rings_used);
+    munmap(map, (size_t)st.st_size);
+    return 0;
+}
+
+/**
+ * @brief Prints one latency distribution: percentiles, then a log2 histogram.
+ */
+static void print_histogram(const char *name, struct series *series) {
+    unsigned long buckets[HIST_BUCKETS];
+    unsigned long peak = 0;
+    int last = 0;
+    size_t i;
+    int b;
+
+    printf("\n%s: %zu samples", name, series->count);
+    if (series->count == 0) {
+        printf("\n");
+        return;
+    }
+    qsort(series->values, series->count, sizeof(*series->values), compare_u32);
+    printf(", p50 %u us, p90 %u us, p99 %u us, max %u us\n", series_percentile(series, 0.50),
+           series_percentile(series, 0.90), series_percentile(series, 0.99), series->values[series->count - 1]);
+
+    memset(buckets, 0, sizeof(buckets));
+    for (i = 0; i < series->count; i++) {
+        uint32_t value = series->values[i];
+        b = value ? 32 - __builtin_clz(value) : 0;
+        if (b >= HIST_BUCKETS) {
+            b = HIST_BUCKETS - 1;
+        }
+        buckets[b]++;
+    }
+    for (b = 0; b < HIST_BUCKETS; b++) {
+        if (buckets[b] > peak) {
+            peak = buckets[b];
+        }
+        if (buckets[b]) {
+            last = b;
+        }
+    }
+    for (b = 0; b <= last; b++) {
+        unsigned long low = b ? 1ul << (b - 1) : 0;
+        unsigned long high = 1ul << b;
+        int width = (int)(buckets[b] * 50 / peak);
+        if (buckets[b] == 0 && (b == 0 || buckets[b - 1] == 0)) {
+            continue;
+        }
+        printf("  %10lu - %-10lu us %8lu |%.*s\n", low, high, buckets[b], width,
+               "##################################################");
+    }
+}
+
+/**
+ * @brief SOCKS5 reply codes, including Tor's extended codes for onion services.
+ */
+static const char *reply_name(int code) {
+    switch (code) {
+    case 0x00: return "succeeded";
+    case 0x01: return "general failure";
+    case 0x02: return "not allowed by ruleset";
+    case 0x03: return "network unreachable";
+    case 0x04: return "host unreachable";
+    case 0x05: return "connection refused";
+    case 0x06: return "TTL expired";
+    case 0x07: return "command not supported";
+    case 0x08: return "address type not supported";
+    case 0xf0: return "onion service descriptor not found";
+    case 0xf1: return "onion service descriptor invalid";
+    case 0xf2: return "onion service introduction failed";
+    case 0xf3: return "onion service rendezvous failed";
+    case 0xf4: return "onion service client authorization missing";
+    case 0xf5: return "onion service client authorization wrong";
+    case 0xf6: return "invalid onion service address";
+    case 0xf7: return "onion service introduction timed out";
+    case 0xff: return "no reply";
+    }
+    return "unknown";
+}
+
+int main(int argc, char **argv) {
+    int decoded = 0;
+    int i;
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <trace file>...\n", argv[0]);
+        return 2;
+    }
+    for (i = 1; i < argc; i++) {
+        if (decode_file(argv[i]) == 0) {
+            decoded++;
+        }
+    }
+    if (decoded == 0) {
+        return 1;
+    }
+    printf("\n%lu connects, %lu failed\n", records_total, records_failed);
+    if (records_total == 0) {
+        return 0;
+    }
+
+    // 1. Where the time goes, phase by phase
+    for (i = 0; i < METRIC_COUNT; i++) {
+        print_histogram(metric_names[i], &metrics[i]);
+    }
+
+    // 2. How each connect went
+    printf("\npaths:\n");
+    for (i = 0; i < SOCKS5_TRACE_PATHS; i++) {
+        if (path_counts[i]) {
+            printf("  %-9s%-7s%-7s%-11s%-7s%-5s %8lu\n", (i & SOCKS5_TRACE_ASYNC) ? "async" : "blocking",
+                   (i & SOCKS5_TRACE_POOLED) ? "pooled" : "", (i & SOCKS5_TRACE_HEDGED) ? "hedged" : "",
+                   (i & SOCKS5_TRACE_OPTIMISTIC) ? "optimistic" : "", (i & SOCKS5_TRACE_NEGATIVE) ? "cached" : "",
+                   (i & SOCKS5_TRACE_BREAKER) ? "down" : "", path_counts[i]);
+        }
+    }
+    printf("\nreply codes:\n");
+    for (i = 0; i < 256; i++) {
+        if (reply_counts[i]) {
+            printf("  0x%02x %-44s %8lu\n", i, reply_name(i), reply_counts[i]);
+        }
+    }
+    if (error_kinds) {
+        size_t e;
+        printf("\nerrors returned:\n");
+        for (e = 0; e < error_kinds; e++) {
+            printf("  %-44s %8lu\n", strerror(errors[e].error), errors[e].count);
+        }
+    }
+
+    // 3. Per SocksPort shard, in the order of the wrapper's SocksPorts list
+    printf("\nSocksPort shards:\n");
+    for (i = 0; i < SHARD_MAX; i++) {
+        struct series *series = &shard_total[i];
+        if (series->count == 0) {
+            continue;
+        }
+        qsort(series->values, series->count, sizeof(*series->values), compare_u32);
+        printf("  shard %-3d %8zu connects %6lu failed  total p50 %u us, p99 %u us\n", i, series->count,
+               shard_failed[i], series_percentile(series, 0.50), series_percentile(series, 0.99));
+    }
+    return 0;
+}
\ No newline at end of file